@@ -0,0 +1,1092 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "include/fs.h"
+#include "include/vdisk.h"
+#include "include/error.h"
+
+/*
+ * Micro-benchmarks for the virtual disk and the file system.
+ * Build with `make bench` and run `./fs_bench`.
+ */
+
+#define BENCH_DISK "bench_disk.img"
+#define BENCH_SECTORS 16384 // 16 MiB image
+
+// ==============================
+// Helpers
+// ==============================
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Create (or truncate) a zero-filled image of the given # of 1 KiB sectors
+static int make_image(const char *name, uint32_t sectors)
+{
+    // NB: fs.h shadows read()/write() from unistd.h, so stick to stdio here
+    FILE *fp = fopen(name, "wb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    int result = fseek(fp, (long)sectors * 1024 - 1, SEEK_SET);
+    if (result == 0)
+    {
+        result = (fputc(0, fp) == EOF) ? -1 : 0;
+    }
+    fclose(fp);
+    return result;
+}
+
+static const char *mode_name(int mode)
+{
+    switch (mode)
+    {
+    case VDISK_MODE_STDIO:
+        return "stdio";
+    case VDISK_MODE_PREAD:
+        return "pread";
+    case VDISK_MODE_MMAP:
+        return "mmap";
+    case VDISK_MODE_DIRECT:
+        return "direct";
+    default:
+        return "?";
+    }
+}
+
+static void print_bench_header(const char *bench_name)
+{
+    printf("\n===== BENCH: %s =====\n", bench_name);
+}
+
+static void print_bench_row(const char *label, int ops, double secs, uint64_t host_calls)
+{
+    printf("%-28s %8d ops %10.1f ns/op %6.2f host calls/op\n",
+           label, ops, secs * 1e9 / ops, (double)host_calls / ops);
+}
+
+// ==============================
+// Benchmarks
+// ==============================
+
+// Sector-level reads and writes, sequential and random, for each backend
+static void bench_sector_io(void)
+{
+    const int modes[] = {VDISK_MODE_STDIO, VDISK_MODE_PREAD, VDISK_MODE_MMAP, VDISK_MODE_DIRECT};
+    char label[64];
+
+    print_bench_header("Sector I/O");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        DISK disk;
+        if (vdisk_on_mode(BENCH_DISK, &disk, modes[m]) != 0)
+        {
+            printf("%s: unavailable\n", mode_name(modes[m]));
+            continue;
+        }
+
+        // Pool buffers are aligned, as O_DIRECT requires
+        uint8_t *buffer = vdisk_buf_get(&disk);
+        memset(buffer, 0xab, 1024);
+        disk.host_calls = 0;
+        double start = now_sec();
+        for (uint32_t s = 0; s < BENCH_SECTORS; s++)
+        {
+            vdisk_write(&disk, s, buffer);
+        }
+        snprintf(label, sizeof(label), "%s seq write", mode_name(modes[m]));
+        print_bench_row(label, BENCH_SECTORS, now_sec() - start, disk.host_calls);
+
+        disk.host_calls = 0;
+        start = now_sec();
+        for (uint32_t s = 0; s < BENCH_SECTORS; s++)
+        {
+            vdisk_read(&disk, s, buffer);
+        }
+        snprintf(label, sizeof(label), "%s seq read", mode_name(modes[m]));
+        print_bench_row(label, BENCH_SECTORS, now_sec() - start, disk.host_calls);
+
+        srand(42);
+        disk.host_calls = 0;
+        start = now_sec();
+        for (uint32_t i = 0; i < BENCH_SECTORS; i++)
+        {
+            vdisk_read(&disk, rand() % BENCH_SECTORS, buffer);
+        }
+        snprintf(label, sizeof(label), "%s random read", mode_name(modes[m]));
+        print_bench_row(label, BENCH_SECTORS, now_sec() - start, disk.host_calls);
+
+        vdisk_buf_put(&disk, buffer);
+        vdisk_off(&disk);
+    }
+}
+
+static const char *engine_name(int engine)
+{
+    switch (engine)
+    {
+    case VDISK_AIO_URING:
+        return "io_uring";
+    case VDISK_AIO_THREADS:
+        return "threads";
+    case VDISK_AIO_SYNC:
+        return "sync";
+    default:
+        return "?";
+    }
+}
+
+// Random sector reads through the async engines at several queue depths,
+// against the blocking one-at-a-time path
+static void bench_queue_depth(void)
+{
+    const int engines[] = {VDISK_AIO_URING, VDISK_AIO_THREADS};
+    const uint32_t depths[] = {1, 4, 16, 64};
+    const int ops = BENCH_SECTORS;
+    uint8_t *buffers = malloc(64 * 1024);
+    char label[64];
+
+    print_bench_header("Queue depth (random sector reads)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+
+    DISK disk;
+    if (vdisk_on_mode(BENCH_DISK, &disk, VDISK_MODE_PREAD) != 0)
+    {
+        printf("pread backend unavailable\n");
+        free(buffers);
+        return;
+    }
+
+    srand(42);
+    disk.host_calls = 0;
+    double start = now_sec();
+    for (int i = 0; i < ops; i++)
+    {
+        vdisk_read(&disk, rand() % BENCH_SECTORS, buffers);
+    }
+    print_bench_row("blocking qd=1", ops, now_sec() - start, disk.host_calls);
+
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+    {
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+        {
+            if (vdisk_aio_init(&disk, engines[e], depths[d]) != 0)
+            {
+                printf("%s: unavailable\n", engine_name(engines[e]));
+                break;
+            }
+
+            srand(42);
+            disk.host_calls = 0;
+            start = now_sec();
+            int submitted = 0;
+            int completed = 0;
+            vdisk_completion done[64];
+            while (completed < ops)
+            {
+                // Refill every free slot, then reap what has completed
+                while (submitted < ops &&
+                       vdisk_submit_read(&disk, rand() % BENCH_SECTORS,
+                                         buffers + (submitted % 64) * 1024, submitted) == 0)
+                {
+                    submitted++;
+                }
+                int n = vdisk_complete(&disk, done, 64, 1);
+                if (n < 0)
+                {
+                    break;
+                }
+                completed += n;
+            }
+            snprintf(label, sizeof(label), "%s qd=%u", engine_name(engines[e]), depths[d]);
+            print_bench_row(label, ops, now_sec() - start, disk.host_calls);
+        }
+    }
+
+    vdisk_off(&disk);
+    free(buffers);
+}
+
+// Read-heavy file system workload: stat every file, then read them back
+static void bench_fs_read(void)
+{
+    const int modes[] = {VDISK_MODE_STDIO, VDISK_MODE_PREAD, VDISK_MODE_MMAP, VDISK_MODE_DIRECT};
+    const int num_files = 16;
+    const int file_size = 512 * 1024;
+    uint8_t *data = calloc(file_size, 1);
+    char label[64];
+
+    print_bench_header("File system reads");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 64);
+    mount(BENCH_DISK);
+    for (int i = 0; i < num_files; i++)
+    {
+        write(create(), data, file_size, 0);
+    }
+    unmount();
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        vdisk_set_default_mode(modes[m]);
+        if (mount(BENCH_DISK) != 0)
+        {
+            printf("%s: unavailable\n", mode_name(modes[m]));
+            continue;
+        }
+
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        for (int round = 0; round < 1000; round++)
+        {
+            for (int i = 0; i < num_files; i++)
+            {
+                stat(i);
+            }
+        }
+        fs_get_stats(&stats);
+        snprintf(label, sizeof(label), "%s stat", mode_name(modes[m]));
+        print_bench_row(label, 1000 * num_files, now_sec() - start, stats.host_calls);
+
+        fs_reset_stats();
+        start = now_sec();
+        for (int i = 0; i < num_files; i++)
+        {
+            read(i, data, file_size, 0);
+        }
+        fs_get_stats(&stats);
+        snprintf(label, sizeof(label), "%s read (per KiB)", mode_name(modes[m]));
+        print_bench_row(label, num_files * file_size / 1024, now_sec() - start, stats.host_calls);
+
+        unmount();
+    }
+
+    vdisk_set_default_mode(VDISK_MODE_PREAD);
+    free(data);
+}
+
+// Random small reads across a file deep in the double indirect range, with
+// cold then warm block maps (no block cache, so every pointer lookup is I/O)
+static void bench_block_map(void)
+{
+    const int file_size = 8 * 1024 * 1024;
+    const int chunk = 1024;
+    const int reads = 4096;
+    uint8_t *data = calloc(file_size, 1);
+    const char *labels[] = {"cold block map", "warm block map"};
+
+    print_bench_header("Block map (1 KiB random reads)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 32);
+    mount(BENCH_DISK);
+    write(create(), data, file_size, 0);
+    unmount();
+
+    fs_set_cache_size(0);
+    fs_set_readahead(0);
+    mount(BENCH_DISK);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        srand(42);
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        for (int i = 0; i < reads; i++)
+        {
+            read(0, data, chunk, (rand() % (file_size / chunk)) * chunk);
+        }
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(labels[pass], reads, secs, stats.host_calls);
+    }
+    unmount();
+
+    fs_set_cache_size(1024 * 1024);
+    fs_set_readahead(256 * 1024);
+    free(data);
+}
+
+// Allocation latency at a given volume fullness: each op creates a file,
+// writes one block to it (one allocation) and deletes it again, so the
+// fullness stays put. The used blocks are all below the free ones, the
+// worst case for a first-available search
+static void bench_allocation(void)
+{
+    const double fullness[] = {0.10, 0.90, 0.999};
+    const uint32_t sectors = 256 * 1024; // 256 MiB image, 1 KiB blocks
+    const int max_file = 32 * 1024 * 1024;
+    const int chunk = 1024 * 1024;
+    const int ops = 20000;
+    uint8_t *data = calloc(chunk, 1);
+    char label[64];
+
+    print_bench_header("Block allocation (create + 1 KiB write + delete)");
+    for (size_t f = 0; f < sizeof(fullness) / sizeof(fullness[0]); f++)
+    {
+        make_image(BENCH_DISK, sectors);
+        format(BENCH_DISK, 64);
+        mount(BENCH_DISK);
+
+        // Fill up with files of up to 32 MiB (plus their indirect blocks)
+        long long fill = (long long)(sectors * fullness[f]) * 1024;
+        while (fill > 0)
+        {
+            int inode = create();
+            for (int offset = 0; offset < max_file && fill > 0; offset += chunk)
+            {
+                int len = fill < chunk ? (int)fill : chunk;
+                write(inode, data, len, offset);
+                fill -= len;
+            }
+        }
+
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        for (int i = 0; i < ops; i++)
+        {
+            int inode = create();
+            write(inode, data, 1024, 0);
+            delete(inode);
+        }
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        snprintf(label, sizeof(label), "%.1f%% full", fullness[f] * 100);
+        print_bench_row(label, ops, secs, stats.host_calls);
+
+        unmount();
+    }
+
+    free(data);
+}
+
+// Files created and deleted one call at a time vs. in batches, with and
+// without the block cache
+static void bench_create_delete(void)
+{
+    const int num_files = 4096;
+    const int rounds = 10;
+    int *inodes = malloc(num_files * sizeof(int));
+    char label[64];
+
+    print_bench_header("Create + delete (4096 empty files)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, num_files);
+    for (int cached = 0; cached < 2; cached++)
+    {
+        fs_set_cache_size(cached ? 1024 * 1024 : 0);
+        mount(BENCH_DISK);
+        for (int batched = 0; batched < 2; batched++)
+        {
+            fs_stats_t stats;
+            double create_secs = 0;
+            double delete_secs = 0;
+            uint64_t create_calls = 0;
+            uint64_t delete_calls = 0;
+            for (int r = 0; r < rounds; r++)
+            {
+                fs_reset_stats();
+                double start = now_sec();
+                if (batched)
+                {
+                    create_many(num_files, inodes);
+                }
+                else
+                {
+                    for (int i = 0; i < num_files; i++)
+                    {
+                        inodes[i] = create();
+                    }
+                }
+                create_secs += now_sec() - start;
+                fs_get_stats(&stats);
+                create_calls += stats.host_calls;
+
+                fs_reset_stats();
+                start = now_sec();
+                if (batched)
+                {
+                    delete_many(inodes, num_files);
+                }
+                else
+                {
+                    for (int i = 0; i < num_files; i++)
+                    {
+                        delete(inodes[i]);
+                    }
+                }
+                delete_secs += now_sec() - start;
+                fs_get_stats(&stats);
+                delete_calls += stats.host_calls;
+            }
+            snprintf(label, sizeof(label), "%s, %s", batched ? "create_many" : "create", cached ? "cache" : "no cache");
+            print_bench_row(label, rounds * num_files, create_secs, create_calls);
+            snprintf(label, sizeof(label), "%s, %s", batched ? "delete_many" : "delete", cached ? "cache" : "no cache");
+            print_bench_row(label, rounds * num_files, delete_secs, delete_calls);
+        }
+        unmount();
+    }
+
+    fs_set_cache_size(1024 * 1024);
+    free(inodes);
+}
+
+// Callback of bench_inventory(): adds up the sizes of the files
+static void add_size(const fs_stat_t *file, void *arg)
+{
+    *(long long *)arg += file->size;
+}
+
+// Inventory of a volume: stat() of every inode # vs. one stat_all(), with
+// no block cache
+static void bench_inventory(void)
+{
+    const int num_inodes = 16384; // 512 inode blocks
+    const int rounds = 10;
+    uint8_t data[1024] = {0};
+    long long total = 0;
+
+    print_bench_header("Inventory (16384 inodes, 1 in 4 used)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, num_inodes);
+    mount(BENCH_DISK);
+    for (int i = 0; i < num_inodes; i++)
+    {
+        int inode = create();
+        if (i % 4 != 0)
+        {
+            delete(inode);
+        }
+        else
+        {
+            write(inode, data, sizeof(data), 0);
+        }
+    }
+    unmount();
+
+    fs_set_cache_size(0);
+    fs_set_readahead(0);
+    mount(BENCH_DISK);
+    fs_stats_t stats;
+    fs_reset_stats();
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < num_inodes; i++)
+        {
+            int size = stat(i);
+            total += (size > 0) ? size : 0;
+        }
+    }
+    double secs = now_sec() - start;
+    fs_get_stats(&stats);
+    print_bench_row("stat() per inode", rounds, secs, stats.host_calls);
+
+    fs_reset_stats();
+    start = now_sec();
+    for (int r = 0; r < rounds; r++)
+    {
+        stat_all(add_size, &total);
+    }
+    secs = now_sec() - start;
+    fs_get_stats(&stats);
+    print_bench_row("stat_all()", rounds, secs, stats.host_calls);
+    unmount();
+
+    fs_set_cache_size(1024 * 1024);
+    fs_set_readahead(256 * 1024);
+}
+
+// Small appends to a file, with inodes written through on every size change
+// vs. written back lazily, with no block cache
+static void bench_appends(void)
+{
+    const int appends = 20000;
+    uint8_t data[100] = {0};
+    const char *labels[] = {"write-through inodes", "write-back inodes"};
+    const uint32_t limits[] = {0, 64};
+
+    print_bench_header("Appends (100 bytes each)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 64);
+    fs_set_cache_size(0);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        fs_set_inode_dirty_limit(limits[pass]);
+        mount(BENCH_DISK);
+        int inode = create();
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        for (int i = 0; i < appends; i++)
+        {
+            write(inode, data, sizeof(data), i * (int)sizeof(data));
+        }
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(labels[pass], appends, secs, stats.host_calls);
+        delete(inode);
+        unmount();
+    }
+
+    fs_set_inode_dirty_limit(64);
+    fs_set_cache_size(1024 * 1024);
+}
+
+// A file with a 60 MiB hole: the write past the end, then exporting it with
+// plain reads of the whole file vs. reads of its data only (seek())
+static void bench_sparse(void)
+{
+    const int far = 60 * 1024 * 1024;
+    const int chunk = 64 * 1024;
+    const int rounds = 10;
+    uint8_t *data = calloc(chunk, 1);
+
+    print_bench_header("Sparse file (10 bytes after a 60 MiB hole)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 64);
+    mount(BENCH_DISK);
+    fs_stats_t stats;
+    fs_reset_stats();
+    double start = now_sec();
+    int inode = create();
+    write(inode, data, 10, far);
+    double secs = now_sec() - start;
+    fs_get_stats(&stats);
+    print_bench_row("write past the hole", 1, secs, stats.host_calls);
+
+    fs_reset_stats();
+    start = now_sec();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int offset = 0; offset < far + 10; offset += chunk)
+        {
+            read(inode, data, chunk, offset);
+        }
+    }
+    secs = now_sec() - start;
+    fs_get_stats(&stats);
+    print_bench_row("export, read() everything", rounds, secs, stats.host_calls);
+
+    fs_reset_stats();
+    start = now_sec();
+    for (int r = 0; r < rounds; r++)
+    {
+        int offset = seek(inode, 0, FS_SEEK_DATA);
+        while (offset >= 0)
+        {
+            int end = seek(inode, offset, FS_SEEK_HOLE);
+            for (; offset < end; offset += chunk)
+            {
+                read(inode, data, (end - offset < chunk) ? end - offset : chunk, offset);
+            }
+            offset = (end < far + 10) ? seek(inode, end, FS_SEEK_DATA) : -1;
+        }
+    }
+    secs = now_sec() - start;
+    fs_get_stats(&stats);
+    print_bench_row("export, seek() to data", rounds, secs, stats.host_calls);
+    unmount();
+
+    free(data);
+}
+
+// Lowest free block vs goal-based allocation: two 4 MiB files written 4 KiB
+// at a time in turn, then each read back sequentially from a cold mount (no
+// block cache, no readahead), 64 KiB per request
+static void bench_interleaved(void)
+{
+    const int file_size = 4 * 1024 * 1024;
+    const int piece = 4 * 1024;
+    const int chunk = 64 * 1024;
+    const int policies[] = {FS_ALLOC_LOWEST, FS_ALLOC_GOAL};
+    const char *write_labels[] = {"lowest free, write", "goal, write"};
+    const char *read_labels[] = {"lowest free, cold read", "goal, cold read"};
+    uint8_t *data = calloc(chunk, 1);
+
+    print_bench_header("Interleaved writers (2 x 4 MiB, 4 KiB writes)");
+    for (int p = 0; p < 2; p++)
+    {
+        fs_set_allocation(policies[p]);
+        make_image(BENCH_DISK, BENCH_SECTORS);
+        format(BENCH_DISK, 32);
+        mount(BENCH_DISK);
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        int first = create();
+        int second = create();
+        for (int offset = 0; offset < file_size; offset += piece)
+        {
+            write(first, data, piece, offset);
+            write(second, data, piece, offset);
+        }
+        fs_sync();
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(write_labels[p], 2 * file_size / piece, secs, stats.host_calls);
+        unmount();
+
+        fs_set_cache_size(0);
+        fs_set_readahead(0);
+        mount(BENCH_DISK);
+        fs_reset_stats();
+        start = now_sec();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(first, data, chunk, offset);
+        }
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(second, data, chunk, offset);
+        }
+        secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(read_labels[p], 2 * file_size / chunk, secs, stats.host_calls);
+        unmount();
+        fs_set_cache_size(1024 * 1024);
+        fs_set_readahead(256 * 1024);
+    }
+    fs_set_allocation(FS_ALLOC_LOWEST);
+
+    free(data);
+}
+
+// fallocate(): two 4 MiB extent files written 4 KiB at a time in turns, with
+// the lowest free block policy, then read back from a cold mount. Reserving
+// the first file up front keeps its blocks together, so the second one gets
+// a contiguous run too
+static void bench_fallocate(void)
+{
+    const int file_size = 4 * 1024 * 1024;
+    const int piece = 4 * 1024;
+    const int chunk = 64 * 1024;
+    const char *write_labels[] = {"no fallocate, write", "fallocate, write"};
+    const char *read_labels[] = {"no fallocate, cold read", "fallocate, cold read"};
+    uint8_t *data = calloc(chunk, 1);
+
+    print_bench_header("fallocate (2 x 4 MiB extent files, 4 KiB writes)");
+    fs_set_inode_format(FS_INODE_EXTENTS);
+    for (int reserve = 0; reserve < 2; reserve++)
+    {
+        make_image(BENCH_DISK, BENCH_SECTORS);
+        format(BENCH_DISK, 32);
+        mount(BENCH_DISK);
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        int first = create();
+        int second = create();
+        if (reserve)
+        {
+            fallocate(first, 0, file_size);
+        }
+        for (int offset = 0; offset < file_size; offset += piece)
+        {
+            write(first, data, piece, offset);
+            write(second, data, piece, offset);
+        }
+        fs_sync();
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(write_labels[reserve], 2 * file_size / piece, secs, stats.host_calls);
+        unmount();
+
+        fs_set_cache_size(0);
+        fs_set_readahead(0);
+        mount(BENCH_DISK);
+        fs_reset_stats();
+        start = now_sec();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(first, data, chunk, offset);
+        }
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(second, data, chunk, offset);
+        }
+        secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(read_labels[reserve], 2 * file_size / chunk, secs, stats.host_calls);
+        unmount();
+        fs_set_cache_size(1024 * 1024);
+        fs_set_readahead(256 * 1024);
+    }
+    fs_set_inode_format(FS_INODE_POINTERS);
+
+    free(data);
+}
+
+// Pointer vs extent inodes: an 8 MiB file written and then read back
+// sequentially from a cold mount (no block cache, no readahead, so every
+// metadata block read shows up as a host call)
+static void bench_inode_formats(void)
+{
+    const int file_size = 8 * 1024 * 1024;
+    const int chunk = 64 * 1024;
+    const int formats[] = {FS_INODE_POINTERS, FS_INODE_EXTENTS};
+    const char *write_labels[] = {"pointers, write", "extents, write"};
+    const char *read_labels[] = {"pointers, cold read", "extents, cold read"};
+    uint8_t *data = calloc(chunk, 1);
+
+    print_bench_header("Inode formats (8 MiB file, 64 KiB requests)");
+    for (int f = 0; f < 2; f++)
+    {
+        fs_set_inode_format(formats[f]);
+        make_image(BENCH_DISK, BENCH_SECTORS);
+        format(BENCH_DISK, 32);
+        mount(BENCH_DISK);
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        int inode = create();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            write(inode, data, chunk, offset);
+        }
+        fs_sync();
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(write_labels[f], file_size / chunk, secs, stats.host_calls);
+        unmount();
+
+        fs_set_cache_size(0);
+        fs_set_readahead(0);
+        mount(BENCH_DISK);
+        fs_reset_stats();
+        start = now_sec();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(inode, data, chunk, offset);
+        }
+        secs = now_sec() - start;
+        fs_get_stats(&stats);
+        print_bench_row(read_labels[f], file_size / chunk, secs, stats.host_calls);
+        unmount();
+        fs_set_cache_size(1024 * 1024);
+        fs_set_readahead(256 * 1024);
+    }
+    fs_set_inode_format(FS_INODE_POINTERS);
+
+    free(data);
+}
+
+// Clear the clean-unmount flag of a volume (superblock byte 32), so that
+// the next mount has to scan its inodes as after a crash
+static void mark_unclean(const char *name)
+{
+    DISK raw_disk;
+    if (vdisk_on((char *)name, &raw_disk) != 0)
+    {
+        return;
+    }
+    uint8_t *sector = vdisk_buf_get(&raw_disk);
+    if (vdisk_read(&raw_disk, 0, sector) == 0)
+    {
+        memset(sector + 32, 0, sizeof(uint32_t));
+        vdisk_write(&raw_disk, 0, sector);
+    }
+    vdisk_buf_put(&raw_disk, sector);
+    vdisk_off(&raw_disk);
+}
+
+// Mount time of a volume full of files, after a clean unmount (bitmap
+// blocks loaded) and after a crash (inodes and indirect blocks scanned), the
+// scan with 1 to 8 threads. Then lazy mounts after a crash: the time until
+// mount() returns, and until the first block allocation is done
+static void bench_mount(void)
+{
+    const int threads[] = {0, 1, 2, 4, 8}; // 0: clean mount, no scan
+    const int num_files = 200;
+    const int file_size = 64 * 1024;
+    const int rounds = 20;
+    uint8_t *data = calloc(file_size, 1);
+    char label[64];
+
+    print_bench_header("Mount (200 files of 64 KiB, 1024 inodes)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 1024);
+    mount(BENCH_DISK);
+    for (int i = 0; i < num_files; i++)
+    {
+        write(create(), data, file_size, 0);
+    }
+    unmount();
+
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+    {
+        double secs = 0;
+        uint64_t host_calls = 0;
+        fs_set_scan_threads(threads[t]);
+        for (int r = 0; r < rounds; r++)
+        {
+            if (threads[t] > 0)
+            {
+                mark_unclean(BENCH_DISK);
+            }
+            fs_stats_t stats;
+            double start = now_sec();
+            mount(BENCH_DISK);
+            secs += now_sec() - start;
+            fs_get_stats(&stats);
+            host_calls += stats.host_calls;
+            unmount();
+        }
+        if (threads[t] == 0)
+        {
+            snprintf(label, sizeof(label), "clean");
+        }
+        else
+        {
+            snprintf(label, sizeof(label), "unclean, %d scan thread%s", threads[t], threads[t] > 1 ? "s" : "");
+        }
+        print_bench_row(label, rounds, secs, host_calls);
+    }
+    fs_set_scan_threads(0);
+    fs_set_lazy_mount(true);
+
+    double mount_secs = 0;
+    double write_secs = 0;
+    uint64_t host_calls = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+        mark_unclean(BENCH_DISK);
+        fs_stats_t stats;
+        double start = now_sec();
+        mount(BENCH_DISK);
+        mount_secs += now_sec() - start;
+        int inode = create();
+        write(inode, data, 1024, 0);
+        write_secs += now_sec() - start;
+        delete(inode);
+        fs_get_stats(&stats);
+        host_calls += stats.host_calls;
+        unmount();
+    }
+    fs_set_lazy_mount(false);
+    print_bench_row("lazy, mount returns", rounds, mount_secs, 0);
+    print_bench_row("lazy, first write done", rounds, write_secs, host_calls);
+
+    free(data);
+}
+
+// Streaming a large file in small read() calls, per readahead window
+static void bench_readahead(void)
+{
+    const size_t windows[] = {0, 64 * 1024, 256 * 1024, 1024 * 1024};
+    const int file_size = 8 * 1024 * 1024;
+    const int chunk = 4096;
+    uint8_t *data = calloc(file_size, 1);
+    char label[64];
+
+    print_bench_header("Readahead (4 KiB sequential reads)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 32);
+    mount(BENCH_DISK);
+    write(create(), data, file_size, 0);
+    unmount();
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+    {
+        fs_set_readahead(windows[w]);
+        mount(BENCH_DISK);
+
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(0, data + offset, chunk, offset);
+        }
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        snprintf(label, sizeof(label), "%zu KiB window", windows[w] / 1024);
+        print_bench_row(label, file_size / chunk, secs, stats.host_calls);
+
+        unmount();
+    }
+
+    fs_set_readahead(256 * 1024);
+    free(data);
+}
+
+// Sequential throughput on a large file, 1 MiB per call, per block size
+static void bench_fs_sequential(void)
+{
+    const uint32_t block_sizes[] = {1024, 4096, 65536};
+    const int file_size = 8 * 1024 * 1024;
+    const int chunk = 1024 * 1024;
+    uint8_t *data = malloc(chunk);
+    char label[64];
+
+    print_bench_header("Sequential large file");
+    memset(data, 0x5a, chunk);
+    for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+    {
+        uint32_t kib = block_sizes[b] / 1024;
+        make_image(BENCH_DISK, BENCH_SECTORS);
+        format_block_size(BENCH_DISK, 32, block_sizes[b]);
+        mount(BENCH_DISK);
+        int inode = create();
+
+        fs_stats_t stats;
+        fs_reset_stats();
+        double start = now_sec();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            write(inode, data, chunk, offset);
+        }
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        snprintf(label, sizeof(label), "%uK write %.0f MiB/s (per KiB)", kib, file_size / secs / (1024 * 1024));
+        print_bench_row(label, file_size / 1024, secs, stats.host_calls);
+
+        fs_reset_stats();
+        start = now_sec();
+        for (int offset = 0; offset < file_size; offset += chunk)
+        {
+            read(inode, data, chunk, offset);
+        }
+        secs = now_sec() - start;
+        fs_get_stats(&stats);
+        snprintf(label, sizeof(label), "%uK read %.0f MiB/s (per KiB)", kib, file_size / secs / (1024 * 1024));
+        print_bench_row(label, file_size / 1024, secs, stats.host_calls);
+
+        unmount();
+    }
+
+    free(data);
+}
+
+// Metadata-heavy workload (stat and small random reads) per block cache budget
+static void bench_block_cache(void)
+{
+    const size_t budgets[] = {0, 16 * 1024, 256 * 1024, 1024 * 1024};
+    const int num_files = 16;
+    const int file_size = 512 * 1024;
+    const int ops = 20000;
+    uint8_t *data = calloc(file_size, 1);
+    char label[64];
+
+    print_bench_header("Block cache (stat + 1 KiB random reads)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+    format(BENCH_DISK, 64);
+    mount(BENCH_DISK);
+    for (int i = 0; i < num_files; i++)
+    {
+        write(create(), data, file_size, 0);
+    }
+    unmount();
+
+    for (size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++)
+    {
+        fs_set_cache_size(budgets[b]);
+        mount(BENCH_DISK);
+
+        fs_stats_t stats;
+        fs_reset_stats();
+        srand(42);
+        double start = now_sec();
+        for (int i = 0; i < ops; i++)
+        {
+            int inode = rand() % num_files;
+            stat(inode);
+            read(inode, data, 1024, (rand() % (file_size / 1024)) * 1024);
+        }
+        double secs = now_sec() - start;
+        fs_get_stats(&stats);
+        uint64_t lookups = stats.cache_hits + stats.cache_misses;
+        snprintf(label, sizeof(label), "%zu KiB cache, %.0f%% hits", budgets[b] / 1024,
+                 lookups ? stats.cache_hits * 100.0 / lookups : 0.0);
+        print_bench_row(label, ops, secs, stats.host_calls);
+
+        unmount();
+    }
+
+    fs_set_cache_size(1024 * 1024);
+    free(data);
+}
+
+// Random hot-set reads interleaved with a sequential scan of the whole disk,
+// per cache policy: the scan should not push the hot set out
+static void bench_cache_policy(void)
+{
+    const int hot_sectors = 128;
+    const size_t budget = 256 * 1024;
+    const char *names[] = {"LRU", "2Q", "2Q + metadata hints"};
+    const int policies[] = {VDISK_CACHE_LRU, VDISK_CACHE_2Q, VDISK_CACHE_2Q};
+    char label[64];
+
+    print_bench_header("Cache policy (hot set + sequential scan)");
+    make_image(BENCH_DISK, BENCH_SECTORS);
+
+    for (int p = 0; p < 3; p++)
+    {
+        DISK disk;
+        if (vdisk_on_mode(BENCH_DISK, &disk, VDISK_MODE_PREAD) != 0 ||
+            vdisk_cache_init(&disk, budget, policies[p]) != 0)
+        {
+            printf("%s: unavailable\n", names[p]);
+            continue;
+        }
+        uint8_t *buffer = vdisk_buf_get(&disk);
+        bool hints = p == 2;
+
+        // One scan sector, then one hot-set sector, over the whole disk
+        srand(42);
+        disk.host_calls = 0;
+        double start = now_sec();
+        for (uint32_t s = hot_sectors; s < BENCH_SECTORS; s++)
+        {
+            vdisk_read(&disk, s, buffer);
+            uint32_t hot = rand() % hot_sectors;
+            hints ? vdisk_read_meta(&disk, hot, buffer) : vdisk_read(&disk, hot, buffer);
+        }
+        double secs = now_sec() - start;
+        int ops = 2 * (BENCH_SECTORS - hot_sectors);
+        snprintf(label, sizeof(label), "%s %.0f%% hits", names[p],
+                 disk.cache_hits * 100.0 / (disk.cache_hits + disk.cache_misses));
+        print_bench_row(label, ops, secs, disk.host_calls);
+
+        vdisk_buf_put(&disk, buffer);
+        vdisk_off(&disk);
+    }
+}
+
+int main(void)
+{
+    printf("File System Benchmarks\n");
+    printf("======================\n");
+
+    bench_sector_io();
+    bench_queue_depth();
+    bench_fs_read();
+    bench_block_cache();
+    bench_cache_policy();
+    bench_readahead();
+    bench_block_map();
+    bench_allocation();
+    bench_create_delete();
+    bench_inventory();
+    bench_appends();
+    bench_sparse();
+    bench_inode_formats();
+    bench_interleaved();
+    bench_fallocate();
+    bench_mount();
+    bench_fs_sequential();
+
+    remove(BENCH_DISK);
+    return 0;
+}
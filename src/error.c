@@ -3,3 +3,7 @@ const int vdisk_EACCESS  = -2;
 const int vdisk_ENOEXIST = -3;
 const int vdisk_EEXCEED  = -4;
 const int vdisk_ESECTOR  = -5;
+const int vdisk_EMODE    = -6;
+const int vdisk_EBUSY    = -7;
+const int vdisk_ESIZE    = -8;
+const int vdisk_EIO      = -9;
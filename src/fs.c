@@ -3,14 +3,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/sysinfo.h>
+#include <pthread.h>
 #include "include/fs.h"
 #include "include/vdisk.h"
 #include "include/error.h"
 
-#define BLOCK_SIZE 1024
+#define DEFAULT_BLOCK_SIZE 1024
 #define INODE_SIZE 32
-#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
-#define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define DEFAULT_CACHE_SIZE (1024 * 1024) // Block cache budget in bytes
+#define MAX_RUN_BLOCKS 256 // Max # of blocks moved by one vectored request
+#define DEFAULT_READAHEAD (256 * 1024) // Max readahead window in bytes, per stream
+#define READAHEAD_MIN 4      // Window (blocks) of a stream that just turned sequential
+#define READAHEAD_STREAMS 4  // # of inodes whose reads are tracked at once
+#define BLOCK_MAPS 8         // # of inodes whose block map is kept in memory
+#define SCAN_THREADS 8       // Max # of threads of a mount-time inode scan
+#define SCAN_READ_SIZE (256 * 1024) // Bytes of inode table a scan reads per request
+#define SUMMARY_LEVELS 5     // Max levels above the block bitmap (64^5 words >= 2^32 blocks)
+#define DEFAULT_INODE_DIRTY_LIMIT 64 // Dirty inode blocks kept in memory before a write-back
+#define ALLOC_SLACK MAX_RUN_BLOCKS // Free blocks goal-based allocation leaves after another file's
 #define MAGIC_NUMBER "\xf0\x55\x4c\x49\x45\x47\x45\x49\x4e\x46\x4f\x30\x39\x34\x30\x0f"
 
 
@@ -24,27 +35,217 @@ typedef struct
     uint8_t magic[16];         // Magic # for SSFS
     uint32_t num_blocks;       // Total # of blocks
     uint32_t num_inode_blocks; // Number of inode blocks
-    uint32_t block_size;       // Block size in bytes (1024)
+    uint32_t block_size;       // Block size in bytes (1024 to 65536, power of 2)
+    uint32_t num_bitmap_blocks; // Blocks holding the block bitmap, after the inode blocks (0: none)
+    uint32_t clean_unmount;    // 1 if the bitmap blocks are up to date (unmounted cleanly)
+    uint32_t inode_format;     // FS_INODE_* (see fs_set_inode_format)
 } superblock_t;
 
 
+// Inode flags: INODE_SPARSE is set once the file may hold fewer (or more)
+// blocks than its size says, after a write or fallocate() past the end of
+// file left a hole, or a failed write left blocks past the end
+#define INODE_SPARSE 0x01
+
 // Inode structure (32 bytes)
+// FS_INODE_POINTERS volumes map file blocks through the block pointers,
+// FS_INODE_EXTENTS volumes through an extent tree whose root is in `root`
 typedef struct
 {
     uint8_t valid;                  // 0 if free, 1 if allocated
+    uint8_t depth;                  // Extents: levels of tree blocks below the root
+    uint8_t entries;                // Extents: # of entries in the root
+    uint8_t flags;                  // INODE_SPARSE
     uint32_t size;                  // File size in bytes
-    uint32_t direct_blocks[4];      // Direct block pointers
-    uint32_t indirect_block;        // Single indirect block pointer
-    uint32_t double_indirect_block; // Double indirect block pointer
+    union
+    {
+        struct
+        {
+            uint32_t direct_blocks[4];      // Direct block pointers
+            uint32_t indirect_block;        // Single indirect block pointer
+            uint32_t double_indirect_block; // Double indirect block pointer
+        };
+        uint32_t root[6];           // Extents: ROOT_EXTENTS extents, or ROOT_INDEXES index entries
+    };
 } inode_t;
 
+// Extent tree: a run of `length` file blocks from `logical` held by the
+// blocks from `physical` on. Leaves (depth 0) hold extents sorted by logical
+// block; the nodes above hold index entries, each the tree block of a child
+// and the first file block routed to it (the first child also gets all the
+// blocks before). Tree blocks start with an extent_header_t. The blocks of
+// an unwritten extent (EXTENT_UNWRITTEN set in its length) are reserved for
+// the file (see fallocate) but hold nothing yet: they read as 0s
+#define EXTENT_UNWRITTEN 0x80000000u
+#define ROOT_EXTENTS 2
+#define ROOT_INDEXES 3
+#define EXTENT_MAX_DEPTH 4
+typedef struct
+{
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+} extent_t;
+
+typedef struct
+{
+    uint32_t logical;
+    uint32_t block;
+} extent_index_t;
+
+typedef struct
+{
+    uint32_t entries; // # of entries in the block
+    uint32_t depth;   // 0: leaf
+} extent_header_t;
+
+// Extent tree node on the way from the root to a leaf (see find_extent_path)
+typedef struct
+{
+    uint32_t block;    // Tree block (0: the root, in the inode)
+    uint8_t *buffer;   // Copy of the tree block (NULL for the root)
+    uint8_t *entries;  // extent_t (leaf) or extent_index_t entries
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t depth;
+    uint32_t slot;     // Entry followed to the next node
+    uint32_t lo, hi;   // File blocks [lo, hi) routed to this node (hi: UINT32_MAX if no end)
+} extent_node_t;
+
+typedef struct
+{
+    inode_t *inode;
+    int levels; // Nodes in use, root first
+    extent_node_t nodes[EXTENT_MAX_DEPTH + 1];
+} extent_path_t;
+
+
+// Readahead stream: sequential reads of one inode
+// Slot i of the buffer holds the prefetched file block `index[i]`, with
+// index[i] % num_slots == i
+#define RA_EMPTY   0
+#define RA_PENDING 1 // read submitted, not reaped yet
+#define RA_READY   2
+typedef struct
+{
+    bool used;
+    int inode_num;
+    uint64_t last_use;    // For picking the stream to recycle
+    uint32_t next_offset; // Where a sequential read would start
+    uint32_t window;      // # of blocks kept prefetched ahead (0: random access)
+    uint32_t ra_end;      // File block index after the last one prefetched
+    uint8_t *buffer;      // num_slots blocks (allocated on first prefetch)
+    uint32_t *index;
+    uint8_t *state;       // RA_* of each slot
+} stream_t;
+
+
+// In-memory block map of one inode: blocks[i] is the block holding file
+// block i (0: none), or MAP_UNKNOWN until the indirect block (or extent tree
+// leaf) that maps it is first read. Direct blocks are not kept (the inode has
+// them); extent inodes keep all their blocks there
+#define MAP_UNKNOWN UINT32_MAX
+typedef struct
+{
+    bool used;
+    int inode_num;
+    uint64_t last_use;  // For picking the map to recycle
+    uint32_t *blocks;
+    uint32_t capacity;  // # of entries in blocks
+    uint32_t goal;      // Block after the last one allocated to the inode (0: none yet)
+} block_map_t;
+
+// Walk over the inode table one block at a time (see next_inode_block)
+typedef struct
+{
+    uint32_t block;      // Index of the inode block in view
+    const uint8_t *view; // That block, NULL before the first step
+    bool cached;         // view is the inode cache's copy (not to be released)
+} inode_iter_t;
+
+// Part of the inode table scanned by one thread at mount (see scan_inodes)
+typedef struct
+{
+    uint32_t first_block; // Inode blocks [first_block, last_block)
+    uint32_t last_block;
+    uint64_t *bitmap;     // Blocks in use found by this thread
+    uint64_t host_calls;  // Host I/O calls of this thread's disk handle
+    int result;
+    pthread_t thread;
+} scan_range_t;
+
 
 // File system state
 static bool disk_mounted = false;
 static DISK disk; // Defined in vdisk.h
 static superblock_t superblock;
-static uint32_t *block_bitmap = NULL; // For tracking free blocks
+static uint64_t *block_bitmap = NULL; // For tracking free blocks, 1 bit per block (1: used)
+static uint32_t bitmap_words = 0;      // # of 64-bit words in block_bitmap
+
+// Summary of the block bitmap (see find_free_block): bit i of a level-1 word
+// is set if bitmap word i has a free block, bit i of a level-2 word if
+// level-1 word i has a set bit, and so on up to a single word
+static uint64_t *summary[SUMMARY_LEVELS]; // summary[0] is level 1
+static int summary_levels = 0;            // 0 until built at mount
 static char *mounted_disk = NULL;
+static uint64_t *inode_bitmap = NULL; // Inodes in use, 1 bit each (built by the first create())
+static uint32_t inode_words = 0;      // # of 64-bit words in inode_bitmap
+
+// Geometry of the mounted volume, derived from superblock.block_size
+static int block_size = DEFAULT_BLOCK_SIZE;
+static int inodes_per_block = DEFAULT_BLOCK_SIZE / INODE_SIZE;
+static uint32_t pointers_per_block = DEFAULT_BLOCK_SIZE / sizeof(uint32_t);
+static bool extent_inodes = false; // superblock.inode_format is FS_INODE_EXTENTS
+
+// Block allocation policy (see fs_set_allocation)
+static int alloc_policy = FS_ALLOC_LOWEST;
+
+// Inode format of the volumes the next format() creates (see fs_set_inode_format)
+static int inode_format = FS_INODE_POINTERS;
+
+// Block cache set up by the next mount (see fs_set_cache_size)
+static size_t cache_size = DEFAULT_CACHE_SIZE;
+static int cache_policy = VDISK_CACHE_2Q;
+
+// Threads of the next mount-time inode scan (0: one per core)
+static int scan_threads = 0;
+
+// Block bitmap construction (see wait_for_bitmap): with lazy mounts, the
+// bitmap is loaded or rebuilt by a background thread while mount() returns
+static bool lazy_mount = false;      // Used by the next mount
+static pthread_t bitmap_thread;
+static bool bitmap_pending = false;  // bitmap_thread not joined yet
+static bool bitmap_load = false;     // Load the bitmap blocks (clean unmount) rather than scan
+static int bitmap_threads = 1;       // # of threads of the inode scan
+static int bitmap_result = 0;        // Outcome of the construction
+static uint64_t bitmap_host_calls = 0; // Host I/O calls of the construction
+
+// Readahead (see readahead_stream)
+static size_t readahead_size = DEFAULT_READAHEAD; // Used by the next mount
+static uint32_t num_slots = 0;  // Blocks per stream buffer (0: readahead off)
+static stream_t streams[READAHEAD_STREAMS];
+static uint32_t ra_in_flight = 0; // Prefetch reads not reaped yet
+static uint64_t ra_clock = 0;
+static uint64_t ra_hits = 0;      // Blocks served from a stream buffer
+
+// Blocks seen by count_block() (see stat_all)
+static uint32_t counted_blocks = 0;
+
+// Blocks gathered by collect_block() (see free_collected_blocks)
+static uint32_t *collected_blocks = NULL;
+static uint32_t num_collected = 0;
+static uint32_t collected_capacity = 0;
+
+// Inode cache (see load_inode_block): the inode blocks read or written since
+// mount, as on disk; dirty ones are written back by flush_inodes()
+static uint8_t **inode_cache = NULL;  // Per inode block (NULL: not loaded)
+static bool *inode_dirty = NULL;      // Per inode block: changed since written back
+static uint32_t dirty_inode_blocks = 0;
+static uint32_t inode_dirty_limit = DEFAULT_INODE_DIRTY_LIMIT; // see fs_set_inode_dirty_limit
+
+// Block maps of recently used inodes (see map_block)
+static block_map_t block_maps[BLOCK_MAPS];
+static uint64_t map_clock = 0;
 
 
 /*************************/
@@ -53,9 +254,55 @@ static char *mounted_disk = NULL;
 
 static int read_inode(int inode_num, inode_t *inode, bool bypass_mount_check);
 static int write_inode(int inode_num, inode_t *inode);
-static void free_block(int block_num);
-static int find_free_block(void);
-static int get_block_for_offset(inode_t *inode, int offset, bool allocate);
+static int write_inode_if_changed(int inode_num, inode_t *inode, const inode_t *before);
+static int write_inodes(const int *inode_nums, int count, const inode_t *inode);
+static int compare_ints(const void *a, const void *b);
+static int next_inode_block(inode_iter_t *iter, const inode_t **inodes);
+static int load_inode_block(uint32_t index, uint8_t **records);
+static int mark_inode_block_dirty(uint32_t index);
+static int flush_inodes(void);
+static int setup_inode_cache(void);
+static void free_inode_cache(void);
+static int find_free_inode(void);
+static void free_inode(int inode_num);
+static int free_block(int block_num);
+static int find_free_block(uint32_t goal);
+static int get_block_for_offset(inode_t *inode, int offset, bool allocate, bool *fresh, uint32_t goal);
+static int get_extent_block(inode_t *inode, uint32_t index, bool allocate, bool *fresh, uint32_t goal);
+static int reserve_blocks(inode_t *inode, uint32_t index, uint32_t end);
+static int view_block(uint32_t block_num, const uint8_t **view);
+static void release_view(const uint8_t *view);
+static int map_block(int inode_num, inode_t *inode, uint32_t offset, bool allocate, bool *fresh);
+static uint32_t allocation_goal(const block_map_t *map, const inode_t *inode, uint32_t index);
+static void forget_block_map(int inode_num);
+static void reset_block_maps(void);
+static int map_run(int inode_num, inode_t *inode, uint32_t offset, int len, bool allocate, uint32_t *first_block);
+static int write_data(int inode_num, inode_t *inode, uint8_t *data, int len, int offset, uint8_t *head, uint8_t *tail);
+static void mark_sparse_if_gap(inode_t *inode, uint32_t offset);
+static uint32_t blocks_for_size(uint32_t size);
+static int file_blocks(const inode_t *inode, uint32_t *blocks);
+static int for_each_inode_block(const inode_t *inode, int (*visit)(uint32_t block_num));
+static void mark_block_used(uint32_t block_num);
+static int count_block(uint32_t block_num);
+static int collect_block(uint32_t block_num);
+static int free_collected_blocks(void);
+static int build_summary(void);
+static void update_summary(uint32_t word);
+static void free_block_bitmap(void);
+static int transfer_bitmap(DISK *diskp, uint32_t first_block, uint32_t num_blocks, uint64_t *bitmap, uint32_t words, bool write);
+static int write_superblock(void);
+static int scan_inodes(int threads, bool inline_ok);
+static int build_bitmap(bool background);
+static void *bitmap_worker(void *arg);
+static int wait_for_bitmap(void);
+static int read_blocks_from(DISK *diskp, const uint32_t *blocks, int count, uint8_t *buffers, const uint8_t **views);
+static void readahead_setup(void);
+static stream_t *readahead_stream(int inode_num, uint32_t offset);
+static const uint8_t *readahead_block(stream_t *stream, uint32_t index);
+static void readahead_submit(stream_t *stream, inode_t *inode);
+static void readahead_drain(void);
+static void readahead_forget(int inode_num);
+static void readahead_reset(void);
 
 
 /*************************/
@@ -75,6 +322,16 @@ static int get_block_for_offset(inode_t *inode, int offset, bool allocate);
  *      - count=100: Number of blocks to copy - copies exactly 100 blocks
  */
 int format(char *disk_name, int inodes)
+{
+    return format_block_size(disk_name, inodes, DEFAULT_BLOCK_SIZE);
+}
+
+/*
+ * Same as format(), with blocks of `size` bytes (a power of 2 from 1 KiB to
+ * 64 KiB). Only whole blocks of the image are used; mount() picks the block
+ * size back up from the superblock.
+ */
+int format_block_size(char *disk_name, int inodes, uint32_t size)
 {
     // Precondition: Check if disk already mounted
     if (disk_mounted)
@@ -96,8 +353,17 @@ int format(char *disk_name, int inodes)
         return result;
     }
 
+    // Cut the disk into blocks of the requested size
+    result = vdisk_set_sector_size(&format_disk, size);
+    if (result != 0)
+    {
+        vdisk_off(&format_disk);
+        return (result == vdisk_ESIZE) ? E_INVALID_BLOCK_SIZE : result;
+    }
+
     // Get required # of inode blocks (ceiling division)
-    int num_inode_blocks = (inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    int per_block = size / INODE_SIZE;
+    int num_inode_blocks = (inodes + per_block - 1) / per_block;
     if (num_inode_blocks <= 0)
     {
         num_inode_blocks = 1;
@@ -106,54 +372,83 @@ int format(char *disk_name, int inodes)
     // Calculate total # of blocks available on disk
     uint32_t total_blocks = format_disk.size_in_sectors;
 
+    // Get required # of bitmap blocks (1 bit per block, in 64-bit words)
+    uint32_t words = (total_blocks + 63) / 64;
+    uint32_t num_bitmap_blocks = (words * sizeof(uint64_t) + size - 1) / size;
+
     // Ensure enough space for at least one data block
     //  +1 to account for the superblock!
-    if ((uint32_t)num_inode_blocks + 1 >= total_blocks)
+    uint32_t first_data_block = 1 + num_inode_blocks + num_bitmap_blocks;
+    if (first_data_block >= total_blocks)
     {
         vdisk_off(&format_disk);
-        return E_OUT_OF_SPACE; // can't fit inode b + superb + (>=1) one data b
+        return E_OUT_OF_SPACE; // can't fit inode b + bitmap b + superb + (>=1) one data b
     }
 
     // Init superblock
     superblock_t sb;
+    memset(&sb, 0, sizeof(sb));
     memcpy(sb.magic, MAGIC_NUMBER, 16);
     sb.num_blocks = total_blocks;
     sb.num_inode_blocks = num_inode_blocks;
-    sb.block_size = BLOCK_SIZE;
+    sb.block_size = size;
+    sb.num_bitmap_blocks = num_bitmap_blocks;
+    sb.clean_unmount = 1;
+    sb.inode_format = inode_format;
+
+    // Init bitmap - everything before the first data block is used, and so
+    // are the bits past the last block
+    uint64_t *bitmap = (uint64_t *)calloc(words, sizeof(uint64_t));
+    if (bitmap == NULL)
+    {
+        vdisk_off(&format_disk);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    for (uint32_t i = 0; i < first_data_block; i++)
+    {
+        bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+    if (total_blocks % 64 != 0)
+    {
+        bitmap[words - 1] |= ~0ULL << (total_blocks % 64);
+    }
 
     // Write superblock to block 0
-    uint8_t block_buffer[BLOCK_SIZE] = {0};
-    memcpy(block_buffer, &sb, sizeof(superblock_t));
-    result = vdisk_write(&format_disk, 0, block_buffer);
-    if (result != 0)
+    uint8_t *block_buffer = vdisk_buf_get(&format_disk);
+    if (block_buffer == NULL)
     {
+        free(bitmap);
         vdisk_off(&format_disk);
-        return result;
+        return E_OUT_OF_SPACE; // see error.h
     }
+    memset(block_buffer, 0, size);
+    memcpy(block_buffer, &sb, sizeof(superblock_t));
+    result = vdisk_write(&format_disk, 0, block_buffer);
 
     // Init inode blocks (starting at block idx 1)
-    memset(block_buffer, 0, BLOCK_SIZE); // zero-out buffer
-    for (int i = 1; i <= num_inode_blocks; i++)
+    memset(block_buffer, 0, size); // zero-out buffer
+    for (int i = 1; i <= num_inode_blocks && result == 0; i++)
     {
         result = vdisk_write(&format_disk, i, block_buffer);
-        if (result != 0)
-        {
-            vdisk_off(&format_disk);
-            return result;
-        }
     }
 
+    // Write the bitmap blocks (right after the inode blocks)
+    if (result == 0)
+    {
+        result = transfer_bitmap(&format_disk, 1 + num_inode_blocks, num_bitmap_blocks, bitmap, words, true);
+    }
+    free(bitmap);
+
     // Sync to ensure all changes are written to disk
-    result = vdisk_sync(&format_disk);
-    if (result != 0)
+    if (result == 0)
     {
-        vdisk_off(&format_disk);
-        return result;
+        result = vdisk_sync(&format_disk);
     }
 
-    // Close the disk and return success
+    // Close the disk and return success (or the first error)
+    vdisk_buf_put(&format_disk, block_buffer);
     vdisk_off(&format_disk);
-    return 0;
+    return result;
 }
 
 int mount(char *disk_name)
@@ -172,15 +467,16 @@ int mount(char *disk_name)
     }
 
     // 3. Read superblock (Block 0) and copy its data
-    uint8_t block_buffer[BLOCK_SIZE];
-    result = vdisk_read(&disk, 0, block_buffer);
+    const uint8_t *view;
+    result = view_block(0, &view);
     if (result != 0)
     {
         vdisk_off(&disk);
         return result;
     }
 
-    memcpy(&superblock, block_buffer, sizeof(superblock_t));
+    memcpy(&superblock, view, sizeof(superblock_t));
+    release_view(view);
 
     // 4. Verify the magic #
     if (memcmp(superblock.magic, MAGIC_NUMBER, 16) != 0)
@@ -189,134 +485,93 @@ int mount(char *disk_name)
         return E_CORRUPT_DISK;
     }
 
-    // 5. Allocate mem for the block bitmap
-    block_bitmap = (uint32_t *)calloc(superblock.num_blocks, sizeof(uint32_t));
-    if (block_bitmap == NULL)
+    // 5. Switch to the volume's block size and check it fits the image
+    result = vdisk_set_sector_size(&disk, superblock.block_size);
+    if (result != 0 || superblock.num_blocks > disk.size_in_sectors ||
+        1 + superblock.num_inode_blocks + superblock.num_bitmap_blocks >= superblock.num_blocks ||
+        (superblock.inode_format != FS_INODE_POINTERS && superblock.inode_format != FS_INODE_EXTENTS))
     {
         vdisk_off(&disk);
-        return E_OUT_OF_SPACE;  // see error.h
+        return (result == 0 || result == vdisk_ESIZE) ? E_CORRUPT_DISK : result;
     }
-
-    // 6. Init block bitmap - mark superblock and inode blocks as used
-    block_bitmap[0] = 1;
-    for (uint32_t i = 1; i <= superblock.num_inode_blocks; i++)
+    block_size = superblock.block_size;
+    inodes_per_block = block_size / INODE_SIZE;
+    pointers_per_block = block_size / sizeof(uint32_t);
+    extent_inodes = superblock.inode_format == FS_INODE_EXTENTS;
+
+    // 6. Put the block cache between the file system and the disk, then
+    //    allocate mem for the block bitmap
+    bitmap_words = (superblock.num_blocks + 63) / 64;
+    block_bitmap = (uint64_t *)calloc(bitmap_words, sizeof(uint64_t));
+    if (block_bitmap == NULL || vdisk_cache_init(&disk, cache_size, cache_policy) != 0)
     {
-        block_bitmap[i] = 1;
+        free_block_bitmap();
+        vdisk_off(&disk);
+        return E_OUT_OF_SPACE;  // see error.h
     }
 
-    // Scan all inodes to mark data blocks as used if allocated
-    for (uint32_t i = 0; i < superblock.num_inode_blocks * INODES_PER_BLOCK; i++)
+    // 7. Build the block bitmap - load it from the bitmap blocks if the
+    //    volume was unmounted cleanly, otherwise (crash, or a volume without
+    //    bitmap blocks) scan all inodes. Lazy mounts leave that to a
+    //    background thread; only block allocation and freeing wait for it
+    bitmap_load = superblock.num_bitmap_blocks > 0 && superblock.clean_unmount == 1;
+    bitmap_threads = (scan_threads > 0) ? scan_threads : get_nprocs();
+    bitmap_result = 0;
+    bitmap_host_calls = 0;
+    bitmap_pending = lazy_mount && pthread_create(&bitmap_thread, NULL, bitmap_worker, NULL) == 0;
+    if (!bitmap_pending)
     {
-        inode_t inode;
-        int result = read_inode(i, &inode, true);
+        bitmap_result = build_bitmap(false);
+        result = wait_for_bitmap();
         if (result != 0)
         {
-            free(block_bitmap);
-            block_bitmap = NULL;
+            free_block_bitmap();
             vdisk_off(&disk);
             return result;
         }
+    }
 
-        if (inode.valid)
+    // The bitmap blocks are stale from now on, until unmount() saves them
+    if (superblock.num_bitmap_blocks > 0)
+    {
+        superblock.clean_unmount = 0;
+        result = write_superblock();
+        if (result == 0)
         {
-            // Mark direct blocks
-            for (int j = 0; j < 4; j++)
-            {
-                if (inode.direct_blocks[j] != 0)
-                {
-                    block_bitmap[inode.direct_blocks[j]] = 1;
-                }
-            }
-
-            // Mark indirect block
-            if (inode.indirect_block != 0)
-            {
-                block_bitmap[inode.indirect_block] = 1;
-
-                uint8_t indirect_block[BLOCK_SIZE];
-                result = vdisk_read(&disk, inode.indirect_block, indirect_block);
-                if (result != 0)
-                {
-                    free(block_bitmap);
-                    block_bitmap = NULL;
-                    vdisk_off(&disk);
-                    return result;
-                }
-
-                // Set non-zero entries in indirect block as used
-                uint32_t *pointers = (uint32_t *)indirect_block;
-                for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++)
-                {
-                    if (pointers[k] != 0)
-                    {
-                        block_bitmap[pointers[k]] = 1;
-                    }
-                }
-            }
-
-            // Mark double indirect block
-            if (inode.double_indirect_block != 0)
-            {
-                block_bitmap[inode.double_indirect_block] = 1;
-
-                uint8_t double_indirect_block[BLOCK_SIZE];
-                result = vdisk_read(&disk, inode.double_indirect_block, double_indirect_block);
-                if (result != 0)
-                {
-                    free(block_bitmap);
-                    block_bitmap = NULL;
-                    vdisk_off(&disk);
-                    return result;
-                }
-
-                // Process pointer in the double indirect block
-                uint32_t *indirect_pointers = (uint32_t *)double_indirect_block;
-                for (uint32_t j = 0; j < POINTERS_PER_BLOCK; j++)
-                {
-                    if (indirect_pointers[j] != 0)
-                    {
-                        // Mark indir block as used
-                        block_bitmap[indirect_pointers[j]] = 1;
-
-                        uint8_t curr_indirect_block[BLOCK_SIZE];
-                        result = vdisk_read(&disk, indirect_pointers[j], curr_indirect_block);
-                        if (result != 0)
-                        {
-                            free(block_bitmap);
-                            block_bitmap = NULL;
-                            vdisk_off(&disk);
-                            return result;
-                        }
-
-                        // Set non-zero entries in this indirect block
-                        uint32_t *data_pointers = (uint32_t *)curr_indirect_block;
-                        for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++)
-                        {
-                            if (data_pointers[k] != 0)
-                            {
-                                block_bitmap[data_pointers[k]] = 1;
-                            }
-                        }
-                    }
-                }
-            }
+            result = vdisk_sync(&disk);
+        }
+        if (result != 0)
+        {
+            free_block_bitmap();
+            vdisk_off(&disk);
+            return result;
         }
     }
 
-    // 7. Store disk name
+    // 8. Store disk name
     int name_length = strlen(disk_name) + 1;
     mounted_disk = (char *)malloc(name_length);
     if (mounted_disk == NULL)
     {
-        free(block_bitmap);
-        block_bitmap = NULL;
+        free_block_bitmap();
         vdisk_off(&disk);
         return E_OUT_OF_SPACE; // see error.h
     }
     strcpy(mounted_disk, disk_name);
 
-    // 8. Set disk_mounted flag
+    // 9. Set disk_mounted flag, inode cache, readahead streams and block maps
+    result = setup_inode_cache();
+    if (result != 0)
+    {
+        free(mounted_disk);
+        mounted_disk = NULL;
+        free_block_bitmap();
+        vdisk_off(&disk);
+        return result;
+    }
     disk_mounted = true;
+    readahead_setup();
+    reset_block_maps();
 
     return 0; // Success
 }
@@ -329,18 +584,45 @@ int unmount(void)
         return E_DISK_NOT_MOUNTED;
     }
 
-    // 2. Sync any pending changes to disk
-    int result = vdisk_sync(&disk);
+    // 2. Stop readahead and sync any pending changes to disk (dirty inodes
+    //    first), along with the bitmap; only then flag the volume clean
+    readahead_reset();
+    reset_block_maps();
+    int inode_result = flush_inodes();
+    int result = wait_for_bitmap();
+    result = (result != 0) ? result : inode_result;
+    bool save_bitmap = superblock.num_bitmap_blocks > 0 && result == 0; // else stays unclean
+    if (save_bitmap)
+    {
+        result = transfer_bitmap(&disk, 1 + superblock.num_inode_blocks, superblock.num_bitmap_blocks,
+                                 block_bitmap, bitmap_words, true);
+    }
+    if (result == 0)
+    {
+        result = vdisk_sync(&disk);
+    }
+    if (result == 0 && save_bitmap)
+    {
+        superblock.clean_unmount = 1;
+        result = write_superblock();
+        if (result == 0)
+        {
+            result = vdisk_sync(&disk);
+        }
+    }
     // we actually don't check the result here
     // because we want to clean up even if sync fails
     // -> will check in the final return
 
-    // 3. Free memory allocated for block bitmap
-    if (block_bitmap != NULL)
-    {
-        free(block_bitmap);
-        block_bitmap = NULL;
-    }
+    // 3. Free memory allocated for block and inode bitmaps, inode cache and
+    //    the list of blocks to free
+    free_block_bitmap();
+    free(inode_bitmap);
+    inode_bitmap = NULL;
+    free_inode_cache();
+    free(collected_blocks);
+    collected_blocks = NULL;
+    collected_capacity = 0;
 
     // 4. Free memory allocated for mounted disk name
     if (mounted_disk != NULL)
@@ -366,46 +648,27 @@ int create(void)
         return E_DISK_NOT_MOUNTED;
     }
 
-    // 2. Iterate through all inodes
-    int max_inodes = superblock.num_inode_blocks * INODES_PER_BLOCK;
-    for (int inode_num = 0; inode_num < max_inodes; inode_num++)
+    // 2. Take the lowest free inode (from memory, see find_free_inode)
+    int inode_num = find_free_inode();
+    if (inode_num < 0)
     {
-        // 3. Get curr inode
-        inode_t inode;
-        int result = read_inode(inode_num, &inode, false);
-        if (result != 0)
-        {
-            return result;
-        }
-
-        // 4. Check if inode is free (valid = 0)
-        if (inode.valid == 0)
-        {
-            // Init inode fields
-            inode.valid = 1; // mark as allocated
-            inode.size = 0;  // empty file
-
-            // Init all block pointers to 0
-            for (int i = 0; i < 4; i++)
-            {
-                inode.direct_blocks[i] = 0;
-            }
-            inode.indirect_block = 0;
-            inode.double_indirect_block = 0;
+        return inode_num;
+    }
 
-            // 5. Write inode back to disk
-            result = write_inode(inode_num, &inode);
-            if (result != 0)
-            {
-                return result;
-            }
+    // 3. Init inode fields: allocated, empty file, all block pointers 0
+    inode_t inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.valid = 1;
 
-            return inode_num;
-        }
+    // 4. Write inode back to disk
+    int result = write_inode(inode_num, &inode);
+    if (result != 0)
+    {
+        free_inode(inode_num);
+        return result;
     }
 
-    // 7. If we get here -> no free inodes found
-    return E_OUT_OF_INODES;
+    return inode_num;
 }
 
 int delete(int inode_num)
@@ -417,7 +680,7 @@ int delete(int inode_num)
     }
 
     // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
     {
         return E_INVALID_INODE;
     }
@@ -436,99 +699,185 @@ int delete(int inode_num)
         return E_INVALID_INODE; // inode already free
     }
 
-    // 5. Free direct blocks
-    for (int i = 0; i < 4; i++)
+    // 5. Free all data blocks and the (double) indirect or extent tree
+    //    blocks: gathered first, so that if one can't be read none is freed
+    readahead_forget(inode_num);
+    forget_block_map(inode_num);
+    num_collected = 0;
+    result = for_each_inode_block(&inode, collect_block);
+    result = (result != 0) ? result : free_collected_blocks();
+    if (result != 0)
     {
-        if (inode.direct_blocks[i] != 0)
-        {
-            free_block(inode.direct_blocks[i]);
-            inode.direct_blocks[i] = 0;
-        }
+        return result;
     }
+    memset(inode.root, 0, sizeof(inode.root)); // the block pointers, or the extent tree root
+    inode.depth = 0;
+    inode.entries = 0;
+
+    // 6. Mark inode as free
+    inode.valid = 0;
+    inode.size = 0;
 
-    // 6. Free indirect block and all blocks it points to
-    if (inode.indirect_block != 0)
+    // 7. Write back to disk
+    result = write_inode(inode_num, &inode);
+    if (result != 0)
     {
-        // Read the indirect block
-        uint8_t indirect_block[BLOCK_SIZE];
-        result = vdisk_read(&disk, inode.indirect_block, indirect_block);
-        if (result != 0)
+        return result;
+    }
+    free_inode(inode_num);
+
+    return 0;
+}
+
+/*
+ * Same as `n` calls to create(): the inode #s go to out[0..n-1] (lowest
+ * first). Inodes of the same inode block are written with one update of
+ * that block. Returns the # of files created, fewer than `n` if the inodes
+ * ran out (or an error if not even one could be created, E_INVALID_OFFSET
+ * if `n` < 0).
+ */
+int create_many(int n, int *out)
+{
+    if (!disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+    if (n <= 0)
+    {
+        return (n == 0) ? 0 : E_INVALID_OFFSET;
+    }
+
+    // Take the inodes, in ascending order
+    int created = 0;
+    int result = 0;
+    while (created < n && (result = find_free_inode()) >= 0)
+    {
+        out[created++] = result;
+    }
+
+    // Write them one inode block at a time
+    inode_t inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.valid = 1;
+    int written = 0;
+    while (written < created)
+    {
+        int count = 1;
+        while (written + count < created &&
+               out[written + count] / inodes_per_block == out[written] / inodes_per_block)
         {
-            return result;
+            count++;
         }
-
-        // Free all referenced data blocks
-        uint32_t *pointers = (uint32_t *)indirect_block;
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        result = write_inodes(out + written, count, &inode);
+        if (result != 0)
         {
-            if (pointers[i] != 0)
+            for (int i = written; i < created; i++)
             {
-                free_block(pointers[i]);
+                free_inode(out[i]);
             }
+            break;
         }
+        written += count;
+    }
 
-        // Free indirect block itself
-        free_block(inode.indirect_block);
-        inode.indirect_block = 0;
+    return (written > 0 || result >= 0) ? written : result;
+}
+
+/*
+ * Same as delete() on each of inodes[0..n-1]. Each inode block involved is
+ * updated once. Inodes that are out of range or not in use are skipped;
+ * returns 0, or E_INVALID_INODE if there were any (or another error, in
+ * which case the inodes of the inode block it happened in and of the ones
+ * after it are not deleted, and their blocks not freed). E_INVALID_OFFSET
+ * if `n` < 0.
+ */
+int delete_many(const int *inodes, int n)
+{
+    if (!disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+    if (n <= 0)
+    {
+        return (n == 0) ? 0 : E_INVALID_OFFSET;
     }
 
-    // 7. Free double indirect block and all blocks it points to
-    if (inode.double_indirect_block != 0)
+    // Sort the inode #s so that those of one inode block are together
+    int *sorted = malloc(n * sizeof(int));
+    if (sorted == NULL)
     {
-        // Read the double indirect block
-        uint8_t double_indirect_block[BLOCK_SIZE];
-        result = vdisk_read(&disk, inode.double_indirect_block, double_indirect_block);
-        if (result != 0)
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    memcpy(sorted, inodes, n * sizeof(int));
+    qsort(sorted, n, sizeof(int), compare_ints);
+
+    int max_inodes = superblock.num_inode_blocks * inodes_per_block;
+    int first_error = 0;
+    int i = 0;
+    while (i < n)
+    {
+        if (sorted[i] < 0 || sorted[i] >= max_inodes)
         {
-            return result;
+            first_error = (first_error != 0) ? first_error : E_INVALID_INODE;
+            i++;
+            continue;
         }
 
-        // Process pointer in the double indirect block
-        uint32_t *indirect_pointers = (uint32_t *)double_indirect_block;
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        // Get the inode block, free the blocks of its inodes to delete (all
+        // gathered first: if one can't be read, nothing changes)
+        uint32_t index = sorted[i] / inodes_per_block;
+        uint8_t *records;
+        int result = load_inode_block(index, &records);
+        int end = i;
+        while (end < n && sorted[end] < max_inodes && sorted[end] / inodes_per_block == (int)index)
         {
-            if (indirect_pointers[i] != 0)
+            end++;
+        }
+        num_collected = 0;
+        for (int k = i; k < end && result == 0; k++)
+        {
+            const inode_t *inode = (const inode_t *)(records + (sorted[k] % inodes_per_block) * INODE_SIZE);
+            if (inode->valid != 0 && (k == i || sorted[k] != sorted[k - 1]))
             {
-                // Read this indirect block
-                uint8_t indirect_block[BLOCK_SIZE];
-                result = vdisk_read(&disk, indirect_pointers[i], indirect_block);
-                if (result != 0)
-                {
-                    return result;
-                }
-
-                // Free all referenced data blocks
-                uint32_t *data_pointers = (uint32_t *)indirect_block;
-                for (uint32_t j = 0; j < POINTERS_PER_BLOCK; j++)
-                {
-                    if (data_pointers[j] != 0)
-                    {
-                        free_block(data_pointers[j]);
-                    }
-                }
-
-                // Free indirect block itself
-                free_block(indirect_pointers[i]);
+                result = for_each_inode_block(inode, collect_block);
             }
         }
+        result = (result != 0) ? result : free_collected_blocks();
+        if (result != 0)
+        {
+            first_error = result;
+            break;
+        }
 
-        // Free double indirect block itself
-        free_block(inode.double_indirect_block);
-        inode.double_indirect_block = 0;
-    }
-
-    // 8. Mark inode as free
-    inode.valid = 0;
-    inode.size = 0;
-
-    // 9. Write back to disk
-    result = write_inode(inode_num, &inode);
-    if (result != 0)
-    {
-        return result;
+        // Clear their records and dirty the inode block once, then the
+        // inodes can be reused
+        for (int k = i; k < end; k++)
+        {
+            uint8_t *record = records + (sorted[k] % inodes_per_block) * INODE_SIZE;
+            if (((const inode_t *)record)->valid == 0)
+            {
+                first_error = (first_error != 0) ? first_error : E_INVALID_INODE; // free, or listed twice
+                continue;
+            }
+            readahead_forget(sorted[k]);
+            forget_block_map(sorted[k]);
+            memset(record, 0, INODE_SIZE); // invalid, empty, no blocks
+        }
+        result = mark_inode_block_dirty(index);
+        for (int k = i; k < end; k++)
+        {
+            free_inode(sorted[k]);
+        }
+        if (result != 0)
+        {
+            first_error = result; // the block stays dirty, written back later
+            break;
+        }
+        i = end;
     }
 
-    return 0;
+    free(sorted);
+    return first_error;
 }
 
 int stat(int inode_num)
@@ -540,7 +889,7 @@ int stat(int inode_num)
     }
 
     // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
     {
         return E_INVALID_INODE;
     }
@@ -562,112 +911,120 @@ int stat(int inode_num)
     return inode.size;
 }
 
-int read(int inode_num, uint8_t *data, int len, int offset)
+int stat_all(void (*visit)(const fs_stat_t *stat, void *arg), void *arg)
 {
-    // 1. Check for disk  mounted
+    // 1. Check for disk mounted
     if (!disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
-    // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    // 2. Get a buffer for SCAN_READ_SIZE bytes of inode table
+    uint32_t chunk = SCAN_READ_SIZE / block_size;
+    void *inode_blocks = NULL;
+    if (posix_memalign(&inode_blocks, VDISK_BUF_ALIGN, (size_t)chunk * block_size) != 0)
     {
-        return E_INVALID_INODE;
+        return E_OUT_OF_SPACE; // see error.h
     }
 
-    // 3. Read inode
-    inode_t inode;
-    int result = read_inode(inode_num, &inode, false);
-    if (result != 0)
+    // 3. Read the inode table a chunk at a time, report its valid inodes
+    readahead_drain(); // no prefetch in flight on the disk during the reads
+    int files = 0;
+    int result = 0;
+    for (uint32_t b = 0; b < superblock.num_inode_blocks && result == 0; b += chunk)
     {
-        return result;
+        uint32_t count = (superblock.num_inode_blocks - b < chunk) ? superblock.num_inode_blocks - b : chunk;
+        result = vdisk_read_range(&disk, 1 + b, count, inode_blocks); // +1: superblock
+        for (uint32_t k = 0; k < count && result == 0; k++)
+        {
+            if (inode_dirty[b + k])
+            {
+                memcpy((uint8_t *)inode_blocks + k * block_size, inode_cache[b + k], block_size); // newer than on disk
+            }
+        }
+        const inode_t *inodes = (const inode_t *)inode_blocks;
+        for (uint32_t i = 0; i < count * inodes_per_block && result == 0; i++)
+        {
+            if (inodes[i].valid)
+            {
+                fs_stat_t file = {(int)(b * inodes_per_block + i), (int)inodes[i].size, 0};
+                result = file_blocks(&inodes[i], &file.blocks);
+                if (result == 0)
+                {
+                    visit(&file, arg);
+                    files++;
+                }
+            }
+        }
     }
 
-    // 4. Check if inode is allocated/valid)
-    if (inode.valid == 0)
-    {
-        return E_INVALID_INODE;
-    }
+    free(inode_blocks);
+    return (result != 0) ? result : files;
+}
 
-    // 5. Determine actual # of bytes to read
-    int bytes_to_read = 0;
-    if ((uint32_t)offset < inode.size)
+int seek(int inode_num, int offset, int whence)
+{
+    // 1. Check for disk mounted
+    if (!disk_mounted)
     {
-        bytes_to_read = inode.size - offset;
-        if (bytes_to_read > len)
-        {
-            bytes_to_read = len;
-        }
+        return E_DISK_NOT_MOUNTED;
     }
 
-    // 6. If no bytes to read, return 0
-    if (bytes_to_read <= 0)
+    // 2. Check if inode # is valid
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
     {
-        return 0;
+        return E_INVALID_INODE;
     }
 
-    // 7. Init counter for total bytes read
-    int bytes_read = 0;
-    uint32_t current_offset = offset;
-
-    // 8. Read block by block
-    while (bytes_read < bytes_to_read)
+    // 3. Read inode, check if it's allocated/valid and the offset in the file
+    inode_t inode;
+    int result = read_inode(inode_num, &inode, false);
+    if (result != 0)
     {
-        // Get curr block idx and offset w/in the block
-        // Then get physical block # for curr offset
-        int block_offset = current_offset % BLOCK_SIZE;
-        int block_num = get_block_for_offset(&inode, current_offset, false);
-
-        // If <=0, that means null pointer or error
-        if (block_num <= 0)
-        {
-            break;
-        }
+        return result;
+    }
+    if (inode.valid == 0)
+    {
+        return E_INVALID_INODE;
+    }
+    if (offset < 0 || (uint32_t)offset >= inode.size || (whence != FS_SEEK_DATA && whence != FS_SEEK_HOLE))
+    {
+        return E_INVALID_OFFSET;
+    }
 
-        // Read the block into temp buffer
-        uint8_t block[BLOCK_SIZE];
-        result = vdisk_read(&disk, block_num, block);
-        if (result != 0)
+    // 4. Find the first block from there that is data (or a hole)
+    for (uint64_t index = offset / block_size; index * block_size < inode.size; index++)
+    {
+        int block_num = map_block(inode_num, &inode, index * block_size, false, NULL);
+        if (block_num < 0)
         {
-            // but if some data has already been read, return the count
-            // else, return the error
-            return (bytes_read > 0) ? bytes_read : result;
+            return block_num;
         }
-
-        // Calculate how many bytes to copy from this block
-        int bytes_to_copy = BLOCK_SIZE - block_offset;
-        if (bytes_to_copy > (bytes_to_read - bytes_read))
+        if ((block_num > 0) == (whence == FS_SEEK_DATA))
         {
-            bytes_to_copy = bytes_to_read - bytes_read;
+            return (index * block_size > (uint64_t)offset) ? (int)(index * block_size) : offset;
         }
-
-        // Copy data from block to user buffer
-        memcpy(data + bytes_read, block + block_offset, bytes_to_copy);
-
-        // Update counters
-        bytes_read += bytes_to_copy;
-        current_offset += bytes_to_copy;
     }
 
-    return bytes_read;  // # of bytes actually read
+    // 5. None: there is no data past `offset`, or the hole is the end of file
+    return (whence == FS_SEEK_HOLE) ? (int)inode.size : E_INVALID_OFFSET;
 }
 
-int write(int inode_num, uint8_t *data, int len, int offset)
+int read(int inode_num, uint8_t *data, int len, int offset)
 {
-    // 1. Check for disk mounted
+    // 1. Check for disk  mounted
     if (!disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
     // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
     {
         return E_INVALID_INODE;
     }
 
-    // 3. Read the inode
+    // 3. Read inode
     inode_t inode;
     int result = read_inode(inode_num, &inode, false);
     if (result != 0)
@@ -675,519 +1032,3171 @@ int write(int inode_num, uint8_t *data, int len, int offset)
         return result;
     }
 
-    // 4. Check if inode is allocated/valid
+    // 4. Check if inode is allocated/valid)
     if (inode.valid == 0)
     {
         return E_INVALID_INODE;
     }
 
-    // 5. If offset beyond curr file size, fill the gap with 0s
-    if ((uint32_t)offset > inode.size)
+    // 5. Determine actual # of bytes to read
+    int bytes_to_read = 0;
+    if ((uint32_t)offset < inode.size)
     {
-        int zero_fill_start = inode.size;
-        int zero_fill_end = offset;
-        uint8_t zeros[BLOCK_SIZE] = {0};
-
-        for (int curr_offset = zero_fill_start; curr_offset < zero_fill_end; )
+        bytes_to_read = inode.size - offset;
+        if (bytes_to_read > len)
         {
-            int block_offset = curr_offset % BLOCK_SIZE;
-            int block_num = get_block_for_offset(&inode, curr_offset, true);
-
-            if (block_num <= 0)
-            {
-                // Error allocating block
-                // but potentially we've already modified the file
-                // <=> update inode size to reflect changes so far
-                inode.size = ((uint32_t)curr_offset > inode.size) ? (uint32_t)curr_offset : inode.size;
-                write_inode(inode_num, &inode);
-                return block_num; // err code
-            }
+            bytes_to_read = len;
+        }
+    }
 
-            // Get how many bytes to fill in this block
-            int bytes_to_fill = BLOCK_SIZE - block_offset;
-            if (bytes_to_fill > (zero_fill_end - curr_offset))
-            {
-                bytes_to_fill = zero_fill_end - curr_offset;
-            }
+    // 6. If no bytes to read, return 0
+    if (bytes_to_read <= 0)
+    {
+        return 0;
+    }
 
-            // If block not empty / we're not writing a full block,
-            // we need to read the existing block
-            uint8_t block[BLOCK_SIZE];
-            if (block_offset > 0 || bytes_to_fill < BLOCK_SIZE)
-            {
-                result = vdisk_read(&disk, block_num, block);
-                if (result != 0)
-                {
-                    // If read fails -> update inode and return the error
-                    inode.size = ((uint32_t)curr_offset > inode.size) ? (uint32_t)curr_offset : inode.size;
-                    write_inode(inode_num, &inode);
-                    return result;
-                }
-            }
-            else
-            {
-                // If writing a full block, just use our 0-buffer
-                memcpy(block, zeros, BLOCK_SIZE);
-            }
+    // 7. Get aligned temp buffers for partial first/last blocks
+    uint8_t *head = vdisk_buf_get(&disk);
+    uint8_t *tail = vdisk_buf_get(&disk);
+    if (head == NULL || tail == NULL)
+    {
+        vdisk_buf_put(&disk, head);
+        vdisk_buf_put(&disk, tail);
+        return E_OUT_OF_SPACE; // see error.h
+    }
 
-            // Fill the appropriate portion of the block with 0s
-            memset(block + block_offset, 0, bytes_to_fill);
+    // 8. Init counter for total bytes read, and the readahead stream
+    int bytes_read = 0;
+    uint32_t current_offset = offset;
+    stream_t *stream = readahead_stream(inode_num, offset);
 
-            // Write block back to disk
-            result = vdisk_write(&disk, block_num, block);
-            if (result != 0)
+    // 9. Read run by run, each run being physically contiguous blocks
+    //    fetched with a single vectored request
+    while (bytes_read < bytes_to_read)
+    {
+        // Blocks prefetched by the stream are copied from its buffer
+        const uint8_t *prefetched = readahead_block(stream, current_offset / block_size);
+        if (prefetched != NULL)
+        {
+            int from = current_offset % block_size;
+            int chunk = block_size - from;
+            if (chunk > bytes_to_read - bytes_read)
             {
-                // If write fails -> update inode and return the error
-                inode.size = ((uint32_t)curr_offset > inode.size) ? (uint32_t)curr_offset : inode.size;
-                write_inode(inode_num, &inode);
-                return result;
+                chunk = bytes_to_read - bytes_read;
             }
-
-            // Update offset
-            curr_offset += bytes_to_fill;
+            memcpy(data + bytes_read, prefetched + from, chunk);
+            bytes_read += chunk;
+            current_offset += chunk;
+            ra_hits++;
+            continue;
         }
 
-        // Update inode size to new offset
-        inode.size = offset;
-    }
-
-    // 6. Write data from user buffer
-    int bytes_written = 0;
-    int current_offset = offset;
-
-    while (bytes_written < len)
-    {
-        // Get block idx and offset w/in the block
-        int block_offset = current_offset % BLOCK_SIZE;
-        int block_num = get_block_for_offset(&inode, current_offset, true); // pass allocate=true for potential new block
+        // Get offset w/in the first block and the run of blocks from here
+        int block_offset = current_offset % block_size;
+        uint32_t first_block;
+        int run = map_run(inode_num, &inode, current_offset, bytes_to_read - bytes_read, false, &first_block);
 
-        // If error getting/allocating the block
-        if (block_num <= 0)
+        // A hole (null pointer) reads as 0s, up to the end of its block
+        if (run == 0)
         {
-            // Update inode size to reflect changes so far
-            if ((uint32_t)current_offset > inode.size)
+            int chunk = block_size - block_offset;
+            if (chunk > bytes_to_read - bytes_read)
             {
-                inode.size = current_offset;
-                write_inode(inode_num, &inode);
+                chunk = bytes_to_read - bytes_read;
             }
-            return (bytes_written > 0) ? bytes_written : block_num;
+            memset(data + bytes_read, 0, chunk);
+            bytes_read += chunk;
+            current_offset += chunk;
+            continue;
+        }
+        if (run < 0)
+        {
+            result = run;
+            break;
         }
 
-        // Get how many bytes to write to this block
-        int bytes_to_write = BLOCK_SIZE - block_offset;
-        if (bytes_to_write > (len - bytes_written))
+        // Calculate how many bytes this run covers
+        int run_bytes = run * block_size - block_offset;
+        if (run_bytes > (bytes_to_read - bytes_read))
         {
-            bytes_to_write = len - bytes_written;
+            run_bytes = bytes_to_read - bytes_read;
         }
 
-        // If not writing a full block or starting from the beginning of a block,
-        // => then need to read the existing block to preserve data
-        uint8_t block[BLOCK_SIZE];
-        if (block_offset > 0 || bytes_to_write < BLOCK_SIZE)
+        // Blocks fully covered by the request land straight in the user
+        // buffer; a partial first/last block goes through a temp buffer
+        uint8_t *buffers[MAX_RUN_BLOCKS];
+        int end_offset = block_offset + run_bytes; // relative to first block
+        for (int i = 0; i < run; i++)
         {
-            result = vdisk_read(&disk, block_num, block);
-            if (result != 0)
+            int start = i * block_size;
+            if (i == 0 && block_offset > 0)
             {
-                // If some data was already written, update size and rtn count
-                if (bytes_written > 0)
-                {
-                    if ((uint32_t)current_offset > inode.size)
-                    {
-                        inode.size = current_offset;
-                        write_inode(inode_num, &inode);
-                    }
-                    return bytes_written;
-                }
-                return result;
+                buffers[i] = head;
+            }
+            else if (start + block_size > end_offset)
+            {
+                buffers[i] = (i == 0) ? head : tail;
+            }
+            else
+            {
+                buffers[i] = data + bytes_read + (start - block_offset);
             }
         }
 
-        // Copy data from user buffer to block
-        memcpy(block + block_offset, data + bytes_written, bytes_to_write);
-
-        // Write block back to disk
-        result = vdisk_write(&disk, block_num, block);
+        result = vdisk_readv(&disk, first_block, buffers, run);
         if (result != 0)
         {
-            // If some data was already written, update size and rtn count
-            if (bytes_written > 0)
-            {
-                if ((uint32_t)current_offset > inode.size)
-                {
-                    inode.size = current_offset;
-                    write_inode(inode_num, &inode);
-                }
-                return bytes_written;
-            }
-            return result;
+            break;
+        }
+
+        // Copy the partial blocks from the temp buffers to the user buffer
+        if (buffers[0] == head)
+        {
+            int head_bytes = (end_offset < block_size ? end_offset : block_size) - block_offset;
+            memcpy(data + bytes_read, head + block_offset, head_bytes);
+        }
+        if (run > 1 && buffers[run - 1] == tail)
+        {
+            int tail_start = (run - 1) * block_size;
+            memcpy(data + bytes_read + (tail_start - block_offset), tail, end_offset - tail_start);
         }
 
         // Update counters
-        bytes_written += bytes_to_write;
-        current_offset += bytes_to_write;
+        bytes_read += run_bytes;
+        current_offset += run_bytes;
     }
 
-    // 7. Update inode size if the write extended the file
-    if ((uint32_t)current_offset > inode.size)
+    vdisk_buf_put(&disk, head);
+    vdisk_buf_put(&disk, tail);
+
+    // 10. Prefetch what a sequential reader will ask for next, in the
+    //     background of the caller's processing
+    if (stream != NULL)
     {
-        inode.size = current_offset;
-        result = write_inode(inode_num, &inode);
-        if (result != 0)
-        {
-            // Even writing inode fails, we have written data,
-            // so return count of bytes written so far
-            return bytes_written;
-        }
+        stream->next_offset = offset + bytes_read;
+        readahead_submit(stream, &inode);
     }
 
-    return bytes_written;
+    // If a read failed: if some data has already been read, return the count
+    // else, return the error
+    if (result != 0 && bytes_read == 0)
+    {
+        return result;
+    }
+    return bytes_read;  // # of bytes actually read
 }
 
-
-
-
-/*************************/
-/* Helper functions      */
-/*************************/
-
-// Helper function to read an inode from disk
-// bypass_mount_check: if true, skip the mounted disk check (used only during mount operation)
-static int read_inode(int inode_num, inode_t *inode, bool bypass_mount_check)
+int write(int inode_num, uint8_t *data, int len, int offset)
 {
-    if (!disk_mounted && !bypass_mount_check)
+    // 1. Check for disk mounted
+    if (!disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    // 2. Check if inode # is valid
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
     {
         return E_INVALID_INODE;
     }
 
-    // Calculate block # and offset for the inode
-    int block_num = 1 + (inode_num / INODES_PER_BLOCK); // +1 because block 0 is superblock
-    int offset = (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
-
-    // Read the block containing the inode
-    uint8_t block[BLOCK_SIZE];
-    int result = vdisk_read(&disk, block_num, block);
+    // 3. Read the inode
+    inode_t inode;
+    int result = read_inode(inode_num, &inode, false);
     if (result != 0)
     {
         return result;
     }
 
-    // Copy inode data
-    memcpy(inode, block + offset, INODE_SIZE);
+    // 4. Check if inode is allocated/valid
+    if (inode.valid == 0)
+    {
+        return E_INVALID_INODE;
+    }
 
-    return 0;
+    // 5. Get aligned temp buffers for partial first/last blocks
+    uint8_t *head = vdisk_buf_get(&disk);
+    uint8_t *tail = vdisk_buf_get(&disk);
+    if (head == NULL || tail == NULL)
+    {
+        vdisk_buf_put(&disk, head);
+        vdisk_buf_put(&disk, tail);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    // 6. Write the data (prefetched blocks of the file become stale)
+    readahead_forget(inode_num);
+    result = write_data(inode_num, &inode, data, len, offset, head, tail);
+    vdisk_buf_put(&disk, head);
+    vdisk_buf_put(&disk, tail);
+    return result;
 }
 
-// Helper function to write an inode to disk
-static int write_inode(int inode_num, inode_t *inode)
+/*
+ * Reserves the blocks of `len` bytes from `offset` in inode `inode_num`,
+ * physically contiguous as far as the free space allows, and extends the
+ * file to offset + len if it was shorter. The reserved blocks are unwritten:
+ * read() returns 0s for them with no I/O, and write() puts data in them
+ * where they are, with no allocation. Blocks of the range the file already
+ * has are left alone. Only volumes of extent inodes can do that (see
+ * fs_set_inode_format): others return E_NOT_SUPPORTED. Returns 0, or an
+ * error (E_OUT_OF_SPACE: some blocks may be reserved, the size is unchanged).
+ */
+int fallocate(int inode_num, int offset, int len)
 {
+    // 1. Check for disk mounted
     if (!disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    // 2. Check if inode # and range are valid
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
     {
         return E_INVALID_INODE;
     }
+    if (offset < 0 || len <= 0 || offset > INT32_MAX - len)
+    {
+        return E_INVALID_OFFSET;
+    }
 
-    // Calculate block # and offset for the inode
-    int block_num = 1 + (inode_num / INODES_PER_BLOCK); // +1 because block 0 is superblock
-    int offset = (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
-
-    // Read the block containing the inode
-    uint8_t block[BLOCK_SIZE];
-    int result = vdisk_read(&disk, block_num, block);
+    // 3. Read inode, check if it's allocated/valid and can hold unwritten blocks
+    inode_t inode;
+    int result = read_inode(inode_num, &inode, false);
     if (result != 0)
     {
         return result;
     }
-
-    // Update inode data in the block
-    memcpy(block + offset, inode, INODE_SIZE);
-
-    // Write the block back to disk
-    result = vdisk_write(&disk, block_num, block);
+    if (inode.valid == 0)
+    {
+        return E_INVALID_INODE;
+    }
+    if (!extent_inodes)
+    {
+        return E_NOT_SUPPORTED;
+    }
+    result = wait_for_bitmap();
     if (result != 0)
     {
         return result;
     }
 
-    return 0;
+    // 4. Reserve the holes of the range, then extend the file
+    inode_t before;
+    memcpy(&before, &inode, sizeof(before));
+    mark_sparse_if_gap(&inode, offset);
+    result = reserve_blocks(&inode, offset / block_size, (offset + len - 1) / block_size + 1);
+    if (result != 0)
+    {
+        inode.flags |= INODE_SPARSE; // blocks may be reserved past the end of file
+    }
+    else if ((uint32_t)(offset + len) > inode.size)
+    {
+        inode.size = offset + len;
+    }
+
+    // 5. Write the inode back if its extent tree root or size changed
+    int write_result = write_inode_if_changed(inode_num, &inode, &before);
+    return (result != 0) ? result : write_result;
 }
 
-// Helper function to find a free block
-static int find_free_block()
+int fs_get_stats(fs_stats_t *stats)
 {
     if (!disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
-    // Start from the first data block (after superblock and inode blocks)
-    int first_data_block = 1 + superblock.num_inode_blocks;
+    stats->host_calls = disk.host_calls;
+    stats->cache_hits = disk.cache_hits;
+    stats->cache_misses = disk.cache_misses;
+    stats->readahead_hits = ra_hits;
+    return 0;
+}
 
-    // Search for the first available block using first-available strategy
-    for (uint32_t i = (uint32_t)first_data_block; i < superblock.num_blocks; i++)
-    {
-        if (block_bitmap[i] == 0)
-        {
-            // Mark the block as used
-            block_bitmap[i] = 1;
-            return i;
-        }
-    }
+void fs_reset_stats(void)
+{
+    disk.host_calls = 0;
+    disk.cache_hits = 0;
+    disk.cache_misses = 0;
+    ra_hits = 0;
+}
 
-    return E_OUT_OF_SPACE; // No free blocks available
+void fs_set_cache_size(size_t bytes)
+{
+    cache_size = bytes;
 }
 
-// Helper function to mark a block as free
-static void free_block(int block_num)
+void fs_set_cache_policy(int policy)
 {
-    if (disk_mounted && block_num > 0 && (uint32_t)block_num < superblock.num_blocks)
-    {
-        // Mark the block as free in the bitmap
-        block_bitmap[block_num] = 0;
-    }
+    cache_policy = policy;
 }
 
-// Helper function to get block # for a specific file offset
-static int get_block_for_offset(inode_t *inode, int offset, bool allocate)
+void fs_set_readahead(size_t bytes)
+{
+    readahead_size = bytes;
+}
+
+void fs_set_scan_threads(int threads)
+{
+    scan_threads = threads;
+}
+
+void fs_set_lazy_mount(bool lazy)
+{
+    lazy_mount = lazy;
+}
+
+void fs_set_inode_format(int format)
+{
+    inode_format = format;
+}
+
+void fs_set_allocation(int policy)
+{
+    alloc_policy = policy;
+}
+
+void fs_set_inode_dirty_limit(uint32_t blocks)
+{
+    inode_dirty_limit = blocks;
+}
+
+int fs_sync(void)
 {
     if (!disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
-    if (offset < 0)
-    {
-        return E_INVALID_OFFSET;
-    }
 
-    // Calculate which block this offset falls into
-    int block_index = offset / BLOCK_SIZE;
+    int result = flush_inodes();
+    return (result != 0) ? result : vdisk_sync(&disk);
+}
 
-    // Direct blocks (0-3)
-    if (block_index < 4)
+
+
+
+/*************************/
+/* Helper functions      */
+/*************************/
+
+// Helper function doing the actual work of write()
+// `head` and `tail` are block buffers for partial first/last blocks
+// Blocks that hold nothing of the file yet (just allocated in a hole, or past
+// its old end) are never read: the parts of them the write doesn't cover are 0s
+static int write_data(int inode_num, inode_t *inode, uint8_t *data, int len, int offset, uint8_t *head, uint8_t *tail)
+{
+    uint32_t old_size = inode->size;
+    inode_t before; // to tell whether the inode must be written back
+    memcpy(&before, inode, sizeof(before));
+
+    // 1. If offset beyond curr file size, the gap is left as a hole: no
+    //    blocks are allocated for it and reads return 0s. Only the rest of
+    //    a partial old last block is zeroed (up to the offset)
+    if ((uint32_t)offset > inode->size)
     {
-        if (inode->direct_blocks[block_index] == 0 && allocate)
+        mark_sparse_if_gap(inode, offset);
+        int block_offset = inode->size % block_size;
+        int block_num = (block_offset > 0) ? map_block(inode_num, inode, inode->size, false, NULL) : 0;
+        if (block_num < 0)
         {
-            // Need to allocate a new block
-            int new_block = find_free_block();
-            if (new_block < 0)
+            return block_num; // err code
+        }
+        if (block_num > 0)
+        {
+            // Get how many bytes to fill in this block
+            int bytes_to_fill = block_size - block_offset;
+            if ((uint32_t)bytes_to_fill > offset - inode->size)
             {
-                return new_block; // Error finding free block
+                bytes_to_fill = offset - inode->size;
             }
 
-            // Init the new block with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
+            // Read the block, fill that portion with 0s and write it back
+            int result = vdisk_read(&disk, block_num, head);
+            if (result == 0)
+            {
+                memset(head + block_offset, 0, bytes_to_fill);
+                result = vdisk_write(&disk, block_num, head);
+            }
             if (result != 0)
             {
-                free_block(new_block);
                 return result;
             }
-
-            inode->direct_blocks[block_index] = new_block;
         }
-        return inode->direct_blocks[block_index];
+
+        // Update inode size to new offset
+        inode->size = offset;
     }
 
-    // Indirect blocks (4-259)
-    block_index -= 4;
-    if ((uint32_t)block_index < POINTERS_PER_BLOCK)
+    // 2. Write data from user buffer, up to MAX_RUN_BLOCKS blocks at a time:
+    //    map (allocate) them, then write them run by run
+    int result = 0;
+    int bytes_written = 0;
+    int current_offset = offset;
+    uint32_t blocks[MAX_RUN_BLOCKS];
+    bool fresh[MAX_RUN_BLOCKS];
+
+    while (bytes_written < len)
     {
-        // Check if we have an indirect block
-        if (inode->indirect_block == 0)
+        // Map the next blocks (allocate=true for potential new blocks)
+        int first_index = current_offset / block_size;
+        int count = (offset + len - 1) / block_size - first_index + 1;
+        count = (count < MAX_RUN_BLOCKS) ? count : MAX_RUN_BLOCKS;
+        int mapped = 0;
+        int map_result = 0;
+        while (mapped < count)
         {
-            if (!allocate)
+            int block_num = map_block(inode_num, inode, (first_index + mapped) * block_size, true, &fresh[mapped]);
+            if (block_num <= 0)
             {
-                return 0; // No block and not allocating
+                map_result = (block_num < 0) ? block_num : E_OUT_OF_SPACE;
+                break;
             }
+            fresh[mapped] = fresh[mapped] || (uint32_t)(first_index + mapped) * block_size >= old_size;
+            blocks[mapped++] = block_num;
+        }
 
-            // Allocate new indirect block
-            int new_block = find_free_block();
-            if (new_block < 0)
+        // Write the mapped blocks, one run of physically contiguous blocks
+        // (all new or all old) at a time
+        for (int i = 0; i < mapped; )
+        {
+            int run = 1;
+            while (i + run < mapped && blocks[i + run] == blocks[i] + run && fresh[i + run] == fresh[i])
             {
-                return new_block;
+                run++;
             }
 
-            // Init with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
+            // Get offset w/in the first block and how many bytes to write
+            // to this run
+            int block_offset = current_offset % block_size;
+            int run_bytes = run * block_size - block_offset;
+            if (run_bytes > (len - bytes_written))
             {
-                free_block(new_block);
-                return result;
+                run_bytes = len - bytes_written;
             }
 
-            inode->indirect_block = new_block;
-        }
-
-        // Read the indirect block
-        uint8_t indirect_block[BLOCK_SIZE];
-        int result = vdisk_read(&disk, inode->indirect_block, indirect_block);
-        if (result != 0)
-        {
-            return result;
-        }
+            // Full blocks are written straight from the user buffer. For a
+            // partial first/last block, we need to read the existing block to
+            // preserve data, or start from 0s if it's a new block
+            uint8_t *buffers[MAX_RUN_BLOCKS];
+            int end_offset = block_offset + run_bytes; // relative to first block
+            for (int j = 0; j < run && result == 0; j++)
+            {
+                int start = j * block_size;
+                if ((j == 0 && block_offset > 0) || start + block_size > end_offset)
+                {
+                    buffers[j] = (j == 0) ? head : tail;
+                    if (fresh[i])
+                    {
+                        memset(buffers[j], 0, block_size);
+                    }
+                    else
+                    {
+                        result = vdisk_read(&disk, blocks[i] + j, buffers[j]);
+                    }
 
-        uint32_t *pointers = (uint32_t *)indirect_block;
+                    // Copy data from user buffer to the partial block
+                    int from = (j == 0) ? block_offset : 0;
+                    int to = (start + block_size > end_offset) ? end_offset - start : block_size;
+                    memcpy(buffers[j] + from, data + bytes_written + (start + from - block_offset), to - from);
+                }
+                else
+                {
+                    buffers[j] = data + bytes_written + (start - block_offset);
+                }
+            }
 
-        // Check if we need to allocate a new data block
-        if (pointers[block_index] == 0 && allocate)
-        {
-            int new_block = find_free_block();
-            if (new_block < 0)
+            // Write the run back to disk
+            if (result == 0)
             {
-                return new_block;
+                result = vdisk_writev(&disk, blocks[i], buffers, run);
             }
-
-            // Init with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            result = vdisk_write(&disk, new_block, zeros);
             if (result != 0)
             {
-                free_block(new_block);
+                // If some data was already written, update size and rtn count
+                // (the blocks mapped past it stay with the file)
+                inode->flags |= INODE_SPARSE;
+                if (bytes_written > 0)
+                {
+                    inode->size = ((uint32_t)current_offset > inode->size) ? (uint32_t)current_offset : inode->size;
+                    write_inode_if_changed(inode_num, inode, &before);
+                    return bytes_written;
+                }
+                write_inode_if_changed(inode_num, inode, &before);
                 return result;
             }
 
-            pointers[block_index] = new_block;
+            // Update counters
+            bytes_written += run_bytes;
+            current_offset += run_bytes;
+            i += run;
+        }
 
-            // Write the updated indirect block back
-            result = vdisk_write(&disk, inode->indirect_block, indirect_block);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+        // If error getting/allocating a block
+        if (map_result != 0)
+        {
+            // Update inode size to reflect changes so far (an indirect or
+            // tree block may have been allocated for the block that failed)
+            inode->flags |= INODE_SPARSE;
+            inode->size = ((uint32_t)current_offset > inode->size) ? (uint32_t)current_offset : inode->size;
+            write_inode_if_changed(inode_num, inode, &before);
+            return (bytes_written > 0) ? bytes_written : map_result;
         }
+    }
 
-        return pointers[block_index];
+    // 3. Update inode size if the write extended the file, and write the
+    //    inode back if that or a new block (in a hole) changed it
+    if ((uint32_t)current_offset > inode->size)
+    {
+        inode->size = current_offset;
     }
+    // Even if writing the inode fails, we have written data,
+    // so return count of bytes written so far
+    write_inode_if_changed(inode_num, inode, &before);
+
+    return bytes_written;
+}
 
-    // Double indirect blocks (260+)
-    block_index -= POINTERS_PER_BLOCK;
-    if ((uint32_t)block_index < (uint32_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+// Helper function to flag an inode as sparse if a write (or reservation)
+// from `offset` skips blocks past its end of file, leaving a hole
+static void mark_sparse_if_gap(inode_t *inode, uint32_t offset)
+{
+    if (offset / block_size > ((uint64_t)inode->size + block_size - 1) / block_size)
     {
-        // Check if we have a double indirect block
-        if (inode->double_indirect_block == 0)
-        {
-            if (!allocate)
-            {
-                return 0; // No block and not allocating
-            }
+        inode->flags |= INODE_SPARSE;
+    }
+}
 
-            // Allocate new double indirect block
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block;
-            }
+// Helper function to write an inode back if it differs from `before`
+static int write_inode_if_changed(int inode_num, inode_t *inode, const inode_t *before)
+{
+    if (memcmp(inode, before, sizeof(inode_t)) == 0)
+    {
+        return 0;
+    }
+    return write_inode(inode_num, inode);
+}
 
-            // Init with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+// Helper function to read an inode from disk
+// bypass_mount_check: if true, skip the mounted disk check (used only during mount operation)
+static int read_inode(int inode_num, inode_t *inode, bool bypass_mount_check)
+{
+    if (!disk_mounted && !bypass_mount_check)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
 
-            inode->double_indirect_block = new_block;
-        }
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
+    {
+        return E_INVALID_INODE;
+    }
 
-        // Read the double indirect block
-        uint8_t double_indirect_block[BLOCK_SIZE];
-        int result = vdisk_read(&disk, inode->double_indirect_block, double_indirect_block);
-        if (result != 0)
-        {
-            return result;
-        }
+    // Get the inode's block from the inode cache (read on first use)
+    uint8_t *records;
+    int result = load_inode_block(inode_num / inodes_per_block, &records);
+    if (result != 0)
+    {
+        return result;
+    }
 
-        uint32_t *pointers = (uint32_t *)double_indirect_block;
+    // Copy inode data
+    memcpy(inode, records + (inode_num % inodes_per_block) * INODE_SIZE, INODE_SIZE);
 
-        // Calculate which indirect block and entry within that block
-        int indirect_index = block_index / POINTERS_PER_BLOCK;
-        int entry_index = block_index % POINTERS_PER_BLOCK;
+    return 0;
+}
 
-        // Check if we need to allocate a new indirect block
-        if (pointers[indirect_index] == 0 && allocate)
+// Helper function to step an inode table walk to its next inode block
+// *inodes is set to the inodes_per_block inodes of the block, in place (valid
+// until the next step); the first one is inode # iter->block * inodes_per_block.
+// Returns 1, 0 past the last block (view released), or an error
+static int next_inode_block(inode_iter_t *iter, const inode_t **inodes)
+{
+    if (iter->view != NULL)
+    {
+        if (!iter->cached)
         {
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block;
-            }
+            release_view(iter->view);
+        }
+        iter->view = NULL;
+        iter->block++;
+    }
+    if (iter->block >= superblock.num_inode_blocks)
+    {
+        return 0;
+    }
 
-            // Init with zeros
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+    // Blocks in the inode cache may be newer than on disk
+    iter->cached = inode_cache[iter->block] != NULL;
+    if (iter->cached)
+    {
+        iter->view = inode_cache[iter->block];
+        *inodes = (const inode_t *)iter->view;
+        return 1;
+    }
+    int result = view_block(1 + iter->block, &iter->view); // +1 because block 0 is superblock
+    if (result != 0)
+    {
+        iter->view = NULL;
+        return result;
+    }
+    *inodes = (const inode_t *)iter->view;
+    return 1;
+}
 
-            pointers[indirect_index] = new_block;
+// Helper function to find (and take) the lowest free inode
+// The inode bitmap is built by the first call after mount, walking the inode
+// table once; from then on it is a word scan, with no disk access
+static int find_free_inode(void)
+{
+    uint32_t num_inodes = superblock.num_inode_blocks * inodes_per_block;
+    if (inode_bitmap == NULL)
+    {
+        inode_words = (num_inodes + 63) / 64;
+        inode_bitmap = (uint64_t *)calloc(inode_words, sizeof(uint64_t));
+        if (inode_bitmap == NULL)
+        {
+            return E_OUT_OF_SPACE; // see error.h
+        }
 
-            // Write the updated double indirect block back
-            result = vdisk_write(&disk, inode->double_indirect_block, double_indirect_block);
-            if (result != 0)
+        inode_iter_t iter = {0, NULL, false};
+        const inode_t *inodes = NULL;
+        int result;
+        while ((result = next_inode_block(&iter, &inodes)) > 0)
+        {
+            for (int slot = 0; slot < inodes_per_block; slot++)
             {
-                free_block(new_block);
-                return result;
+                uint32_t inode_num = iter.block * inodes_per_block + slot;
+                if (inodes[slot].valid)
+                {
+                    inode_bitmap[inode_num / 64] |= 1ULL << (inode_num % 64);
+                }
             }
         }
-        else if (pointers[indirect_index] == 0)
+        if (result < 0)
         {
-            return 0; // No block and not allocating
+            free(inode_bitmap);
+            inode_bitmap = NULL;
+            return result;
         }
+        if (num_inodes % 64 != 0)
+        {
+            inode_bitmap[inode_words - 1] |= ~0ULL << (num_inodes % 64); // past the last inode
+        }
+    }
+
+    for (uint32_t w = 0; w < inode_words; w++)
+    {
+        if (inode_bitmap[w] != ~0ULL)
+        {
+            int slot = __builtin_ctzll(~inode_bitmap[w]);
+            inode_bitmap[w] |= 1ULL << slot;
+            return w * 64 + slot;
+        }
+    }
+    return E_OUT_OF_INODES;
+}
+
+// Helper function to give an inode back to the inode bitmap
+static void free_inode(int inode_num)
+{
+    if (inode_bitmap != NULL)
+    {
+        inode_bitmap[inode_num / 64] &= ~(1ULL << (inode_num % 64));
+    }
+}
+
+// Helper function to write an inode to disk
+static int write_inode(int inode_num, inode_t *inode)
+{
+    if (!disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+
+    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * inodes_per_block)
+    {
+        return E_INVALID_INODE;
+    }
+
+    // Update the inode in the inode cache; its block is written back later
+    uint32_t index = inode_num / inodes_per_block;
+    uint8_t *records;
+    int result = load_inode_block(index, &records);
+    if (result != 0)
+    {
+        return result;
+    }
+    memcpy(records + (inode_num % inodes_per_block) * INODE_SIZE, inode, INODE_SIZE);
+
+    return mark_inode_block_dirty(index);
+}
+
+// Helper function to write the same inode record to `count` inodes, all in
+// one inode block, dirtying that block once
+static int write_inodes(const int *inode_nums, int count, const inode_t *inode)
+{
+    uint32_t index = inode_nums[0] / inodes_per_block;
+    uint8_t *records;
+    int result = load_inode_block(index, &records);
+    if (result != 0)
+    {
+        return result;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(records + (inode_nums[i] % inodes_per_block) * INODE_SIZE, inode, INODE_SIZE);
+    }
+
+    return mark_inode_block_dirty(index);
+}
 
-        // Read the indirect block
-        uint8_t indirect_block[BLOCK_SIZE];
-        result = vdisk_read(&disk, pointers[indirect_index], indirect_block);
+// Helper function to get the inodes of inode block `index` from the inode
+// cache, reading the block on first use. *records stays valid until unmount
+static int load_inode_block(uint32_t index, uint8_t **records)
+{
+    if (inode_cache[index] == NULL)
+    {
+        const uint8_t *view;
+        int result = view_block(1 + index, &view); // +1 because block 0 is superblock
         if (result != 0)
         {
             return result;
         }
+        void *copy = NULL;
+        if (posix_memalign(&copy, VDISK_BUF_ALIGN, block_size) != 0)
+        {
+            release_view(view);
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        memcpy(copy, view, block_size);
+        release_view(view);
+        inode_cache[index] = copy;
+    }
 
-        uint32_t *sub_pointers = (uint32_t *)indirect_block;
+    *records = inode_cache[index];
+    return 0;
+}
 
-        // Check if we need to allocate a new data block
-        if (sub_pointers[entry_index] == 0 && allocate)
+// Helper function to flag a cached inode block as changed
+// Writes all dirty blocks back once there are more than inode_dirty_limit
+static int mark_inode_block_dirty(uint32_t index)
+{
+    if (!inode_dirty[index])
+    {
+        inode_dirty[index] = true;
+        dirty_inode_blocks++;
+    }
+
+    return (dirty_inode_blocks > inode_dirty_limit) ? flush_inodes() : 0;
+}
+
+// Helper function to write the dirty inode blocks back to disk
+// Returns the first error (the block stays dirty)
+static int flush_inodes(void)
+{
+    int first_error = 0;
+    for (uint32_t i = 0; i < superblock.num_inode_blocks && dirty_inode_blocks > 0; i++)
+    {
+        if (!inode_dirty[i])
         {
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block;
-            }
+            continue;
+        }
+        int result = vdisk_write_meta(&disk, 1 + i, inode_cache[i]); // +1 because block 0 is superblock
+        if (result != 0)
+        {
+            first_error = (first_error != 0) ? first_error : result;
+            continue;
+        }
+        inode_dirty[i] = false;
+        dirty_inode_blocks--;
+    }
+    return first_error;
+}
 
-            // Init with zeros
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+// Helper function to set up an empty inode cache for the mounted volume
+static int setup_inode_cache(void)
+{
+    inode_cache = calloc(superblock.num_inode_blocks, sizeof(uint8_t *));
+    inode_dirty = calloc(superblock.num_inode_blocks, sizeof(bool));
+    dirty_inode_blocks = 0;
+    if (inode_cache == NULL || inode_dirty == NULL)
+    {
+        free_inode_cache();
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    return 0;
+}
 
-            sub_pointers[entry_index] = new_block;
+// Helper function to drop the inode cache (dirty blocks included)
+static void free_inode_cache(void)
+{
+    for (uint32_t i = 0; inode_cache != NULL && i < superblock.num_inode_blocks; i++)
+    {
+        free(inode_cache[i]);
+    }
+    free(inode_cache);
+    free(inode_dirty);
+    inode_cache = NULL;
+    inode_dirty = NULL;
+    dirty_inode_blocks = 0;
+}
 
-            // Write the updated indirect block back
-            result = vdisk_write(&disk, pointers[indirect_index], indirect_block);
-            if (result != 0)
+// Helper function to count the blocks a file of `size` bytes with no holes
+// holds through block pointers: its data blocks, plus the indirect blocks
+// that point to them
+static uint32_t blocks_for_size(uint32_t size)
+{
+    uint32_t data_blocks = ((uint64_t)size + block_size - 1) / block_size;
+    uint32_t blocks = data_blocks;
+    if (data_blocks > 4)
+    {
+        blocks++; // single indirect block
+    }
+    if (data_blocks > 4 + pointers_per_block)
+    {
+        uint32_t rest = data_blocks - 4 - pointers_per_block;
+        blocks += 1 + (rest + pointers_per_block - 1) / pointers_per_block; // double indirect + its children
+    }
+    return blocks;
+}
+
+// Helper function to order ints for qsort()
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper function to get the lowest bitmap word at or after `word` with a
+// free block (UINT32_MAX if none): up the summary until a level has a set bit
+// at or after the position, then down along the lowest set bits
+static uint32_t next_free_word(uint32_t word)
+{
+    uint32_t pos = word;
+    uint32_t words = bitmap_words; // # of positions the current level describes
+    for (int level = 0; level < summary_levels && pos < words; level++)
+    {
+        uint64_t bits = summary[level][pos / 64] & (~0ULL << (pos % 64));
+        if (bits != 0)
+        {
+            pos = (pos / 64) * 64 + __builtin_ctzll(bits);
+            for (int below = level - 1; below >= 0; below--)
             {
-                free_block(new_block);
-                return result;
+                pos = pos * 64 + __builtin_ctzll(summary[below][pos]);
             }
+            return pos;
         }
-
-        return sub_pointers[entry_index];
+        pos = pos / 64 + 1;
+        words = (words + 63) / 64;
+    }
+    return UINT32_MAX;
+}
+
+// Helper function to get the lowest free block at or after `from`
+// (UINT32_MAX if none)
+static uint32_t next_free_block(uint32_t from)
+{
+    if (from >= superblock.num_blocks)
+    {
+        return UINT32_MAX;
+    }
+    uint64_t free_bits = ~block_bitmap[from / 64] & (~0ULL << (from % 64));
+    if (free_bits != 0)
+    {
+        return (from / 64) * 64 + __builtin_ctzll(free_bits);
+    }
+    uint32_t word = next_free_word(from / 64 + 1);
+    return (word == UINT32_MAX) ? UINT32_MAX : word * 64 + __builtin_ctzll(~block_bitmap[word]);
+}
+
+// Helper function to get the first block in use in [from, limit), or `limit`
+// (the end of the volume if that comes first)
+static uint32_t free_run_end(uint32_t from, uint32_t limit)
+{
+    if (limit > superblock.num_blocks)
+    {
+        limit = superblock.num_blocks;
+    }
+    for (uint32_t b = from; b < limit; b = (b / 64 + 1) * 64)
+    {
+        uint64_t used = block_bitmap[b / 64] & (~0ULL << (b % 64));
+        if (used != 0)
+        {
+            uint32_t end = (b / 64) * 64 + __builtin_ctzll(used);
+            return (end < limit) ? end : limit;
+        }
+    }
+    return limit;
+}
+
+// Helper function to pick a free block near `goal` (UINT32_MAX if none
+// after it): the goal itself, or if another file's blocks already follow
+// (the goal is taken), the block ALLOC_SLACK blocks into the next free run
+// long enough, to leave that file room to grow; else any free block after it
+static uint32_t find_block_near(uint32_t goal)
+{
+    uint32_t block_num = next_free_block(goal);
+    if (block_num == goal || block_num == UINT32_MAX)
+    {
+        return block_num;
+    }
+    for (uint32_t start = block_num; start != UINT32_MAX; )
+    {
+        uint32_t end = free_run_end(start, start + ALLOC_SLACK + 1);
+        if (end == start + ALLOC_SLACK + 1)
+        {
+            return start + ALLOC_SLACK;
+        }
+        start = next_free_block(end);
+    }
+    return block_num;
+}
+
+// Helper function to find a free block
+// With goal-based allocation (see fs_set_allocation), a non-zero `goal` is
+// where the search starts (see find_block_near); otherwise, or if there's
+// no free block after the goal, the lowest free block is taken
+static int find_free_block(uint32_t goal)
+{
+    if (!disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+    int result = wait_for_bitmap();
+    if (result != 0)
+    {
+        return result;
+    }
+
+    if (alloc_policy == FS_ALLOC_GOAL && goal > 0)
+    {
+        uint32_t block_num = find_block_near(goal);
+        if (block_num != UINT32_MAX)
+        {
+            mark_block_used(block_num);
+            return block_num;
+        }
+    }
+
+    // Search for the first available block using first-available strategy:
+    // walk down the summary along the lowest set bits to the lowest bitmap
+    // word with a free block (superblock and inode blocks are always used)
+    if (summary[summary_levels - 1][0] == 0)
+    {
+        return E_OUT_OF_SPACE; // No free blocks available
+    }
+    uint32_t word = 0;
+    for (int level = summary_levels - 1; level >= 0; level--)
+    {
+        word = word * 64 + __builtin_ctzll(summary[level][word]);
+    }
+
+    // Lowest clear bit of the word, then mark the block as used
+    uint32_t block_num = word * 64 + __builtin_ctzll(~block_bitmap[word]);
+    mark_block_used(block_num);
+    return block_num;
+}
+
+// Helper function to build the summary levels of the block bitmap
+static int build_summary(void)
+{
+    uint32_t words = bitmap_words; // # of words of the level below
+    summary_levels = 0;
+    do
+    {
+        uint32_t level_words = (words + 63) / 64;
+        uint64_t *level = (uint64_t *)calloc(level_words, sizeof(uint64_t));
+        if (level == NULL)
+        {
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        for (uint32_t i = 0; i < words; i++)
+        {
+            bool has_free = (summary_levels == 0) ? block_bitmap[i] != ~0ULL
+                                                  : summary[summary_levels - 1][i] != 0;
+            if (has_free)
+            {
+                level[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+        summary[summary_levels++] = level;
+        words = level_words;
+    } while (words > 1);
+    return 0;
+}
+
+// Helper function to bring the summary up to date after a change of bitmap
+// word `word`. Stops at the first level whose word doesn't turn empty or
+// non-empty
+static void update_summary(uint32_t word)
+{
+    bool has_free = block_bitmap[word] != ~0ULL;
+    for (int level = 0; level < summary_levels; level++)
+    {
+        uint64_t *summary_word = &summary[level][word / 64];
+        bool had_free = *summary_word != 0;
+        if (has_free)
+        {
+            *summary_word |= 1ULL << (word % 64);
+        }
+        else
+        {
+            *summary_word &= ~(1ULL << (word % 64));
+        }
+        if ((*summary_word != 0) == had_free)
+        {
+            break;
+        }
+        has_free = !had_free;
+        word /= 64;
+    }
+}
+
+// Helper function to free the block bitmap and its summary
+static void free_block_bitmap(void)
+{
+    wait_for_bitmap(); // the background thread must be done with it
+    free(block_bitmap);
+    block_bitmap = NULL;
+    for (int level = 0; level < summary_levels; level++)
+    {
+        free(summary[level]);
+        summary[level] = NULL;
+    }
+    summary_levels = 0;
+}
+
+// Helper function to build the block bitmap of the volume being mounted and
+// its summary. In the `background`, the mounted disk handle is left alone
+// (it isn't thread-safe): the bitmap blocks or inode table are read through
+// handles of its own
+static int build_bitmap(bool background)
+{
+    int result = 0;
+    if (bitmap_load)
+    {
+        DISK own_disk;
+        DISK *diskp = &disk;
+        if (background)
+        {
+            diskp = &own_disk;
+            result = vdisk_on_mode(disk.name, diskp, disk.mode);
+            if (result != 0)
+            {
+                return result;
+            }
+            result = vdisk_set_sector_size(diskp, block_size);
+        }
+        if (result == 0)
+        {
+            result = transfer_bitmap(diskp, 1 + superblock.num_inode_blocks, superblock.num_bitmap_blocks,
+                                     block_bitmap, bitmap_words, false);
+        }
+        if (background)
+        {
+            bitmap_host_calls += own_disk.host_calls;
+            vdisk_off(&own_disk);
+        }
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    // Mark superblock, inode and bitmap blocks as used, and the bits past
+    // the last block so that searches never return them
+    for (uint32_t i = 0; i < 1 + superblock.num_inode_blocks + superblock.num_bitmap_blocks; i++)
+    {
+        mark_block_used(i);
+    }
+    if (superblock.num_blocks % 64 != 0)
+    {
+        block_bitmap[bitmap_words - 1] |= ~0ULL << (superblock.num_blocks % 64);
+    }
+
+    if (!bitmap_load)
+    {
+        result = scan_inodes(bitmap_threads, !background);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    // Summarize the bitmap for find_free_block()
+    return build_summary();
+}
+
+// Helper function run by the background thread of a lazy mount
+static void *bitmap_worker(void *arg)
+{
+    (void)arg;
+    bitmap_result = build_bitmap(true);
+    return NULL;
+}
+
+// Helper function to wait until the block bitmap is built
+// Returns the outcome of its construction (0 or the first error)
+static int wait_for_bitmap(void)
+{
+    if (bitmap_pending)
+    {
+        pthread_join(bitmap_thread, NULL);
+        bitmap_pending = false;
+    }
+    disk.host_calls += bitmap_host_calls;
+    bitmap_host_calls = 0;
+    return bitmap_result;
+}
+
+// Helper function to read (or write) the `words` words of a bitmap from (to)
+// the `num_blocks` blocks starting at `first_block`
+static int transfer_bitmap(DISK *diskp, uint32_t first_block, uint32_t num_blocks, uint64_t *bitmap, uint32_t words, bool write)
+{
+    uint8_t *block = vdisk_buf_get(diskp);
+    if (block == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    int result = 0;
+    uint8_t *bytes = (uint8_t *)bitmap;
+    size_t remaining = words * sizeof(uint64_t);
+    for (uint32_t i = 0; i < num_blocks && result == 0; i++)
+    {
+        size_t len = (remaining < (size_t)diskp->sector_size) ? remaining : (size_t)diskp->sector_size;
+        if (write)
+        {
+            memset(block, 0, diskp->sector_size);
+            memcpy(block, bytes, len);
+            result = vdisk_write(diskp, first_block + i, block);
+        }
+        else
+        {
+            result = vdisk_read(diskp, first_block + i, block);
+            memcpy(bytes, block, len);
+        }
+        bytes += len;
+        remaining -= len;
+    }
+
+    vdisk_buf_put(diskp, block);
+    return result;
+}
+
+// Helper function to write the in-memory superblock back to block 0
+static int write_superblock(void)
+{
+    uint8_t *block = vdisk_buf_get(&disk);
+    if (block == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    memset(block, 0, block_size);
+    memcpy(block, &superblock, sizeof(superblock_t));
+    int result = vdisk_write_meta(&disk, 0, block);
+    vdisk_buf_put(&disk, block);
+    return result;
+}
+
+// Helper function to mark a block as free
+// Returns 0, or the error the block bitmap could not be built with (see
+// wait_for_bitmap), in which case nothing is freed
+static int free_block(int block_num)
+{
+    if (!disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+    int result = wait_for_bitmap();
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // Mark the block as free in the bitmap
+    if (block_num > 0 && (uint32_t)block_num < superblock.num_blocks)
+    {
+        block_bitmap[block_num / 64] &= ~(1ULL << (block_num % 64));
+        update_summary(block_num / 64);
+    }
+    return 0;
+}
+
+// Helper functions to mark a block in the bitmap (callbacks for for_each_inode_block)
+static void mark_block_used(uint32_t block_num)
+{
+    if (block_num < superblock.num_blocks)
+    {
+        block_bitmap[block_num / 64] |= 1ULL << (block_num % 64);
+        update_summary(block_num / 64);
+    }
+}
+
+// Helper function to count a block of a file (see for_each_inode_block)
+static int count_block(uint32_t block_num)
+{
+    (void)block_num;
+    counted_blocks++;
+    return 0;
+}
+
+// Helper function to add a block of a file to collected_blocks (see
+// for_each_inode_block), to be freed once the whole walk has succeeded
+static int collect_block(uint32_t block_num)
+{
+    if (num_collected == collected_capacity)
+    {
+        uint32_t capacity = (collected_capacity > 0) ? 2 * collected_capacity : 256;
+        uint32_t *blocks = realloc(collected_blocks, capacity * sizeof(uint32_t));
+        if (blocks == NULL)
+        {
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        collected_blocks = blocks;
+        collected_capacity = capacity;
+    }
+    collected_blocks[num_collected++] = block_num;
+    return 0;
+}
+
+// Helper function to free the blocks in collected_blocks, then empty it
+// Either all of them are freed or, if the block bitmap could not be built,
+// none (only the first free_block() can fail)
+static int free_collected_blocks(void)
+{
+    int result = 0;
+    for (uint32_t i = 0; i < num_collected && result == 0; i++)
+    {
+        result = free_block(collected_blocks[i]);
+    }
+    num_collected = 0;
+    return result;
+}
+
+// Helper function to get a read-only view of a metadata block
+// (superblock, inode or indirect block)
+// When the disk is memory-mapped, *view points straight into the mapping (no copy);
+// otherwise the block is read into a pool buffer. Pair with release_view()
+static int view_block(uint32_t block_num, const uint8_t **view)
+{
+    const uint8_t *mapped = vdisk_map_sector(&disk, block_num);
+    if (mapped != NULL)
+    {
+        *view = mapped;
+        return 0;
+    }
+
+    uint8_t *buffer = vdisk_buf_get(&disk);
+    if (buffer == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    int result = vdisk_read_meta(&disk, block_num, buffer);
+    if (result != 0)
+    {
+        vdisk_buf_put(&disk, buffer);
+        return result;
+    }
+    *view = buffer;
+    return 0;
+}
+
+// Helper function to release a view obtained from view_block()
+static void release_view(const uint8_t *view)
+{
+    if (disk.map != NULL && view >= disk.map && view < disk.map + disk.map_len)
+    {
+        return; // points into the mapping, nothing to give back
+    }
+    vdisk_buf_put(&disk, (uint8_t *)view);
+}
+
+// Helper function to update one entry of an indirect block on disk
+static int set_block_pointer(uint32_t block_num, uint32_t index, uint32_t value)
+{
+    // Memory-mapped disk: patch the entry in place
+    uint8_t *mapped = vdisk_map_sector(&disk, block_num);
+    if (mapped != NULL)
+    {
+        ((uint32_t *)mapped)[index] = value;
+        return 0;
+    }
+
+    uint8_t *block = vdisk_buf_get(&disk);
+    if (block == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    int result = vdisk_read_meta(&disk, block_num, block);
+    if (result == 0)
+    {
+        ((uint32_t *)block)[index] = value;
+        result = vdisk_write_meta(&disk, block_num, block);
+    }
+    vdisk_buf_put(&disk, block);
+    return result;
+}
+
+// Helper function to allocate an indirect block (near `goal`, see
+// find_free_block) and init it with 0s
+// (data blocks are allocated as is, see get_block_for_offset)
+static int alloc_zeroed_block(uint32_t goal)
+{
+    int new_block = find_free_block(goal);
+    if (new_block < 0)
+    {
+        return new_block; // Error finding free block
+    }
+
+    uint8_t *zeros = vdisk_buf_get(&disk);
+    if (zeros == NULL)
+    {
+        free_block(new_block);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    memset(zeros, 0, block_size);
+    int result = vdisk_write_meta(&disk, new_block, zeros);
+    vdisk_buf_put(&disk, zeros);
+    if (result != 0)
+    {
+        free_block(new_block);
+        return result;
+    }
+    return new_block;
+}
+
+// Helper function to get block # for a specific file offset
+// A data block allocated here is not initialized: *fresh (if not NULL) is
+// set, and the caller must then write all of the block. Blocks are allocated
+// near `goal` (see find_free_block); an indirect block allocated on the way
+// takes the goal, and the data block the one after it
+static int get_block_for_offset(inode_t *inode, int offset, bool allocate, bool *fresh, uint32_t goal)
+{
+    if (fresh != NULL)
+    {
+        *fresh = false;
+    }
+    if (!disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+    if (offset < 0)
+    {
+        return E_INVALID_OFFSET;
+    }
+
+    // Calculate which block this offset falls into
+    int block_index = offset / block_size;
+
+    // Extent inodes map all their blocks through the extent tree
+    if (extent_inodes)
+    {
+        return get_extent_block(inode, block_index, allocate, fresh, goal);
+    }
+
+    // Direct blocks (0-3)
+    if (block_index < 4)
+    {
+        if (inode->direct_blocks[block_index] == 0 && allocate)
+        {
+            // Need to allocate a new block
+            int new_block = find_free_block(goal);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+            inode->direct_blocks[block_index] = new_block;
+            if (fresh != NULL)
+            {
+                *fresh = true;
+            }
+        }
+        return inode->direct_blocks[block_index];
+    }
+
+    // Indirect blocks (4 to 3 + pointers_per_block)
+    block_index -= 4;
+    if ((uint32_t)block_index < pointers_per_block)
+    {
+        // Check if we have an indirect block
+        if (inode->indirect_block == 0)
+        {
+            if (!allocate)
+            {
+                return 0; // No block and not allocating
+            }
+
+            // Allocate new indirect block
+            int new_block = alloc_zeroed_block(goal);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+            inode->indirect_block = new_block;
+            goal = (goal != 0) ? new_block + 1 : 0;
+        }
+
+        // Look up the entry in the indirect block
+        const uint8_t *view;
+        int result = view_block(inode->indirect_block, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        uint32_t data_block = ((const uint32_t *)view)[block_index];
+        release_view(view);
+
+        // Check if we need to allocate a new data block
+        if (data_block == 0 && allocate)
+        {
+            int new_block = find_free_block(goal);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Write the updated indirect block back
+            result = set_block_pointer(inode->indirect_block, block_index, new_block);
+            if (result != 0)
+            {
+                free_block(new_block);
+                return result;
+            }
+            data_block = new_block;
+            if (fresh != NULL)
+            {
+                *fresh = true;
+            }
+        }
+
+        return data_block;
+    }
+
+    // Double indirect blocks (4 + pointers_per_block and up)
+    block_index -= pointers_per_block;
+    if ((uint32_t)block_index < (uint32_t)pointers_per_block * pointers_per_block)
+    {
+        // Check if we have a double indirect block
+        if (inode->double_indirect_block == 0)
+        {
+            if (!allocate)
+            {
+                return 0; // No block and not allocating
+            }
+
+            // Allocate new double indirect block
+            int new_block = alloc_zeroed_block(goal);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+            inode->double_indirect_block = new_block;
+            goal = (goal != 0) ? new_block + 1 : 0;
+        }
+
+        // Calculate which indirect block and entry within that block
+        int indirect_index = block_index / pointers_per_block;
+        int entry_index = block_index % pointers_per_block;
+
+        // Look up the indirect block in the double indirect block
+        const uint8_t *view;
+        int result = view_block(inode->double_indirect_block, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        uint32_t indirect = ((const uint32_t *)view)[indirect_index];
+        release_view(view);
+
+        // Check if we need to allocate a new indirect block
+        if (indirect == 0 && allocate)
+        {
+            int new_block = alloc_zeroed_block(goal);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+            goal = (goal != 0) ? new_block + 1 : 0;
+
+            // Write the updated double indirect block back
+            result = set_block_pointer(inode->double_indirect_block, indirect_index, new_block);
+            if (result != 0)
+            {
+                free_block(new_block);
+                return result;
+            }
+            indirect = new_block;
+        }
+        else if (indirect == 0)
+        {
+            return 0; // No block and not allocating
+        }
+
+        // Look up the entry in the indirect block
+        result = view_block(indirect, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        uint32_t data_block = ((const uint32_t *)view)[entry_index];
+        release_view(view);
+
+        // Check if we need to allocate a new data block
+        if (data_block == 0 && allocate)
+        {
+            int new_block = find_free_block(goal);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Write the updated indirect block back
+            result = set_block_pointer(indirect, entry_index, new_block);
+            if (result != 0)
+            {
+                free_block(new_block);
+                return result;
+            }
+            data_block = new_block;
+            if (fresh != NULL)
+            {
+                *fresh = true;
+            }
+        }
+
+        return data_block;
     }
 
     return E_INVALID_OFFSET; // Offset too large for this file system
 }
+
+// Helper function to size an entry of an extent tree node of `depth`
+static size_t extent_entry_size(uint32_t depth)
+{
+    return (depth > 0) ? sizeof(extent_index_t) : sizeof(extent_t);
+}
+
+// Helper function to get the # of entries of a node whose first block is at
+// most `index` (binary search, entries are sorted by first file block)
+static uint32_t extent_upper_bound(const extent_node_t *node, uint32_t index)
+{
+    size_t size = extent_entry_size(node->depth);
+    uint32_t lo = 0;
+    uint32_t hi = node->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (*(const uint32_t *)(node->entries + mid * size) <= index)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Helper function to release the tree blocks of a path
+static void release_extent_path(extent_path_t *path)
+{
+    for (int l = 1; l < path->levels; l++)
+    {
+        vdisk_buf_put(&disk, path->nodes[l].buffer);
+    }
+    path->levels = 0;
+}
+
+// Helper function to walk down the extent tree of an inode to the leaf
+// file block `index` is routed to, keeping a copy of each tree block on the way
+// Pair with release_extent_path() (also on failure)
+static int find_extent_path(inode_t *inode, uint32_t index, extent_path_t *path)
+{
+    extent_node_t *node = &path->nodes[0];
+    path->inode = inode;
+    path->levels = 1;
+    node->block = 0;
+    node->buffer = NULL;
+    node->entries = (uint8_t *)inode->root;
+    node->count = inode->entries;
+    node->depth = inode->depth;
+    node->capacity = (node->depth > 0) ? ROOT_INDEXES : ROOT_EXTENTS;
+    node->lo = 0;
+    node->hi = UINT32_MAX;
+    if (node->depth > EXTENT_MAX_DEPTH || node->count > node->capacity)
+    {
+        return E_CORRUPT_DISK;
+    }
+
+    while (node->depth > 0)
+    {
+        if (node->count == 0)
+        {
+            return E_CORRUPT_DISK; // index nodes are never empty
+        }
+
+        // Follow the last entry starting at or before `index` (the first if none)
+        const extent_index_t *indexes = (const extent_index_t *)node->entries;
+        uint32_t slot = extent_upper_bound(node, index);
+        node->slot = (slot > 0) ? slot - 1 : 0;
+
+        extent_node_t *child = &path->nodes[path->levels];
+        child->buffer = vdisk_buf_get(&disk);
+        if (child->buffer == NULL)
+        {
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        path->levels++;
+        child->block = indexes[node->slot].block;
+        int result = vdisk_read_meta(&disk, child->block, child->buffer);
+        if (result != 0)
+        {
+            return result;
+        }
+        child->entries = child->buffer + sizeof(extent_header_t);
+        child->count = ((const extent_header_t *)child->buffer)->entries;
+        child->depth = node->depth - 1;
+        child->capacity = (block_size - sizeof(extent_header_t)) / extent_entry_size(child->depth);
+        child->lo = (node->slot > 0) ? indexes[node->slot].logical : node->lo;
+        child->hi = (node->slot + 1 < node->count) ? indexes[node->slot + 1].logical : node->hi;
+        if (child->count > child->capacity)
+        {
+            return E_CORRUPT_DISK;
+        }
+        node = child;
+    }
+    return 0;
+}
+
+// Helper function to write an extent tree node back (the root goes to the
+// inode, which the caller writes)
+static int store_extent_node(inode_t *inode, extent_node_t *node)
+{
+    if (node->block == 0)
+    {
+        inode->entries = node->count;
+        inode->depth = node->depth;
+        return 0;
+    }
+    extent_header_t *header = (extent_header_t *)node->buffer;
+    header->entries = node->count;
+    header->depth = node->depth;
+    return vdisk_write_meta(&disk, node->block, node->buffer);
+}
+
+// Helper function to put an entry at position `pos` of a node with room for it
+static void put_extent_entry(extent_node_t *node, uint32_t pos, const void *entry)
+{
+    size_t size = extent_entry_size(node->depth);
+    memmove(node->entries + (pos + 1) * size, node->entries + pos * size, (node->count - pos) * size);
+    memcpy(node->entries + pos * size, entry, size);
+    node->count++;
+}
+
+// Helper function to insert an entry at position `pos` of node `level` of a
+// path, splitting full nodes on the way up
+// A full node moves its upper half to a new block whose index entry goes to
+// the parent; when the entry is appended, only the entry moves, so files
+// written sequentially leave their leaves full. A full root moves all its
+// entries to a new block and points to it, one level higher
+static int insert_extent_entry(extent_path_t *path, int level, uint32_t pos, const void *entry)
+{
+    // 1. Take the blocks of all the splits up front, so that running out of
+    //    space leaves the tree as it was
+    int needed = 0;
+    while (needed <= level && path->nodes[level - needed].count == path->nodes[level - needed].capacity)
+    {
+        needed++;
+    }
+    if (needed > level && path->nodes[0].depth >= EXTENT_MAX_DEPTH)
+    {
+        return E_OUT_OF_SPACE; // the tree can't grow any deeper
+    }
+    uint32_t spare[EXTENT_MAX_DEPTH + 1];
+    for (int i = 0; i < needed; i++)
+    {
+        int block_num = find_free_block(0); // tree blocks stay out of the way of the data
+        if (block_num < 0)
+        {
+            while (i > 0)
+            {
+                free_block(spare[--i]);
+            }
+            return block_num;
+        }
+        spare[i] = block_num;
+    }
+
+    // 2. Insert, splitting from `level` up as long as nodes are full
+    extent_index_t carry;
+    const void *next_entry = entry;
+    for (int l = level; ; l--)
+    {
+        extent_node_t *node = &path->nodes[l];
+        if (node->count < node->capacity)
+        {
+            put_extent_entry(node, pos, next_entry);
+            return store_extent_node(path->inode, node);
+        }
+
+        extent_node_t right;
+        right.block = spare[--needed];
+        right.buffer = vdisk_buf_get(&disk);
+        if (right.buffer == NULL)
+        {
+            while (needed >= 0)
+            {
+                free_block(spare[needed--]);
+            }
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        memset(right.buffer, 0, block_size);
+        right.entries = right.buffer + sizeof(extent_header_t);
+        right.depth = node->depth;
+        right.capacity = (block_size - sizeof(extent_header_t)) / extent_entry_size(right.depth);
+        size_t size = extent_entry_size(node->depth);
+
+        // Full root: everything moves down into the new block
+        if (l == 0)
+        {
+            memcpy(right.entries, node->entries, node->count * size);
+            right.count = node->count;
+            put_extent_entry(&right, pos, next_entry);
+            int result = store_extent_node(path->inode, &right);
+            carry.logical = *(const uint32_t *)right.entries;
+            carry.block = right.block;
+            vdisk_buf_put(&disk, right.buffer);
+            if (result != 0)
+            {
+                return result;
+            }
+            node->depth++;
+            node->count = 0;
+            node->capacity = ROOT_INDEXES;
+            put_extent_entry(node, 0, &carry);
+            return store_extent_node(path->inode, node);
+        }
+
+        // Split, and put the entry on its side
+        uint32_t half = (pos == node->count) ? node->count : node->count / 2;
+        right.count = node->count - half;
+        memcpy(right.entries, node->entries + half * size, right.count * size);
+        node->count = half;
+        if (pos < half || (pos == half && right.count > 0))
+        {
+            put_extent_entry(node, pos, next_entry);
+        }
+        else
+        {
+            put_extent_entry(&right, pos - half, next_entry);
+        }
+        int result = store_extent_node(path->inode, node);
+        if (result == 0)
+        {
+            result = store_extent_node(path->inode, &right);
+        }
+        carry.logical = *(const uint32_t *)right.entries;
+        carry.block = right.block;
+        vdisk_buf_put(&disk, right.buffer);
+        if (result != 0)
+        {
+            while (needed > 0)
+            {
+                free_block(spare[--needed]);
+            }
+            return result;
+        }
+
+        // The parent gets the new block, right after the entry followed down
+        next_entry = &carry;
+        pos = path->nodes[l - 1].slot + 1;
+    }
+}
+
+// Helper function to get the # of blocks of an extent, written or not
+static uint32_t extent_length(const extent_t *extent)
+{
+    return extent->length & ~EXTENT_UNWRITTEN;
+}
+
+// Helper function to find the extent of the leaf of a path that holds file
+// block `index`: its position in the leaf, or -1 if the block is in a hole
+static int find_extent(const extent_path_t *path, uint32_t index)
+{
+    const extent_node_t *leaf = &path->nodes[path->levels - 1];
+    uint32_t pos = extent_upper_bound(leaf, index);
+    if (pos == 0)
+    {
+        return -1;
+    }
+    const extent_t *extent = (const extent_t *)leaf->entries + pos - 1;
+    return (index - extent->logical < extent_length(extent)) ? (int)pos - 1 : -1;
+}
+
+// Helper function to map file block `index` (a hole) to block `physical`
+// in the leaf of a path. The block joins the extent before or after it when
+// it directly follows/precedes it on disk, otherwise it gets its own extent
+static int add_extent_block(extent_path_t *path, uint32_t index, uint32_t physical)
+{
+    extent_node_t *leaf = &path->nodes[path->levels - 1];
+    extent_t *extents = (extent_t *)leaf->entries;
+    uint32_t pos = extent_upper_bound(leaf, index);
+    extent_t *prev = (pos > 0) ? &extents[pos - 1] : NULL;
+    extent_t *next = (pos < leaf->count) ? &extents[pos] : NULL;
+
+    // (unwritten extents don't take written blocks)
+    if (prev != NULL && (prev->length & EXTENT_UNWRITTEN) != 0)
+    {
+        prev = NULL;
+    }
+    if (next != NULL && (next->length & EXTENT_UNWRITTEN) != 0)
+    {
+        next = NULL;
+    }
+
+    if (prev != NULL && prev->logical + prev->length == index && prev->physical + prev->length == physical)
+    {
+        prev->length++;
+        if (next != NULL && next->logical == index + 1 && next->physical == physical + 1)
+        {
+            // The hole between two extents is filled: they become one
+            prev->length += next->length;
+            memmove(next, next + 1, (leaf->count - pos - 1) * sizeof(extent_t));
+            leaf->count--;
+        }
+        return store_extent_node(path->inode, leaf);
+    }
+    if (next != NULL && next->logical == index + 1 && next->physical == physical + 1)
+    {
+        next->logical--;
+        next->physical--;
+        next->length++;
+        return store_extent_node(path->inode, leaf);
+    }
+
+    extent_t extent = { index, physical, 1 };
+    return insert_extent_entry(path, path->levels - 1, pos, &extent);
+}
+
+// Helper function to write file block `index` of the unwritten extent at
+// `pos` in the leaf of a path: the block stays where it is, and moves to a
+// written extent (the one before, if it directly precedes it). Returns the
+// block #
+static int write_unwritten_block(extent_path_t *path, uint32_t pos, uint32_t index)
+{
+    extent_node_t *leaf = &path->nodes[path->levels - 1];
+    extent_t *extent = (extent_t *)leaf->entries + pos;
+    uint32_t length = extent_length(extent);
+    uint32_t skip = index - extent->logical;
+    uint32_t physical = extent->physical + skip;
+    int result;
+
+    if (length == 1)
+    {
+        // Only block of the extent: the extent turns written
+        extent->length = 1;
+        extent_t *prev = (pos > 0) ? extent - 1 : NULL;
+        if (prev != NULL && (prev->length & EXTENT_UNWRITTEN) == 0 &&
+            prev->logical + prev->length == index && prev->physical + prev->length == physical)
+        {
+            prev->length++;
+            memmove(extent, extent + 1, (leaf->count - pos - 1) * sizeof(extent_t));
+            leaf->count--;
+        }
+        result = store_extent_node(path->inode, leaf);
+    }
+    else if (skip == 0 || skip == length - 1)
+    {
+        // First or last block: the extent loses it, then it's added as written
+        extent_t saved = *extent;
+        if (skip == 0)
+        {
+            extent->logical++;
+            extent->physical++;
+        }
+        extent->length--;
+        result = add_extent_block(path, index, physical);
+        if (result != 0)
+        {
+            *extent = saved;
+        }
+    }
+    else
+    {
+        // Block in the middle: the blocks after it get an unwritten extent
+        // of their own, then it's added as written (the tree may have
+        // changed: look its leaf up again)
+        extent_t saved = *extent;
+        extent_t after = { index + 1, physical + 1, (length - skip - 1) | EXTENT_UNWRITTEN };
+        extent->length = skip | EXTENT_UNWRITTEN;
+        result = insert_extent_entry(path, path->levels - 1, pos + 1, &after);
+        if (result != 0)
+        {
+            *extent = saved;
+            return result;
+        }
+        inode_t *inode = path->inode;
+        release_extent_path(path);
+        result = find_extent_path(inode, index, path);
+        if (result == 0)
+        {
+            result = add_extent_block(path, index, physical);
+        }
+        if (result != 0)
+        {
+            free_block(physical); // left as a hole
+        }
+    }
+    return (result != 0) ? result : (int)physical;
+}
+
+// Helper function to find a run of up to `want` free blocks, preferably all
+// of them: the first free run that long from `goal` on (then from the start
+// of the volume), else the longest one. Returns its first block and sets
+// *length, or returns UINT32_MAX if no block is free
+static uint32_t find_free_run(uint32_t goal, uint32_t want, uint32_t *length)
+{
+    uint32_t best = UINT32_MAX;
+    *length = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t from = (pass == 0) ? goal : 0;
+        uint32_t limit = (pass == 0) ? superblock.num_blocks : goal;
+        for (uint32_t start = next_free_block(from); start < limit; )
+        {
+            uint32_t end = free_run_end(start, (start + want < start) ? UINT32_MAX : start + want);
+            if (end - start > *length)
+            {
+                best = start;
+                *length = end - start;
+                if (*length == want)
+                {
+                    return best;
+                }
+            }
+            start = next_free_block(end);
+        }
+    }
+    return best;
+}
+
+// Helper function to reserve unwritten blocks for the holes among file
+// blocks [index, end) of an extent inode, one free run (and unwritten
+// extent) at a time, each run starting from where the last one ended
+static int reserve_blocks(inode_t *inode, uint32_t index, uint32_t end)
+{
+    uint32_t goal = 0;
+    while (index < end)
+    {
+        extent_path_t path;
+        int result = find_extent_path(inode, index, &path);
+        if (result != 0)
+        {
+            release_extent_path(&path);
+            return result;
+        }
+
+        // Skip blocks the file already has
+        const extent_node_t *leaf = &path.nodes[path.levels - 1];
+        const extent_t *extents = (const extent_t *)leaf->entries;
+        int found = find_extent(&path, index);
+        if (found >= 0)
+        {
+            index = extents[found].logical + extent_length(&extents[found]);
+            release_extent_path(&path);
+            continue;
+        }
+
+        // The hole goes up to the next extent (or the end of the leaf's range)
+        uint32_t pos = extent_upper_bound(leaf, index);
+        uint32_t hole_end = (pos < leaf->count) ? extents[pos].logical : leaf->hi;
+        hole_end = (hole_end < end) ? hole_end : end;
+
+        // Take a free run for it and map it with an unwritten extent
+        uint32_t length;
+        uint32_t start = find_free_run(goal, hole_end - index, &length);
+        if (start == UINT32_MAX)
+        {
+            release_extent_path(&path);
+            return E_OUT_OF_SPACE; // No free blocks available
+        }
+        for (uint32_t b = start; b < start + length; b++)
+        {
+            mark_block_used(b);
+        }
+        extent_t extent = { index, start, length | EXTENT_UNWRITTEN };
+        result = insert_extent_entry(&path, path.levels - 1, pos, &extent);
+        release_extent_path(&path);
+        if (result != 0)
+        {
+            for (uint32_t b = start; b < start + length; b++)
+            {
+                free_block(b);
+            }
+            return result;
+        }
+        index += length;
+        goal = start + length;
+    }
+    return 0;
+}
+
+// Helper function to get block # for file block `index` of an extent inode
+// (see get_block_for_offset). An unwritten block is a hole to lookups; when
+// allocating, it's written where it is
+static int get_extent_block(inode_t *inode, uint32_t index, bool allocate, bool *fresh, uint32_t goal)
+{
+    extent_path_t path;
+    int result = find_extent_path(inode, index, &path);
+    int pos = (result == 0) ? find_extent(&path, index) : -1;
+    if (pos >= 0)
+    {
+        const extent_t *extent = (const extent_t *)path.nodes[path.levels - 1].entries + pos;
+        if ((extent->length & EXTENT_UNWRITTEN) == 0)
+        {
+            result = extent->physical + (index - extent->logical);
+        }
+        else if (allocate)
+        {
+            result = write_unwritten_block(&path, pos, index);
+            if (result > 0 && fresh != NULL)
+            {
+                *fresh = true;
+            }
+        }
+    }
+    else if (result == 0 && allocate)
+    {
+        int new_block = find_free_block(goal);
+        result = new_block;
+        if (new_block > 0)
+        {
+            result = add_extent_block(&path, index, new_block);
+            if (result != 0)
+            {
+                free_block(new_block);
+            }
+            else
+            {
+                result = new_block;
+                if (fresh != NULL)
+                {
+                    *fresh = true;
+                }
+            }
+        }
+    }
+    release_extent_path(&path);
+    return result;
+}
+
+// Helper function to get the block map of an inode, recycling the least
+// recently used one if needed
+static block_map_t *get_block_map(int inode_num)
+{
+    block_map_t *oldest = &block_maps[0];
+    for (int m = 0; m < BLOCK_MAPS; m++)
+    {
+        if (block_maps[m].used && block_maps[m].inode_num == inode_num)
+        {
+            block_maps[m].last_use = ++map_clock;
+            return &block_maps[m];
+        }
+        if (!block_maps[m].used || (oldest->used && block_maps[m].last_use < oldest->last_use))
+        {
+            oldest = &block_maps[m];
+        }
+    }
+
+    // The recycled map keeps its array, all entries unknown again
+    oldest->used = true;
+    oldest->inode_num = inode_num;
+    oldest->last_use = ++map_clock;
+    oldest->goal = 0;
+    if (oldest->blocks != NULL)
+    {
+        memset(oldest->blocks, 0xff, oldest->capacity * sizeof(uint32_t)); // all MAP_UNKNOWN
+    }
+    return oldest;
+}
+
+// Helper function to grow a block map to at least `count` entries (doubling)
+// New entries are MAP_UNKNOWN
+static int grow_block_map(block_map_t *map, uint32_t count)
+{
+    if (count <= map->capacity)
+    {
+        return 0;
+    }
+    uint32_t capacity = (map->capacity > 0) ? map->capacity : pointers_per_block;
+    while (capacity < count)
+    {
+        capacity *= 2;
+    }
+    uint32_t *blocks = realloc(map->blocks, capacity * sizeof(uint32_t));
+    if (blocks == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    memset(blocks + map->capacity, 0xff, (capacity - map->capacity) * sizeof(uint32_t));
+    map->blocks = blocks;
+    map->capacity = capacity;
+    return 0;
+}
+
+// Helper function to fill the block map entries covered by the indirect
+// block that maps file block `index` (a whole indirect block at a time)
+static int fill_block_map(block_map_t *map, inode_t *inode, uint32_t index)
+{
+    // Locate the indirect block and the file block its first entry maps
+    uint32_t indirect = inode->indirect_block;
+    uint32_t first = 4;
+    if (index - 4 >= pointers_per_block)
+    {
+        uint32_t slot = (index - 4 - pointers_per_block) / pointers_per_block;
+        if (slot >= pointers_per_block)
+        {
+            return E_INVALID_OFFSET; // Offset too large for this file system
+        }
+        first = 4 + pointers_per_block + slot * pointers_per_block;
+        indirect = 0;
+        if (inode->double_indirect_block != 0)
+        {
+            const uint8_t *view;
+            int result = view_block(inode->double_indirect_block, &view);
+            if (result != 0)
+            {
+                return result;
+            }
+            indirect = ((const uint32_t *)view)[slot];
+            release_view(view);
+        }
+    }
+
+    // Grow the map to cover that range
+    int result = grow_block_map(map, first + pointers_per_block);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // No indirect block: none of its entries is mapped
+    if (indirect == 0)
+    {
+        memset(map->blocks + first, 0, pointers_per_block * sizeof(uint32_t));
+        return 0;
+    }
+    const uint8_t *view;
+    result = view_block(indirect, &view);
+    if (result != 0)
+    {
+        return result;
+    }
+    memcpy(map->blocks + first, view, pointers_per_block * sizeof(uint32_t));
+    release_view(view);
+    return 0;
+}
+
+// Helper function to fill the block map entries of an extent inode covered
+// by the leaf that maps file block `index` (a whole leaf at a time: the
+// blocks of a mostly contiguous file come from one or two tree blocks)
+static int fill_extent_map(block_map_t *map, inode_t *inode, uint32_t index)
+{
+    extent_path_t path;
+    int result = find_extent_path(inode, index, &path);
+    if (result != 0)
+    {
+        release_extent_path(&path);
+        return result;
+    }
+    const extent_node_t *leaf = &path.nodes[path.levels - 1];
+    const extent_t *extents = (const extent_t *)leaf->entries;
+
+    // The last leaf covers all blocks to the end of the file and beyond: the
+    // map gets all it has room for
+    uint32_t end = leaf->hi;
+    if (end == UINT32_MAX)
+    {
+        end = index + 1;
+        if (leaf->count > 0 && extents[leaf->count - 1].logical + extent_length(&extents[leaf->count - 1]) > end)
+        {
+            end = extents[leaf->count - 1].logical + extent_length(&extents[leaf->count - 1]);
+        }
+    }
+    result = grow_block_map(map, end);
+    if (result == 0)
+    {
+        if (leaf->hi == UINT32_MAX)
+        {
+            end = map->capacity;
+        }
+        memset(map->blocks + leaf->lo, 0, (end - leaf->lo) * sizeof(uint32_t));
+        for (uint32_t e = 0; e < leaf->count; e++)
+        {
+            if ((extents[e].length & EXTENT_UNWRITTEN) != 0)
+            {
+                continue; // reads as a hole
+            }
+            for (uint32_t b = 0; b < extents[e].length && extents[e].logical + b < end; b++)
+            {
+                map->blocks[extents[e].logical + b] = extents[e].physical + b;
+            }
+        }
+    }
+    release_extent_path(&path);
+    return result;
+}
+
+// Helper function to get block # for a specific file offset of an inode
+// Same as get_block_for_offset(), but blocks behind (double) indirect blocks,
+// or all blocks of an extent inode, are looked up in the inode's in-memory
+// block map, filled on first access and updated as blocks are allocated.
+// Repeated lookups cost no I/O. New blocks go near allocation_goal()
+static int map_block(int inode_num, inode_t *inode, uint32_t offset, bool allocate, bool *fresh)
+{
+    uint32_t index = offset / block_size;
+    bool direct = index < 4 && !extent_inodes;
+    if (fresh != NULL)
+    {
+        *fresh = false;
+    }
+
+    block_map_t *map = NULL;
+    if (direct)
+    {
+        if (inode->direct_blocks[index] != 0 || !allocate)
+        {
+            return inode->direct_blocks[index];
+        }
+    }
+    else
+    {
+        map = get_block_map(inode_num);
+        if (index >= map->capacity || map->blocks[index] == MAP_UNKNOWN)
+        {
+            int result = extent_inodes ? fill_extent_map(map, inode, index) : fill_block_map(map, inode, index);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+        if (map->blocks[index] != 0 || !allocate)
+        {
+            return map->blocks[index];
+        }
+    }
+
+    // Allocate through the inode, then record the new block
+    if (map == NULL)
+    {
+        map = get_block_map(inode_num);
+    }
+    bool allocated = false;
+    int block_num = get_block_for_offset(inode, offset, true, &allocated, allocation_goal(map, inode, index));
+    if (block_num > 0 && !direct)
+    {
+        map->blocks[index] = block_num;
+    }
+    if (allocated)
+    {
+        map->goal = block_num + 1;
+    }
+    if (fresh != NULL)
+    {
+        *fresh = allocated;
+    }
+    return block_num;
+}
+
+// Helper function to pick the goal of a block allocated for file block
+// `index` with goal-based allocation (0: none, the lowest free block): the
+// block after the one holding the previous file block, or when that's a hole
+// (or not in the map), the block after the last one allocated to the inode
+static uint32_t allocation_goal(const block_map_t *map, const inode_t *inode, uint32_t index)
+{
+    if (alloc_policy != FS_ALLOC_GOAL)
+    {
+        return 0;
+    }
+    uint32_t prev = 0;
+    if (index > 0 && index - 1 < 4 && !extent_inodes)
+    {
+        prev = inode->direct_blocks[index - 1];
+    }
+    else if (index > 0 && index - 1 < map->capacity && map->blocks[index - 1] != MAP_UNKNOWN)
+    {
+        prev = map->blocks[index - 1];
+    }
+    return (prev != 0) ? prev + 1 : map->goal;
+}
+
+// Helper function to drop the block map of an inode whose blocks are freed
+static void forget_block_map(int inode_num)
+{
+    for (int m = 0; m < BLOCK_MAPS; m++)
+    {
+        if (block_maps[m].used && block_maps[m].inode_num == inode_num)
+        {
+            block_maps[m].used = false;
+        }
+    }
+}
+
+// Helper function to free every block map (mount/unmount)
+static void reset_block_maps(void)
+{
+    for (int m = 0; m < BLOCK_MAPS; m++)
+    {
+        free(block_maps[m].blocks);
+    }
+    memset(block_maps, 0, sizeof(block_maps));
+}
+
+// Helper function to map a run of physically contiguous blocks
+// Maps the block holding `offset` and extends the run over the following
+// blocks of the `len` bytes from there as long as they directly follow each
+// other on disk (at most MAX_RUN_BLOCKS). Returns the # of blocks in the run
+// and sets *first_block, or returns <=0 if the first block is a hole/error
+static int map_run(int inode_num, inode_t *inode, uint32_t offset, int len, bool allocate, uint32_t *first_block)
+{
+    int block_num = map_block(inode_num, inode, offset, allocate, NULL);
+    if (block_num <= 0)
+    {
+        return block_num;
+    }
+    *first_block = block_num;
+
+    int last_index = (offset + len - 1) / block_size;
+    int run = 1;
+    for (int index = offset / block_size + 1; index <= last_index && run < MAX_RUN_BLOCKS; index++)
+    {
+        int next = map_block(inode_num, inode, index * block_size, allocate, NULL);
+        if (next != block_num + run)
+        {
+            break; // hole, error or discontiguity: next run starts there
+        }
+        run++;
+    }
+    return run;
+}
+
+// Helper function to read many blocks with all reads in flight at once
+// views[i] is set to the content of blocks[i]: in place if the disk is mapped,
+// otherwise read into buffers + i * block_size
+static int read_blocks(const uint32_t *blocks, int count, uint8_t *buffers, const uint8_t **views)
+{
+    readahead_drain(); // completions reaped below must all be ours
+    return read_blocks_from(&disk, blocks, count, buffers, views);
+}
+
+// Same as read_blocks(), on any disk handle (no readahead to wait for)
+static int read_blocks_from(DISK *diskp, const uint32_t *blocks, int count, uint8_t *buffers, const uint8_t **views)
+{
+    int submitted = 0;
+    int completed = 0;
+    int first_error = 0;
+
+    while (completed < count)
+    {
+        // Keep as many reads in flight as the engine accepts
+        while (submitted < count)
+        {
+            const uint8_t *mapped = vdisk_map_sector(diskp, blocks[submitted]);
+            if (mapped != NULL)
+            {
+                views[submitted++] = mapped;
+                completed++;
+                continue;
+            }
+
+            uint8_t *buffer = buffers + (size_t)submitted * block_size;
+            int result = vdisk_submit_read(diskp, blocks[submitted], buffer, submitted);
+            if (result == vdisk_EBUSY)
+            {
+                break; // queue full: reap some completions first
+            }
+            if (result != 0)
+            {
+                first_error = (first_error != 0) ? first_error : result;
+                completed++;
+            }
+            views[submitted++] = buffer;
+        }
+        if (completed == count)
+        {
+            break;
+        }
+
+        vdisk_completion done[16];
+        int n = vdisk_complete(diskp, done, 16, 1);
+        if (n < 0)
+        {
+            vdisk_aio_exit(diskp); // drops whatever is still in flight
+            return n;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (done[i].result != 0 && first_error == 0)
+            {
+                first_error = done[i].result;
+            }
+        }
+        completed += n;
+    }
+
+    return first_error;
+}
+
+// Helper function to visit every block referenced by an indirect block
+// Stops at the first error `visit` returns
+static int visit_pointers(const uint8_t *view, int (*visit)(uint32_t block_num))
+{
+    const uint32_t *pointers = (const uint32_t *)view;
+    for (uint32_t i = 0; i < pointers_per_block; i++)
+    {
+        if (pointers[i] != 0)
+        {
+            int result = visit(pointers[i]);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function to visit every block below `count` entries of an extent
+// tree node of `depth`: the data blocks of its extents, or its child tree
+// blocks and what they reference
+static int visit_extent_node(const uint8_t *entries, uint32_t count, uint32_t depth, int (*visit)(uint32_t block_num))
+{
+    if (depth == 0)
+    {
+        const extent_t *extents = (const extent_t *)entries;
+        for (uint32_t e = 0; e < count; e++)
+        {
+            for (uint32_t b = 0; b < extent_length(&extents[e]); b++)
+            {
+                int result = visit(extents[e].physical + b);
+                if (result != 0)
+                {
+                    return result;
+                }
+            }
+        }
+        return 0;
+    }
+
+    const extent_index_t *indexes = (const extent_index_t *)entries;
+    uint32_t capacity = (block_size - sizeof(extent_header_t)) / extent_entry_size(depth - 1);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int result = visit(indexes[i].block);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        const uint8_t *view;
+        result = view_block(indexes[i].block, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+        const extent_header_t *header = (const extent_header_t *)view;
+        result = (header->entries <= capacity)
+            ? visit_extent_node(view + sizeof(extent_header_t), header->entries, depth - 1, visit)
+            : E_CORRUPT_DISK;
+        release_view(view);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Helper function to add to *blocks the tree blocks below `count` index
+// entries of an extent tree node of `depth` (> 0). Only the index blocks
+// above the leaves are read: a node at depth 1 points to `count` leaves
+static int count_tree_blocks(const uint8_t *entries, uint32_t count, uint32_t depth, uint32_t *blocks)
+{
+    *blocks += count;
+    if (depth == 1)
+    {
+        return 0;
+    }
+
+    const extent_index_t *indexes = (const extent_index_t *)entries;
+    uint32_t capacity = (block_size - sizeof(extent_header_t)) / extent_entry_size(depth - 1);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint8_t *view;
+        int result = view_block(indexes[i].block, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+        const extent_header_t *header = (const extent_header_t *)view;
+        result = (header->entries <= capacity)
+            ? count_tree_blocks(view + sizeof(extent_header_t), header->entries, depth - 1, blocks)
+            : E_CORRUPT_DISK;
+        release_view(view);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Helper function to count the blocks a file holds, data and indirect or
+// extent tree blocks (see stat_all). Files with no holes hold as many data
+// blocks as their size says, and the indirect blocks follow from that: no
+// I/O, or only the upper index blocks of an extent tree 2 or more levels
+// deep. Sparse files (INODE_SPARSE) are walked block by block instead, which
+// reads all their indirect (or tree) blocks
+static int file_blocks(const inode_t *inode, uint32_t *blocks)
+{
+    if (inode->flags & INODE_SPARSE)
+    {
+        counted_blocks = 0;
+        int result = for_each_inode_block(inode, count_block);
+        *blocks = counted_blocks;
+        return result;
+    }
+
+    if (!extent_inodes)
+    {
+        *blocks = blocks_for_size(inode->size);
+        return 0;
+    }
+    *blocks = ((uint64_t)inode->size + block_size - 1) / block_size;
+    if (inode->depth == 0)
+    {
+        return 0;
+    }
+    if (inode->depth > EXTENT_MAX_DEPTH || inode->entries > ROOT_INDEXES)
+    {
+        return E_CORRUPT_DISK;
+    }
+    return count_tree_blocks((const uint8_t *)inode->root, inode->entries, inode->depth, blocks);
+}
+
+// Helper function to visit every block an inode references
+// `visit` is called on each data block and each (double) indirect block or
+// extent tree block, until it returns an error. The child indirect blocks of the double indirect block
+// are all fetched concurrently through the async engine
+static int for_each_inode_block(const inode_t *inode, int (*visit)(uint32_t block_num))
+{
+    // Extent inodes: the tree blocks and the blocks of every extent
+    if (extent_inodes)
+    {
+        uint32_t capacity = (inode->depth > 0) ? ROOT_INDEXES : ROOT_EXTENTS;
+        if (inode->depth > EXTENT_MAX_DEPTH || inode->entries > capacity)
+        {
+            return E_CORRUPT_DISK;
+        }
+        return visit_extent_node((const uint8_t *)inode->root, inode->entries, inode->depth, visit);
+    }
+
+    // Direct blocks
+    for (int i = 0; i < 4; i++)
+    {
+        int result = (inode->direct_blocks[i] != 0) ? visit(inode->direct_blocks[i]) : 0;
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    // Indirect block and the blocks it points to
+    if (inode->indirect_block != 0)
+    {
+        int result = visit(inode->indirect_block);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        const uint8_t *view;
+        result = view_block(inode->indirect_block, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+        result = visit_pointers(view, visit);
+        release_view(view);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    // Double indirect block, its indirect blocks and their data blocks
+    if (inode->double_indirect_block != 0)
+    {
+        int result = visit(inode->double_indirect_block);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        const uint8_t *view;
+        result = view_block(inode->double_indirect_block, &view);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        // Collect the child indirect blocks (heap: up to 16K of them)
+        uint32_t *children = malloc(pointers_per_block * sizeof(uint32_t));
+        if (children == NULL)
+        {
+            release_view(view);
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        int num_children = 0;
+        const uint32_t *pointers = (const uint32_t *)view;
+        for (uint32_t i = 0; i < pointers_per_block; i++)
+        {
+            if (pointers[i] != 0)
+            {
+                children[num_children++] = pointers[i];
+            }
+        }
+        release_view(view);
+        if (num_children == 0)
+        {
+            free(children);
+            return 0;
+        }
+
+        // Fetch them all at once (aligned so O_DIRECT reads land in place)
+        const uint8_t **views = malloc(num_children * sizeof(const uint8_t *));
+        void *buffers = NULL;
+        if (views == NULL ||
+            posix_memalign(&buffers, VDISK_BUF_ALIGN, (size_t)num_children * block_size) != 0)
+        {
+            free(views);
+            free(children);
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        result = read_blocks(children, num_children, buffers, views);
+        if (result == 0)
+        {
+            for (int i = 0; i < num_children && result == 0; i++)
+            {
+                result = visit(children[i]);
+                result = (result != 0) ? result : visit_pointers(views[i], visit);
+            }
+        }
+        free(buffers);
+        free(views);
+        free(children);
+        return result;
+    }
+
+    return 0;
+}
+
+// Helper function to mark a block in use in a scan bitmap
+static void scan_mark(uint64_t *bitmap, uint32_t block_num)
+{
+    if (block_num < superblock.num_blocks)
+    {
+        bitmap[block_num / 64] |= 1ULL << (block_num % 64);
+    }
+}
+
+// Helper function to mark every block referenced by an indirect block
+static void scan_pointers(uint64_t *bitmap, const uint8_t *view)
+{
+    const uint32_t *pointers = (const uint32_t *)view;
+    for (uint32_t i = 0; i < pointers_per_block; i++)
+    {
+        if (pointers[i] != 0)
+        {
+            scan_mark(bitmap, pointers[i]);
+        }
+    }
+}
+
+// Helper function to mark every block below `count` entries of an extent
+// tree node of `depth`, reading tree blocks through `diskp`
+// Same walk as visit_extent_node(), but safe on a scan thread's own disk
+static int scan_extent_node(DISK *diskp, const uint8_t *entries, uint32_t count, uint32_t depth, uint64_t *bitmap)
+{
+    if (depth == 0)
+    {
+        const extent_t *extents = (const extent_t *)entries;
+        for (uint32_t e = 0; e < count; e++)
+        {
+            for (uint32_t b = 0; b < extent_length(&extents[e]); b++)
+            {
+                scan_mark(bitmap, extents[e].physical + b);
+            }
+        }
+        return 0;
+    }
+
+    uint8_t *buffer = vdisk_buf_get(diskp);
+    if (buffer == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    const extent_index_t *indexes = (const extent_index_t *)entries;
+    uint32_t capacity = (block_size - sizeof(extent_header_t)) / extent_entry_size(depth - 1);
+    int result = 0;
+    for (uint32_t i = 0; i < count && result == 0; i++)
+    {
+        scan_mark(bitmap, indexes[i].block);
+        result = vdisk_read_uncached(diskp, indexes[i].block, buffer);
+        if (result == 0)
+        {
+            const extent_header_t *header = (const extent_header_t *)buffer;
+            result = (header->entries <= capacity)
+                ? scan_extent_node(diskp, buffer + sizeof(extent_header_t), header->entries, depth - 1, bitmap)
+                : E_CORRUPT_DISK;
+        }
+    }
+    vdisk_buf_put(diskp, buffer);
+    return result;
+}
+
+// Helper function to mark every block an inode references, reading its
+// (double) indirect blocks through `diskp` into `buffer` (a block)
+// Same walk as for_each_inode_block(), but safe on a scan thread's own disk
+static int scan_inode(DISK *diskp, const inode_t *inode, uint64_t *bitmap, uint8_t *buffer)
+{
+    if (extent_inodes)
+    {
+        uint32_t capacity = (inode->depth > 0) ? ROOT_INDEXES : ROOT_EXTENTS;
+        if (inode->depth > EXTENT_MAX_DEPTH || inode->entries > capacity)
+        {
+            return E_CORRUPT_DISK;
+        }
+        return scan_extent_node(diskp, (const uint8_t *)inode->root, inode->entries, inode->depth, bitmap);
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (inode->direct_blocks[i] != 0)
+        {
+            scan_mark(bitmap, inode->direct_blocks[i]);
+        }
+    }
+
+    if (inode->indirect_block != 0)
+    {
+        scan_mark(bitmap, inode->indirect_block);
+        int result = vdisk_read_uncached(diskp, inode->indirect_block, buffer);
+        if (result != 0)
+        {
+            return result;
+        }
+        scan_pointers(bitmap, buffer);
+    }
+
+    if (inode->double_indirect_block == 0)
+    {
+        return 0;
+    }
+    scan_mark(bitmap, inode->double_indirect_block);
+    int result = vdisk_read_uncached(diskp, inode->double_indirect_block, buffer);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // Read the child indirect blocks all at once
+    uint32_t *children = malloc(pointers_per_block * sizeof(uint32_t));
+    const uint8_t **views = malloc(pointers_per_block * sizeof(const uint8_t *));
+    if (children == NULL || views == NULL)
+    {
+        free(children);
+        free(views);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    int num_children = 0;
+    const uint32_t *pointers = (const uint32_t *)buffer;
+    for (uint32_t i = 0; i < pointers_per_block; i++)
+    {
+        if (pointers[i] != 0)
+        {
+            scan_mark(bitmap, pointers[i]);
+            children[num_children++] = pointers[i];
+        }
+    }
+    void *buffers = NULL;
+    if (num_children > 0 && posix_memalign(&buffers, VDISK_BUF_ALIGN, (size_t)num_children * block_size) != 0)
+    {
+        result = E_OUT_OF_SPACE; // see error.h
+    }
+    else if (num_children > 0)
+    {
+        result = read_blocks_from(diskp, children, num_children, buffers, views);
+        for (int i = 0; i < num_children && result == 0; i++)
+        {
+            scan_pointers(bitmap, views[i]);
+        }
+    }
+    free(buffers);
+    free(views);
+    free(children);
+    return result;
+}
+
+// Helper function to scan the inode blocks of a range through `diskp`
+// The blocks are read SCAN_READ_SIZE bytes per request
+static int scan_range(DISK *diskp, scan_range_t *range)
+{
+    uint32_t chunk = SCAN_READ_SIZE / block_size;
+    void *inode_blocks = NULL;
+    uint8_t *buffer = vdisk_buf_get(diskp);
+    int result = (buffer == NULL) ? E_OUT_OF_SPACE : 0;
+    if (result == 0 && posix_memalign(&inode_blocks, VDISK_BUF_ALIGN, (size_t)chunk * block_size) != 0)
+    {
+        inode_blocks = NULL;
+        result = E_OUT_OF_SPACE; // see error.h
+    }
+
+    for (uint32_t b = range->first_block; b < range->last_block && result == 0; b += chunk)
+    {
+        uint32_t count = (range->last_block - b < chunk) ? range->last_block - b : chunk;
+        result = vdisk_read_range(diskp, 1 + b, count, inode_blocks); // +1: superblock
+        const inode_t *inodes = (const inode_t *)inode_blocks;
+        for (uint32_t i = 0; i < count * inodes_per_block && result == 0; i++)
+        {
+            if (inodes[i].valid)
+            {
+                result = scan_inode(diskp, &inodes[i], range->bitmap, buffer);
+            }
+        }
+    }
+
+    free(inode_blocks);
+    if (buffer != NULL)
+    {
+        vdisk_buf_put(diskp, buffer);
+    }
+    return result;
+}
+
+// Helper function run by a scan thread: scans its range through a disk
+// handle of its own (separate descriptor, buffers and async engine)
+static void *scan_worker(void *arg)
+{
+    scan_range_t *range = (scan_range_t *)arg;
+    DISK worker_disk;
+    range->result = vdisk_on_mode(disk.name, &worker_disk, disk.mode);
+    if (range->result != 0)
+    {
+        return NULL;
+    }
+    range->result = vdisk_set_sector_size(&worker_disk, block_size);
+    if (range->result == 0)
+    {
+        range->result = scan_range(&worker_disk, range);
+    }
+    range->host_calls = worker_disk.host_calls;
+    vdisk_off(&worker_disk);
+    return NULL;
+}
+
+// Helper function to rebuild the block bitmap from the inode table at mount
+// The inode blocks are split into ranges scanned by parallel threads, each
+// into a bitmap of its own; the bitmaps are OR-ed into block_bitmap at the end.
+// With a single thread, the range is scanned by the calling thread, on the
+// mounted disk if `inline_ok`
+static int scan_inodes(int threads, bool inline_ok)
+{
+    threads = (threads < 1) ? 1 : (threads > SCAN_THREADS) ? SCAN_THREADS : threads;
+    threads = ((uint32_t)threads > superblock.num_inode_blocks) ? (int)superblock.num_inode_blocks : threads;
+
+    scan_range_t ranges[SCAN_THREADS];
+    if (threads == 1 && inline_ok)
+    {
+        ranges[0].first_block = 0;
+        ranges[0].last_block = superblock.num_inode_blocks;
+        ranges[0].bitmap = block_bitmap;
+        return scan_range(&disk, &ranges[0]);
+    }
+
+    bool started[SCAN_THREADS] = {false};
+    for (int t = 0; t < threads; t++)
+    {
+        scan_range_t *range = &ranges[t];
+        range->first_block = (uint32_t)(superblock.num_inode_blocks * t / threads);
+        range->last_block = (uint32_t)(superblock.num_inode_blocks * (t + 1) / threads);
+        range->bitmap = (uint64_t *)calloc(bitmap_words, sizeof(uint64_t));
+        range->host_calls = 0;
+        range->result = (range->bitmap == NULL) ? E_OUT_OF_SPACE : 0;
+        if (range->result == 0)
+        {
+            // Single range, or no thread to be had: scan it right here
+            started[t] = threads > 1 && pthread_create(&range->thread, NULL, scan_worker, range) == 0;
+            if (!started[t])
+            {
+                scan_worker(range);
+            }
+        }
+    }
+
+    // Merge the bitmaps of all threads
+    int result = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        scan_range_t *range = &ranges[t];
+        if (started[t])
+        {
+            pthread_join(range->thread, NULL);
+        }
+        for (uint32_t w = 0; w < bitmap_words && range->bitmap != NULL; w++)
+        {
+            block_bitmap[w] |= range->bitmap[w];
+        }
+        bitmap_host_calls += range->host_calls;
+        result = (result != 0) ? result : range->result;
+        free(range->bitmap);
+    }
+    return result;
+}
+
+// Helper function to set up the readahead streams of a fresh mount
+// Readahead needs an asynchronous engine: it is off on mapped disks (nothing
+// to prefetch) and on the stdio backend (requests would run inline)
+static void readahead_setup(void)
+{
+    memset(streams, 0, sizeof(streams));
+    ra_in_flight = 0;
+    num_slots = readahead_size / block_size;
+    if (num_slots < READAHEAD_MIN || vdisk_map_sector(&disk, 0) != NULL ||
+        vdisk_aio_engine(&disk) == VDISK_AIO_SYNC)
+    {
+        num_slots = 0;
+    }
+}
+
+// Helper function to collect prefetch completions (at least `min_wait`)
+static void readahead_reap(int min_wait)
+{
+    vdisk_completion done[16];
+    int n = vdisk_complete(&disk, done, 16, min_wait);
+    if (n < 0)
+    {
+        // Engine failure: whatever was in flight is lost
+        vdisk_aio_exit(&disk);
+        for (int s = 0; s < READAHEAD_STREAMS; s++)
+        {
+            for (uint32_t i = 0; streams[s].state != NULL && i < num_slots; i++)
+            {
+                streams[s].state[i] = (streams[s].state[i] == RA_PENDING) ? RA_EMPTY : streams[s].state[i];
+            }
+        }
+        ra_in_flight = 0;
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        stream_t *stream = &streams[done[i].tag >> 32];
+        stream->state[(uint32_t)done[i].tag] = (done[i].result == 0) ? RA_READY : RA_EMPTY;
+    }
+    ra_in_flight -= n;
+}
+
+// Helper function to wait for every prefetch in flight
+static void readahead_drain(void)
+{
+    while (ra_in_flight > 0)
+    {
+        readahead_reap(1);
+    }
+}
+
+// Helper function to drop the stream of an inode whose blocks change
+static void readahead_forget(int inode_num)
+{
+    for (int s = 0; s < READAHEAD_STREAMS; s++)
+    {
+        if (streams[s].used && streams[s].inode_num == inode_num)
+        {
+            readahead_drain();
+            free(streams[s].buffer);
+            free(streams[s].index);
+            free(streams[s].state);
+            memset(&streams[s], 0, sizeof(stream_t));
+        }
+    }
+}
+
+// Helper function to drop every stream (unmount)
+static void readahead_reset(void)
+{
+    readahead_drain();
+    for (int s = 0; s < READAHEAD_STREAMS; s++)
+    {
+        free(streams[s].buffer);
+        free(streams[s].index);
+        free(streams[s].state);
+    }
+    memset(streams, 0, sizeof(streams));
+    num_slots = 0;
+}
+
+// Helper function to get the readahead stream of a read() at `offset`
+// (NULL if readahead is off). The window doubles, up to the buffer size,
+// while reads follow each other; it halves, down to 0, on every jump.
+// A read from offset 0 starts a sequential stream
+static stream_t *readahead_stream(int inode_num, uint32_t offset)
+{
+    if (num_slots == 0)
+    {
+        return NULL;
+    }
+
+    stream_t *stream = NULL;
+    stream_t *oldest = &streams[0];
+    for (int s = 0; s < READAHEAD_STREAMS && stream == NULL; s++)
+    {
+        if (streams[s].used && streams[s].inode_num == inode_num)
+        {
+            stream = &streams[s];
+        }
+        else if (!streams[s].used || (oldest->used && streams[s].last_use < oldest->last_use))
+        {
+            oldest = &streams[s];
+        }
+    }
+
+    // Recycle the least recently used stream (its buffer is kept)
+    if (stream == NULL)
+    {
+        stream = oldest;
+        if (stream->state != NULL)
+        {
+            readahead_drain();
+            memset(stream->state, RA_EMPTY, num_slots);
+        }
+        stream->used = true;
+        stream->inode_num = inode_num;
+        stream->next_offset = 0;
+        stream->window = 0;
+        stream->ra_end = 0;
+    }
+    stream->last_use = ++ra_clock;
+
+    if (offset == stream->next_offset)
+    {
+        stream->window = (stream->window == 0) ? READAHEAD_MIN : stream->window * 2;
+        stream->window = (stream->window > num_slots) ? num_slots : stream->window;
+    }
+    else
+    {
+        stream->window /= 2;
+        stream->window = (stream->window < READAHEAD_MIN) ? 0 : stream->window;
+    }
+    return stream;
+}
+
+// Helper function to get a block from the stream buffer (NULL if it was not
+// prefetched). Waits for the block if its read is still in flight
+static const uint8_t *readahead_block(stream_t *stream, uint32_t index)
+{
+    if (stream == NULL || stream->state == NULL)
+    {
+        return NULL;
+    }
+    uint32_t slot = index % num_slots;
+    if (stream->index[slot] != index)
+    {
+        return NULL;
+    }
+    while (stream->state[slot] == RA_PENDING && ra_in_flight > 0)
+    {
+        readahead_reap(1);
+    }
+    if (stream->state[slot] != RA_READY)
+    {
+        return NULL;
+    }
+    return stream->buffer + (size_t)slot * block_size;
+}
+
+// Helper function to keep `window` blocks past the stream position
+// prefetched. Reads are submitted in batches, once half the window has been
+// consumed, and handed to the engine right away so they overlap whatever
+// the caller does next. Stops at EOF and at holes
+static void readahead_submit(stream_t *stream, inode_t *inode)
+{
+    if (stream->window == 0 || inode->size == 0)
+    {
+        return;
+    }
+    if (stream->buffer == NULL)
+    {
+        void *buffer;
+        if (posix_memalign(&buffer, VDISK_BUF_ALIGN, (size_t)num_slots * block_size) != 0)
+        {
+            stream->window = 0;
+            return;
+        }
+        stream->buffer = buffer;
+        stream->index = calloc(num_slots, sizeof(uint32_t));
+        stream->state = calloc(num_slots, sizeof(uint8_t));
+        if (stream->index == NULL || stream->state == NULL)
+        {
+            readahead_forget(stream->inode_num);
+            return;
+        }
+    }
+
+    uint32_t next = stream->next_offset / block_size;
+    uint32_t last = (inode->size - 1) / block_size;
+    if (stream->ra_end < next)
+    {
+        stream->ra_end = next;
+    }
+    if (stream->ra_end - next > stream->window / 2)
+    {
+        return; // enough still ahead of the reader
+    }
+
+    uint32_t index = stream->ra_end;
+    for (; index < next + stream->window && index <= last; index++)
+    {
+        uint32_t slot = index % num_slots;
+        if (stream->state[slot] == RA_PENDING)
+        {
+            break;
+        }
+        if (stream->index[slot] == index && stream->state[slot] == RA_READY)
+        {
+            continue;
+        }
+        int block_num = map_block(stream->inode_num, inode, index * block_size, false, NULL);
+        if (block_num <= 0)
+        {
+            break;
+        }
+
+        uint64_t tag = ((uint64_t)(stream - streams) << 32) | slot;
+        stream->index[slot] = index;
+        stream->state[slot] = RA_PENDING;
+        if (vdisk_submit_read(&disk, block_num, stream->buffer + (size_t)slot * block_size, tag) != 0)
+        {
+            stream->state[slot] = RA_EMPTY;
+            break;
+        }
+        ra_in_flight++;
+    }
+    stream->ra_end = index;
+    readahead_reap(0); // starts the io_uring batch
+}
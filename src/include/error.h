@@ -6,6 +6,10 @@ extern const int vdisk_EACCESS ;
 extern const int vdisk_ENOEXIST;
 extern const int vdisk_EEXCEED ;
 extern const int vdisk_ESECTOR ;
+extern const int vdisk_EMODE   ;
+extern const int vdisk_EBUSY   ;
+extern const int vdisk_ESIZE   ;
+extern const int vdisk_EIO     ;
 
 #define E_DISK_NOT_MOUNTED      -100  // Disk not mounted
 #define E_DISK_ALREADY_MOUNTED  -101  // Disk already mounted
@@ -14,5 +18,7 @@ extern const int vdisk_ESECTOR ;
 #define E_OUT_OF_INODES         -104  // No free inodes
 #define E_CORRUPT_DISK          -105  // Corrupt disk image
 #define E_INVALID_OFFSET        -106  // Invalid offset
+#define E_INVALID_BLOCK_SIZE    -107  // Unsupported block size
+#define E_NOT_SUPPORTED         -108  // Not supported by this volume
 
 #endif
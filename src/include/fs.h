@@ -1,9 +1,12 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 int format(char *disk_name, int inodes);
+int format_block_size(char *disk_name, int inodes, uint32_t size);
 int stat(int inode_num);
 int mount(char *disk_name);
 int unmount();
@@ -11,4 +14,90 @@ int create();
 int delete(int inode_num);
 int read(int inode_num, uint8_t *data, int len, int offset);
 int write(int inode_num, uint8_t *data, int len, int offset);
+
+// Batched create()/delete(): one update per inode block involved
+int create_many(int n, int *out);
+int delete_many(const int *inodes, int n);
+
+// One file reported by stat_all()
+typedef struct {
+    int inode;       // Inode #
+    int size;        // Size in bytes, as stat() returns
+    uint32_t blocks; // Blocks the file holds (data and indirect blocks, none for holes)
+} fs_stat_t;
+
+// Calls visit() for every file of the mounted volume, in inode # order. The
+// inode table is read sequentially, 256 KiB per request. Returns the # of files
+int stat_all(void (*visit)(const fs_stat_t *stat, void *arg), void *arg);
+
+// Files may have holes (blocks never written, read as 0s). seek() returns the
+// first offset from `offset` that is data (FS_SEEK_DATA) or in a hole
+// (FS_SEEK_HOLE, the file size if none), or E_INVALID_OFFSET if `offset` is
+// past the end of file or there's no data after it
+#define FS_SEEK_DATA 3
+#define FS_SEEK_HOLE 4
+int seek(int inode_num, int offset, int whence);
+
+// Reserves the blocks of `len` bytes from `offset` (contiguous if possible)
+// and extends the file to offset + len. Until written, they read as 0s (and
+// seek() sees them as a hole); write() fills them in place. Needs a volume
+// of extent inodes (E_NOT_SUPPORTED otherwise)
+int fallocate(int inode_num, int offset, int len);
+
+// I/O statistics of the mounted volume (used by bench.c)
+typedef struct {
+    uint64_t host_calls;     // Host I/O calls issued by the virtual disk
+    uint64_t cache_hits;     // Block reads/writes served by the block cache
+    uint64_t cache_misses;   // ... and that had to take a new cache entry
+    uint64_t readahead_hits; // Blocks read() found already prefetched
+} fs_stats_t;
+
+int fs_get_stats(fs_stats_t *stats);
+void fs_reset_stats(void);
+
+// Memory budget of the block cache, in bytes (0: no cache), and its
+// replacement policy (VDISK_CACHE_* from vdisk.h, 2Q by default). Both apply
+// from the next mount()
+void fs_set_cache_size(size_t bytes);
+void fs_set_cache_policy(int policy);
+
+// Max readahead window of a sequential reader, in bytes (0: no readahead).
+// Applies from the next mount()
+void fs_set_readahead(size_t bytes);
+
+// # of threads a mount() that has to rebuild the block bitmap (after a
+// crash) scans the inode table with (0: one per core, up to 8)
+void fs_set_scan_threads(int threads);
+
+// Lazy mounts (off by default) return once the superblock is checked and
+// build the block bitmap in the background: reads are served right away, the
+// first block allocation or free waits for the bitmap, and it is that call
+// (not mount()) that reports an inode table that can't be scanned. Applies
+// from the next mount()
+void fs_set_lazy_mount(bool lazy);
+
+// Inode format of the volumes format() creates from now on: block pointers
+// (4 direct, 1 indirect, 1 double indirect; the default), or extents (runs of
+// contiguous blocks, in a tree once a file has more than fit in the inode).
+// mount() picks the format back up from the superblock
+#define FS_INODE_POINTERS 0
+#define FS_INODE_EXTENTS 1
+void fs_set_inode_format(int format);
+
+// Block allocation policy, from now on: FS_ALLOC_LOWEST (the default) takes
+// the lowest free block of the volume. FS_ALLOC_GOAL takes the block after
+// the file's previous one, or searches forward from there if it's taken,
+// leaving room to grow to the file already there: files written at the same
+// time each stay in long contiguous runs
+#define FS_ALLOC_LOWEST 0
+#define FS_ALLOC_GOAL 1
+void fs_set_allocation(int policy);
+
+// Inodes are updated in memory and their blocks written back on unmount(),
+// fs_sync(), or once more than `blocks` inode blocks are dirty (0: write
+// every inode change through). Takes effect right away
+void fs_set_inode_dirty_limit(uint32_t blocks);
+
+// Writes the dirty inode blocks back and flushes the disk
+int fs_sync(void);
 #endif
@@ -1,20 +1,98 @@
 #ifndef VDISK_H
 #define VDISK_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+// Sector I/O backends, selected when the disk is opened
+#define VDISK_MODE_STDIO 0 // buffered fseek + fread/fwrite on a FILE*
+#define VDISK_MODE_PREAD 1 // positional pread/pwrite on a raw descriptor
+#define VDISK_MODE_MMAP  2 // whole image mapped into memory (MAP_SHARED)
+#define VDISK_MODE_DIRECT 3 // pread/pwrite with O_DIRECT, bypassing the host page cache
+
+// Supported sector sizes (see vdisk_set_sector_size)
+#define VDISK_MIN_SECTOR_SIZE 1024  // Size of a sector when the disk is opened
+#define VDISK_MAX_SECTOR_SIZE 65536
+
+// Sector buffer pool (see vdisk_buf_get)
+#define VDISK_BUF_ALIGN     4096 // Alignment of pool buffers
+#define VDISK_DIRECT_ALIGN  512  // Buffer alignment O_DIRECT transfers require
+#define VDISK_POOL_BUFFERS  32   // Sector buffers preallocated per disk
+
+// Asynchronous I/O engines (see vdisk_aio.c)
+#define VDISK_AIO_AUTO    0 // io_uring when available, else thread pool
+#define VDISK_AIO_URING   1 // Linux io_uring, submissions batched per syscall
+#define VDISK_AIO_THREADS 2 // worker threads doing blocking pread/pwrite
+#define VDISK_AIO_SYNC    3 // performed inline at submit (stdio/mmap backends)
+
+#define VDISK_AIO_DEFAULT_DEPTH 64
+
+// Sector cache replacement policies (see vdisk_cache.c)
+#define VDISK_CACHE_LRU 0 // least recently used
+#define VDISK_CACHE_2Q  1 // scan-resistant 2Q, metadata kept preferentially
+
+struct vdisk_aio;
+struct vdisk_cache;
+
+// Completion of an asynchronous request
+typedef struct {
+    uint64_t tag; // Caller's cookie from the submit call
+    int result;   // 0 on success, vdisk_E* error otherwise
+} vdisk_completion;
+
 typedef struct {
     uint32_t sector_size;
     uint32_t size_in_sectors;
     char *name;
     FILE *fp;
+    int fd;              // Raw descriptor (-1 when unused)
+    int mode;            // VDISK_MODE_* backend in use
+    uint8_t *map;        // Image mapping (VDISK_MODE_MMAP only)
+    size_t map_len;      // Length of the mapping in bytes
+    uint64_t host_calls; // # of host I/O calls issued (for benchmarking)
+    uint8_t *pool;       // VDISK_POOL_BUFFERS aligned sector buffers
+    uint8_t **pool_free; // Stack of free pool buffers
+    uint32_t pool_free_count;
+    struct vdisk_aio *aio; // Async engine, set up on first submit
+    struct vdisk_cache *cache; // Sector cache (see vdisk_cache_init), NULL if off
+    uint64_t cache_hits;   // Cached sector lookups that found the sector
+    uint64_t cache_misses; // ... and that did not
 } DISK;
 
 int vdisk_on(char *filename, DISK *diskp);
+int vdisk_on_mode(char *filename, DISK *diskp, int mode);
+void vdisk_set_default_mode(int mode);
+int vdisk_set_sector_size(DISK *diskp, uint32_t sector_size);
 int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer);
 int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer);
+int vdisk_read_meta(DISK *diskp, uint32_t sector, uint8_t *buffer);
+int vdisk_write_meta(DISK *diskp, uint32_t sector, uint8_t *buffer);
+int vdisk_read_uncached(DISK *diskp, uint32_t sector, uint8_t *buffer);
+int vdisk_write_uncached(DISK *diskp, uint32_t sector, uint8_t *buffer);
+int vdisk_read_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer);
+int vdisk_write_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer);
+int vdisk_readv(DISK *diskp, uint32_t sector, uint8_t **buffers, uint32_t count);
+int vdisk_writev(DISK *diskp, uint32_t sector, uint8_t **buffers, uint32_t count);
+uint8_t *vdisk_map_sector(DISK *diskp, uint32_t sector);
+uint8_t *vdisk_buf_get(DISK *diskp);
+void vdisk_buf_put(DISK *diskp, uint8_t *buffer);
 int vdisk_sync(DISK *diskp);
 void vdisk_off(DISK *diskp);
 
+int vdisk_aio_init(DISK *diskp, int engine, uint32_t queue_depth);
+int vdisk_aio_engine(DISK *diskp);
+int vdisk_submit_read(DISK *diskp, uint32_t sector, uint8_t *buffer, uint64_t tag);
+int vdisk_submit_write(DISK *diskp, uint32_t sector, uint8_t *buffer, uint64_t tag);
+int vdisk_complete(DISK *diskp, vdisk_completion *completions, int max, int min_wait);
+void vdisk_aio_exit(DISK *diskp);
+
+int vdisk_cache_init(DISK *diskp, size_t budget, int policy);
+int vdisk_cache_read(DISK *diskp, uint32_t sector, uint8_t *buffer, bool meta);
+int vdisk_cache_write(DISK *diskp, uint32_t sector, uint8_t *buffer, bool meta);
+int vdisk_cache_clean(DISK *diskp, uint32_t sector, uint32_t count);
+void vdisk_cache_drop(DISK *diskp, uint32_t sector, uint32_t count);
+int vdisk_cache_flush(DISK *diskp);
+void vdisk_cache_exit(DISK *diskp);
+
 #endif
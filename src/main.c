@@ -409,19 +409,1323 @@ TestResults run_basic_tests()
     return results;
 }
 
+// Fill a buffer with a position-dependent pattern
+static void fill_pattern(uint8_t *buffer, int len, int seed)
+{
+    for (int i = 0; i < len; i++)
+    {
+        buffer[i] = (uint8_t)((i * 31 + seed) ^ (i >> 10));
+    }
+}
+
+// Run large file tests (indirect and double indirect blocks) on a volume
+// formatted with the given block size
+TestResults run_large_file_tests(uint32_t block_size)
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const int file_size = 300 * 1024; // spans direct, indirect and double indirect blocks
+    uint8_t *pattern = malloc(file_size);
+    uint8_t *read_buffer = malloc(file_size);
+    int result;
+
+    log_test("Large File Tests");
+
+    fill_pattern(pattern, file_size, 7);
+    format_block_size((char *)disk_name, 64, block_size);
+    mount((char *)disk_name);
+    int inode = create();
+
+    // Test 1: Write a large file in one call
+    print_test_header("Write large file");
+    results.total++;
+    result = write(inode, pattern, file_size, 0);
+    bool ok = result == file_size && stat(inode) == file_size;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Write large file", ok, result);
+
+    // Test 2: Read it back in odd-sized chunks
+    print_test_header("Read large file in chunks");
+    results.total++;
+    memset(read_buffer, 0, file_size);
+    int offset = 0;
+    while (offset < file_size)
+    {
+        result = read(inode, read_buffer + offset, 3000, offset);
+        if (result <= 0)
+        {
+            break;
+        }
+        offset += result;
+    }
+    ok = offset == file_size && memcmp(read_buffer, pattern, file_size) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Read large file in chunks", ok, result);
+
+    // Test 3: Overwrite across block boundaries, then remount and verify
+    print_test_header("Overwrite and remount");
+    results.total++;
+    fill_pattern(pattern + 4000, 9000, 99);
+    write(inode, pattern + 4000, 9000, 4000);
+    unmount();
+    mount((char *)disk_name);
+    memset(read_buffer, 0, file_size);
+    result = read(inode, read_buffer, file_size, 0);
+    ok = result == file_size && memcmp(read_buffer, pattern, file_size) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Overwrite and remount", ok, result);
+
+    // Test 4: Deleting frees every block so the file fits again
+    print_test_header("Delete reclaims space");
+    results.total++;
+    int filler = create();
+    int filled = write(filler, pattern, file_size, 0);
+    delete(inode);
+    delete(filler);
+    inode = create();
+    result = write(inode, pattern, file_size, 0);
+    int refill = create();
+    int refilled = write(refill, pattern, file_size, 0);
+    ok = result == file_size && refilled == filled;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Delete reclaims space", ok, result);
+
+    unmount();
+    free(pattern);
+    free(read_buffer);
+    return results;
+}
+
+// Read a file sequentially in `chunk`-byte calls, alternating between two
+// inodes when `other` is valid. Returns the # of bytes read from `inode`
+static int stream_file(int inode, int other, uint8_t *buffer, uint8_t *other_buffer, int size, int chunk)
+{
+    int offset = 0;
+    while (offset < size)
+    {
+        int result = read(inode, buffer + offset, chunk, offset);
+        if (result <= 0)
+        {
+            break;
+        }
+        if (other >= 0)
+        {
+            read(other, other_buffer + offset, result, offset);
+        }
+        offset += result;
+    }
+    return offset;
+}
+
+// Run readahead tests: sequential streams are prefetched and stay coherent
+// with writes, random reads are still served correctly. `prefetching`: the
+// backend has an async engine (no readahead on stdio and mmap)
+TestResults run_readahead_tests(bool prefetching)
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const int file_size = 300 * 1024;
+    uint8_t *pattern = malloc(file_size);
+    uint8_t *other_pattern = malloc(file_size);
+    uint8_t *read_buffer = malloc(file_size);
+    uint8_t *other_buffer = malloc(file_size);
+    fs_stats_t stats;
+
+    log_test("Readahead Tests");
+
+    fill_pattern(pattern, file_size, 3);
+    fill_pattern(other_pattern, file_size, 5);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    int inode = create();
+    int other = create();
+    write(inode, pattern, file_size, 0);
+    write(other, other_pattern, file_size, 0);
+
+    // Test 1: Small sequential reads are served from the readahead buffer
+    print_test_header("Sequential reads are prefetched");
+    results.total++;
+    fs_reset_stats();
+    int result = stream_file(inode, -1, read_buffer, NULL, file_size, 1000);
+    fs_get_stats(&stats);
+    bool ok = result == file_size && memcmp(read_buffer, pattern, file_size) == 0 &&
+              (stats.readahead_hits > 0) == prefetching;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Sequential reads are prefetched", ok, (int)stats.readahead_hits);
+
+    // Test 2: Two interleaved streams each keep their own window
+    print_test_header("Interleaved streams");
+    results.total++;
+    memset(read_buffer, 0, file_size);
+    memset(other_buffer, 0, file_size);
+    result = stream_file(inode, other, read_buffer, other_buffer, file_size, 4096);
+    ok = result == file_size && memcmp(read_buffer, pattern, file_size) == 0 &&
+         memcmp(other_buffer, other_pattern, file_size) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Interleaved streams", ok, result);
+
+    // Test 3: A write in the middle of a stream is seen by the next reads
+    print_test_header("Write while streaming");
+    results.total++;
+    memset(read_buffer, 0, file_size);
+    result = 0;
+    for (int offset = 0; offset < file_size / 2; offset += result)
+    {
+        result = read(inode, read_buffer + offset, 1024, offset);
+    }
+    fill_pattern(pattern + file_size / 2, file_size / 2, 11);
+    write(inode, pattern + file_size / 2, file_size / 2, file_size / 2);
+    result = read(inode, read_buffer + file_size / 2, file_size / 2, file_size / 2);
+    ok = result == file_size / 2 && memcmp(read_buffer, pattern, file_size) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Write while streaming", ok, result);
+
+    // Test 4: Random reads return the right data
+    print_test_header("Random reads");
+    results.total++;
+    srand(7);
+    ok = true;
+    for (int i = 0; i < 200 && ok; i++)
+    {
+        int offset = rand() % (file_size - 3000);
+        result = read(inode, read_buffer, 3000, offset);
+        ok = result == 3000 && memcmp(read_buffer, pattern + offset, 3000) == 0;
+    }
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Random reads", ok, result);
+
+    unmount();
+    free(pattern);
+    free(other_pattern);
+    free(read_buffer);
+    free(other_buffer);
+    return results;
+}
+
+// Accumulate the results of one suite into the totals
+static void add_results(TestResults *total, TestResults results)
+{
+    total->total += results.total;
+    total->passed += results.passed;
+    total->failed += results.failed;
+}
+
+// Run block size tests: validation, then the large file tests on bigger blocks
+TestResults run_block_size_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const uint32_t sizes[] = {4096, 65536};
+
+    log_test("Block Size Tests");
+
+    // Test 1: Sizes that are not a power of 2 in [1 KiB, 64 KiB] are refused
+    print_test_header("Reject invalid block sizes");
+    results.total++;
+    int small = format_block_size((char *)disk_name, 64, 512);
+    int odd = format_block_size((char *)disk_name, 64, 3072);
+    int large = format_block_size((char *)disk_name, 64, 131072);
+    bool ok = small == E_INVALID_BLOCK_SIZE && odd == E_INVALID_BLOCK_SIZE && large == E_INVALID_BLOCK_SIZE;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Reject invalid block sizes", ok, odd);
+
+    // Test 2: mount() takes the geometry from the superblock
+    // (one 4 KiB inode block holds 128 inodes, where 1 KiB blocks hold 64)
+    print_test_header("Mount with superblock block size");
+    results.total++;
+    format_block_size((char *)disk_name, 64, 4096);
+    int result = mount((char *)disk_name);
+    int created = 0;
+    while (create() >= 0)
+    {
+        created++;
+    }
+    unmount();
+    ok = result == 0 && created == 4096 / 32;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Mount with superblock block size", ok, created);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        add_results(&results, run_large_file_tests(sizes[i]));
+    }
+
+    return results;
+}
+
+// Create (or truncate) a zero-filled image of the given # of 1 KiB sectors
+static int make_image(const char *name, uint32_t sectors)
+{
+    // NB: fs.h shadows read()/write() from unistd.h, so stick to stdio here
+    FILE *fp = fopen(name, "wb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    int result = fseek(fp, (long)sectors * 1024 - 1, SEEK_SET);
+    if (result == 0)
+    {
+        result = (fputc(0, fp) == EOF) ? -1 : 0;
+    }
+    fclose(fp);
+    return result;
+}
+
+// Simulate a crash of a 1 KiB-block volume: clear the clean-unmount flag
+// and zero the (now stale) bitmap block (superblock: magic, 3 words, # of
+// bitmap blocks at byte 28, clean flag at 32)
+static int simulate_crash(const char *disk_name, uint32_t bitmap_block)
+{
+    DISK raw_disk;
+    int result = vdisk_on((char *)disk_name, &raw_disk);
+    if (result != 0)
+    {
+        return result;
+    }
+    uint8_t *sector = vdisk_buf_get(&raw_disk);
+    result = vdisk_read(&raw_disk, 0, sector);
+    memset(sector + 32, 0, sizeof(uint32_t));
+    result = result != 0 ? result : vdisk_write(&raw_disk, 0, sector);
+    memset(sector, 0, 1024);
+    result = result != 0 ? result : vdisk_write(&raw_disk, bitmap_block, sector);
+    vdisk_buf_put(&raw_disk, sector);
+    vdisk_off(&raw_disk);
+    return result;
+}
+
+// Count the runs of contiguous data blocks of a file of a 1 KiB-block volume
+// that has no double indirect block, straight from the image (inode blocks
+// from block 1, direct pointers at byte 8 of the inode, indirect one at 24)
+static int count_runs(const char *disk_name, int inode_num)
+{
+    DISK raw_disk;
+    if (vdisk_on((char *)disk_name, &raw_disk) != 0)
+    {
+        return -1;
+    }
+    uint32_t blocks[4 + 256] = {0};
+    uint32_t indirect = 0;
+    uint8_t *sector = vdisk_buf_get(&raw_disk);
+    int result = vdisk_read(&raw_disk, 1 + inode_num / 32, sector);
+    if (result == 0)
+    {
+        memcpy(blocks, sector + (inode_num % 32) * 32 + 8, 4 * sizeof(uint32_t));
+        memcpy(&indirect, sector + (inode_num % 32) * 32 + 24, sizeof(indirect));
+    }
+    if (result == 0 && indirect != 0)
+    {
+        result = vdisk_read(&raw_disk, indirect, sector);
+        memcpy(blocks + 4, sector, 256 * sizeof(uint32_t));
+    }
+    vdisk_buf_put(&raw_disk, sector);
+    vdisk_off(&raw_disk);
+
+    int runs = 0;
+    for (int i = 0; i < 4 + 256 && result == 0; i++)
+    {
+        if (blocks[i] != 0 && (i == 0 || blocks[i] != blocks[i - 1] + 1))
+        {
+            runs++;
+        }
+    }
+    return (result == 0) ? runs : -1;
+}
+
+// Point the indirect block of an inode of a 1 KiB-block volume at `block`,
+// straight on the image (pointer at byte 24 of the inode)
+static int set_indirect_block(const char *disk_name, int inode_num, uint32_t block)
+{
+    DISK raw_disk;
+    int result = vdisk_on((char *)disk_name, &raw_disk);
+    if (result != 0)
+    {
+        return result;
+    }
+    uint8_t *sector = vdisk_buf_get(&raw_disk);
+    result = vdisk_read(&raw_disk, 1 + inode_num / 32, sector);
+    memcpy(sector + (inode_num % 32) * 32 + 24, &block, sizeof(block));
+    result = result != 0 ? result : vdisk_write(&raw_disk, 1 + inode_num / 32, sector);
+    result = result != 0 ? result : vdisk_sync(&raw_disk);
+    vdisk_buf_put(&raw_disk, sector);
+    vdisk_off(&raw_disk);
+    return result;
+}
+
+// Run allocation tests: free blocks are handed out lowest first, and every
+// data block of the volume can be allocated and freed again
+TestResults run_allocation_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    uint8_t block[1024];
+
+    log_test("Allocation Tests");
+
+    // Test 1: The lowest free blocks are reused first, across bitmap words
+    // (128 inodes take 4 blocks and the bitmap 1, so file i gets block 6 + i)
+    print_test_header("Lowest free block first");
+    results.total++;
+    format((char *)disk_name, 128);
+    mount((char *)disk_name);
+    memset(block, 0, sizeof(block));
+    for (int i = 0; i < 100; i++)
+    {
+        write(create(), block, sizeof(block), 0);
+    }
+    delete(80);
+    delete(30);
+    const uint32_t expected[] = {36, 86};
+    for (int i = 0; i < 2; i++)
+    {
+        memset(block, 0xa0 + i, sizeof(block));
+        write(create(), block, sizeof(block), 0);
+    }
+    unmount();
+    DISK raw_disk;
+    int result = vdisk_on((char *)disk_name, &raw_disk);
+    uint8_t *sector = vdisk_buf_get(&raw_disk);
+    bool ok = result == 0;
+    for (int i = 0; i < 2 && ok; i++)
+    {
+        result = vdisk_read(&raw_disk, expected[i], sector);
+        ok = result == 0 && sector[0] == 0xa0 + i && sector[1023] == 0xa0 + i;
+    }
+    vdisk_buf_put(&raw_disk, sector);
+    vdisk_off(&raw_disk);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Lowest free block first", ok, result);
+
+    // Test 2: A file fills the whole volume (1021 data blocks, 5 of them
+    // indirect), and deleting it frees every block again
+    print_test_header("Fill and free the volume");
+    results.total++;
+    const int disk_bytes = 1021 * 1024;
+    const int file_bytes = 1016 * 1024;
+    uint8_t *data = malloc(disk_bytes);
+    memset(data, 0x5a, disk_bytes);
+    format((char *)disk_name, 32);
+    mount((char *)disk_name);
+    int inode = create();
+    int first = write(inode, data, disk_bytes, 0);
+    delete(inode);
+    inode = create();
+    int second = write(inode, data, disk_bytes, 0);
+    unmount();
+    free(data);
+    ok = first == file_bytes && second == file_bytes;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Fill and free the volume", ok, first);
+
+    // Test 3: Same on an 8 MiB volume, whose bitmap summary has 2 levels
+    // (8189 data blocks, 33 of them indirect)
+    print_test_header("Fill and free a large volume");
+    results.total++;
+    const char *large_disk = "alloc_disk.img";
+    const int large_bytes = 8189 * 1024;
+    const int large_file_bytes = 8156 * 1024;
+    data = malloc(large_bytes);
+    memset(data, 0x5a, large_bytes);
+    ok = make_image(large_disk, 8192) == 0 && format((char *)large_disk, 32) == 0 &&
+         mount((char *)large_disk) == 0;
+    inode = create();
+    first = write(inode, data, large_bytes, 0);
+    int full = write(create(), data, 1024, 0);
+    delete(inode);
+    inode = create();
+    second = write(inode, data, large_bytes, 0);
+    unmount();
+    remove(large_disk);
+    free(data);
+    ok = ok && first == large_file_bytes && full == E_OUT_OF_SPACE && second == large_file_bytes;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Fill and free a large volume", ok, first);
+
+    // Test 4: After a clean unmount, mount() loads the bitmap block instead
+    // of scanning inodes and indirect blocks (then marks the superblock)
+    print_test_header("Clean mount loads the bitmap");
+    results.total++;
+    const int file_size = 300 * 1024; // needs the double indirect block
+    uint8_t *pattern = malloc(file_size);
+    uint8_t *other_pattern = malloc(file_size);
+    uint8_t *read_buffer = malloc(file_size);
+    fill_pattern(pattern, file_size, 17);
+    fill_pattern(other_pattern, file_size, 19);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    int old_file = create();
+    write(old_file, pattern, file_size, 0);
+    unmount();
+    fs_stats_t stats;
+    result = mount((char *)disk_name);
+    fs_get_stats(&stats);
+    int new_file = create();
+    write(new_file, other_pattern, file_size, 0);
+    read(old_file, read_buffer, file_size, 0);
+    ok = result == 0 && stats.cache_misses <= 2 && memcmp(read_buffer, pattern, file_size) == 0;
+    unmount();
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Clean mount loads the bitmap", ok, (int)stats.cache_misses);
+
+    // Test 5: Without the clean flag, a stale bitmap is ignored and mount()
+    // scans the inodes again
+    print_test_header("Unclean mount rescans");
+    results.total++;
+    result = simulate_crash(disk_name, 3);
+    mount((char *)disk_name);
+    fill_pattern(read_buffer, file_size, 23);
+    write(create(), read_buffer, file_size, 0);
+    read(old_file, read_buffer, file_size, 0);
+    ok = result == 0 && memcmp(read_buffer, pattern, file_size) == 0;
+    read(new_file, read_buffer, file_size, 0);
+    ok = ok && memcmp(read_buffer, other_pattern, file_size) == 0;
+    unmount();
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Unclean mount rescans", ok, result);
+
+    // Test 6: Same with the inode table (8 blocks) split across 4 threads,
+    // with files in every part of it
+    print_test_header("Parallel mount scan");
+    results.total++;
+    format((char *)disk_name, 256);
+    mount((char *)disk_name);
+    for (int i = 0; i < 200; i++)
+    {
+        memset(block, i, sizeof(block));
+        write(create(), block, sizeof(block), 0);
+    }
+    old_file = create();
+    write(old_file, pattern, file_size, 0);
+    unmount();
+    result = simulate_crash(disk_name, 9);
+    fs_set_scan_threads(4);
+    mount((char *)disk_name);
+    fs_set_scan_threads(0);
+    fill_pattern(read_buffer, file_size, 29);
+    write(create(), read_buffer, file_size, 0);
+    read(old_file, read_buffer, file_size, 0);
+    ok = result == 0 && memcmp(read_buffer, pattern, file_size) == 0;
+    for (int i = 0; i < 200 && ok; i++)
+    {
+        ok = read(i, block, sizeof(block), 0) == (int)sizeof(block) && block[0] == (uint8_t)i &&
+             block[1023] == (uint8_t)i;
+    }
+    unmount();
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Parallel mount scan", ok, result);
+
+    // Test 7: A lazy mount leaves the scan to a background thread. With an
+    // indirect pointer past the end of the image the scan fails: mount()
+    // does (the default), a lazy mount returns before the scan gets there.
+    // Reads are then served, while allocations and frees report the error
+    // (delete() leaves the file as it was: it reads the same after the
+    // repair). Once repaired, the lazy mount's first write waits for the
+    // bitmap
+    print_test_header("Lazy mount");
+    results.total++;
+    mount((char *)disk_name);
+    int broken = create();
+    unmount();
+    result = set_indirect_block(disk_name, broken, 0x7fffffff);
+    result = result != 0 ? result : simulate_crash(disk_name, 9);
+    int eager_result = mount((char *)disk_name);
+    fs_set_lazy_mount(true);
+    int lazy_result = mount((char *)disk_name);
+    memset(read_buffer, 0, file_size);
+    read(old_file, read_buffer, file_size, 0);
+    ok = result == 0 && eager_result < 0 && lazy_result == 0 && memcmp(read_buffer, pattern, file_size) == 0 &&
+         delete(old_file) == eager_result && write(create(), block, sizeof(block), 0) == eager_result;
+    unmount();
+    result = set_indirect_block(disk_name, broken, 0);
+    result = result != 0 ? result : simulate_crash(disk_name, 9);
+    ok = ok && result == 0 && mount((char *)disk_name) == 0 &&
+         write(create(), block, sizeof(block), 0) == (int)sizeof(block);
+    read(old_file, read_buffer, file_size, 0);
+    ok = ok && memcmp(read_buffer, pattern, file_size) == 0;
+    unmount();
+    fs_set_lazy_mount(false);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Lazy mount", ok, eager_result);
+
+    free(pattern);
+    free(other_pattern);
+    free(read_buffer);
+
+    return results;
+}
+
+// Run goal-based allocation tests: files written at the same time each get
+// their own runs of blocks, and the volume still fills up
+TestResults run_goal_allocation_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+
+    log_test("Goal-Based Allocation Tests");
+
+    // Test 1: Two files appended to 1 KiB at a time in turn don't
+    // interleave: the second file's blocks follow its first one, right
+    // after the first file's first block, so the first file moves on
+    // ALLOC_SLACK blocks further. Each then has a run up to its indirect
+    // block (in line) and one after it
+    print_test_header("Interleaved appends");
+    results.total++;
+    const int goal_size = 200 * 1024;
+    uint8_t *pattern = malloc(goal_size);
+    uint8_t *other_pattern = malloc(goal_size);
+    uint8_t *read_buffer = malloc(goal_size);
+    fill_pattern(pattern, goal_size, 31);
+    fill_pattern(other_pattern, goal_size, 37);
+    fs_set_allocation(FS_ALLOC_GOAL);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    int inode = create();
+    int other = create();
+    for (int offset = 0; offset < goal_size; offset += 1024)
+    {
+        write(inode, pattern + offset, 1024, offset);
+        write(other, other_pattern + offset, 1024, offset);
+    }
+    unmount();
+    int runs = count_runs(disk_name, inode);
+    int other_runs = count_runs(disk_name, other);
+    mount((char *)disk_name);
+    int result = read(inode, read_buffer, goal_size, 0);
+    bool ok = runs == 3 && other_runs == 2 && result == goal_size && memcmp(read_buffer, pattern, goal_size) == 0;
+    result = read(other, read_buffer, goal_size, 0);
+    ok = ok && result == goal_size && memcmp(read_buffer, other_pattern, goal_size) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Interleaved appends", ok, runs);
+
+    // Test 2: The rest of the volume still fills up, slack included
+    print_test_header("Goal allocation fills the volume");
+    results.total++;
+    uint8_t *data = calloc(1016 * 1024, 1);
+    result = write(create(), data, 1016 * 1024, 0);
+    ok = result == 614 * 1024;
+    unmount();
+    fs_set_allocation(FS_ALLOC_LOWEST);
+    free(data);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Goal allocation fills the volume", ok, result);
+    free(pattern);
+    free(other_pattern);
+    free(read_buffer);
+
+    return results;
+}
+
+// Run sparse file tests: a write past the end of a file leaves a hole that
+// takes no blocks and reads as 0s, seek() finds the data and the holes, and
+// writes into the hole allocate just the blocks they cover
+TestResults run_sparse_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    uint8_t block[1024];
+
+    log_test("Sparse File Tests");
+
+    // Test 1: A write 60 MiB past the end of a file leaves a hole: no block
+    // is allocated for it (it wouldn't fit on the volume) and it reads as 0s
+    print_test_header("Write past the end of file");
+    results.total++;
+    const int far = 60 * 1024 * 1024;
+    uint8_t bytes[10] = "0123456789";
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    int inode = create();
+    int result = write(inode, bytes, sizeof(bytes), far);
+    bool ok = result == sizeof(bytes) && stat(inode) == far + 10;
+    memset(block, 0xff, sizeof(block));
+    ok = ok && read(inode, block, sizeof(block), 1024 * 1024) == sizeof(block);
+    for (int i = 0; i < (int)sizeof(block) && ok; i++)
+    {
+        ok = block[i] == 0;
+    }
+    ok = ok && read(inode, block, sizeof(block), far - 5) == 15 && memcmp(block + 5, bytes, 10) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Write past the end of file", ok, result);
+
+    // Test 2: seek() finds where the data and the holes are
+    print_test_header("Seek to data and holes");
+    results.total++;
+    ok = seek(inode, 0, FS_SEEK_DATA) == far && seek(inode, 100, FS_SEEK_HOLE) == 100 &&
+         seek(inode, far + 3, FS_SEEK_DATA) == far + 3 && seek(inode, far, FS_SEEK_HOLE) == far + 10 &&
+         seek(inode, far + 10, FS_SEEK_DATA) == E_INVALID_OFFSET;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Seek to data and holes", ok, seek(inode, 0, FS_SEEK_DATA));
+
+    // Test 3: Blocks written into the hole (a direct one, and one behind the
+    // indirect block) are still there after a remount
+    print_test_header("Write into a hole");
+    results.total++;
+    ok = write(inode, bytes, sizeof(bytes), 1024) == sizeof(bytes) &&
+         write(inode, bytes, sizeof(bytes), 8 * 1024) == sizeof(bytes);
+    unmount();
+    mount((char *)disk_name);
+    memset(block, 0xff, sizeof(block));
+    ok = ok && read(inode, block, 20, 1020) == 20 && memcmp(block + 4, bytes, 10) == 0 && block[0] == 0;
+    ok = ok && read(inode, block, 10, 8 * 1024) == 10 && memcmp(block, bytes, 10) == 0 &&
+         seek(inode, 0, FS_SEEK_DATA) == 1024 && stat(inode) == far + 10;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Write into a hole", ok, seek(inode, 0, FS_SEEK_DATA));
+
+    // Test 4: The rest of the volume is still free: of its 1020 data blocks,
+    // the file only took 6 (3 data blocks, the indirect and double indirect
+    // blocks and a child), so another file gets 1009 KiB (and 5 indirect
+    // blocks)
+    print_test_header("Holes take no blocks");
+    results.total++;
+    uint8_t *data = malloc(1016 * 1024);
+    memset(data, 0x5a, 1016 * 1024);
+    result = write(create(), data, 1016 * 1024, 0);
+    ok = result == 1009 * 1024;
+    unmount();
+    free(data);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Holes take no blocks", ok, result);
+
+    return results;
+}
+
+// Read the size of an inode of a 1 KiB-block volume straight from the image
+// (inode blocks from block 1, 32 bytes per inode, size at byte 4)
+static uint32_t read_inode_size(const char *disk_name, int inode_num)
+{
+    DISK raw_disk;
+    uint32_t size = 0;
+    if (vdisk_on((char *)disk_name, &raw_disk) != 0)
+    {
+        return 0;
+    }
+    uint8_t *sector = vdisk_buf_get(&raw_disk);
+    if (vdisk_read(&raw_disk, 1 + inode_num / 32, sector) == 0)
+    {
+        memcpy(&size, sector + (inode_num % 32) * 32 + 4, sizeof(size));
+    }
+    vdisk_buf_put(&raw_disk, sector);
+    vdisk_off(&raw_disk);
+    return size;
+}
+
+// What stat_all() reported to check_stat(), for the stat_all test
+typedef struct
+{
+    int files;
+    int last_inode;
+    bool ok;
+} stat_check_t;
+
+// Helper function to check a file reported by stat_all(): files are created
+// with sizes cycling through 0, 1, 1 KiB, 5 KiB and 300 KiB (5 data blocks
+// need the indirect block, 300 the double indirect one and a child), and
+// those with an inode # multiple of 3 deleted; inode 0 then holds 10 bytes
+// at 200 KiB, after a hole
+static void check_stat(const fs_stat_t *file, void *arg)
+{
+    const int sizes[] = {0, 1, 1024, 5 * 1024, 300 * 1024};
+    const uint32_t blocks[] = {0, 1, 1, 6, 303};
+    stat_check_t *check = (stat_check_t *)arg;
+    if (file->inode == 0)
+    {
+        check->ok = check->ok && check->last_inode == -1 && file->size == 200 * 1024 + 10 && file->blocks == 2;
+        check->last_inode = 0;
+        check->files++;
+        return;
+    }
+    check->ok = check->ok && file->inode > check->last_inode && file->inode % 3 != 0 &&
+                file->size == sizes[file->inode % 5] && file->blocks == blocks[file->inode % 5];
+    check->last_inode = file->inode;
+    check->files++;
+}
+
+// Run block cache tests: counters and scan resistance, then the large file
+// tests with caches small enough to evict dirty blocks all the time (2Q and
+// LRU), and with no cache at all
+TestResults run_cache_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+
+    log_test("Block Cache Tests");
+
+    // Test 1: Repeated stat() of a file is served from the inode cache, with
+    // no block lookup at all
+    print_test_header("Repeated stat hits the cache");
+    results.total++;
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    int inode = create();
+    fs_stats_t stats;
+    fs_reset_stats();
+    for (int i = 0; i < 10; i++)
+    {
+        stat(inode);
+    }
+    int result = fs_get_stats(&stats);
+    unmount();
+    bool ok = result == 0 && stats.cache_hits == 0 && stats.cache_misses == 0 && stats.host_calls == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Repeated stat hits the cache", ok, (int)stats.cache_hits);
+
+    // Test 2: A sequential scan through a 2Q cache leaves metadata resident
+    print_test_header("Scan keeps metadata cached");
+    results.total++;
+    DISK scan_disk;
+    result = vdisk_on((char *)disk_name, &scan_disk);
+    uint8_t *block = vdisk_buf_get(&scan_disk);
+    result = result != 0 ? result : vdisk_cache_init(&scan_disk, 16 * 1024, VDISK_CACHE_2Q);
+    for (uint32_t s = 0; s < 4 && result == 0; s++)
+    {
+        result = vdisk_read_meta(&scan_disk, s, block);
+    }
+    for (uint32_t s = 4; s < scan_disk.size_in_sectors && result == 0; s++)
+    {
+        result = vdisk_read(&scan_disk, s, block);
+    }
+    scan_disk.cache_misses = 0;
+    for (uint32_t s = 0; s < 4 && result == 0; s++)
+    {
+        result = vdisk_read_meta(&scan_disk, s, block);
+    }
+    ok = result == 0 && scan_disk.cache_misses == 0;
+    vdisk_buf_put(&scan_disk, block);
+    vdisk_off(&scan_disk);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Scan keeps metadata cached", ok, result);
+
+    // Test 3: Once mapped, a file's indirect blocks aren't looked up again
+    print_test_header("Block map skips indirect lookups");
+    results.total++;
+    const int file_size = 300 * 1024; // needs the double indirect block
+    uint8_t *pattern = malloc(file_size);
+    uint8_t *read_buffer = malloc(file_size);
+    fill_pattern(pattern, file_size, 9);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    inode = create();
+    write(inode, pattern, file_size, 0);
+    read(inode, read_buffer, file_size, 0);
+    fs_reset_stats();
+    result = read(inode, read_buffer, file_size, 0);
+    fs_get_stats(&stats);
+    uint64_t lookups = stats.cache_hits + stats.cache_misses;
+    ok = result == file_size && memcmp(read_buffer, pattern, file_size) == 0 && lookups <= 2;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Block map skips indirect lookups", ok, (int)lookups);
+
+    // Test 4: A deleted file's map isn't reused by the next file
+    print_test_header("Block map dropped on delete");
+    results.total++;
+    delete(inode);
+    inode = create();
+    fill_pattern(pattern, file_size, 13);
+    write(inode, pattern, file_size, 0);
+    memset(read_buffer, 0, file_size);
+    result = read(inode, read_buffer, file_size, 0);
+    unmount();
+    ok = result == file_size && memcmp(read_buffer, pattern, file_size) == 0;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Block map dropped on delete", ok, result);
+    free(pattern);
+    free(read_buffer);
+
+    // Test 5: The first create() after mount looks at each inode block once
+    // (8 of them), later ones find the lowest free inode with no lookup but
+    // those of the inode's own write
+    print_test_header("create() needs no inode scan");
+    results.total++;
+    format((char *)disk_name, 256);
+    mount((char *)disk_name);
+    for (int i = 0; i < 200; i++)
+    {
+        create();
+    }
+    unmount();
+    mount((char *)disk_name);
+    fs_reset_stats();
+    result = create();
+    fs_get_stats(&stats);
+    uint64_t first_lookups = stats.cache_hits + stats.cache_misses;
+    fs_reset_stats();
+    int second = create();
+    fs_get_stats(&stats);
+    lookups = stats.cache_hits + stats.cache_misses;
+    ok = result == 200 && second == 201 && first_lookups <= 10 && lookups <= 2;
+
+    // ... and still hands out the lowest free inode first
+    delete(150);
+    delete(3);
+    ok = ok && create() == 3 && create() == 150 && create() == 202;
+    unmount();
+    ok ? results.passed++ : results.failed++;
+    print_test_result("create() needs no inode scan", ok, (int)lookups);
+
+    // Test 6: create_many() of 64 files (inodes 1-64) touches each of their 3
+    // inode blocks at most once (read + write), and delete_many() frees
+    // inodes and blocks for reuse. A negative count is rejected and a count
+    // of 0 does nothing. A batch where one file of an inode block has an
+    // unreadable indirect block deletes none of that block's files and frees
+    // none of their blocks (inode 64, walked first, keeps its data while a
+    // new file takes the lowest free block)
+    print_test_header("Batched create and delete");
+    results.total++;
+    int inodes[64];
+    uint8_t data[1024];
+    memset(data, 0x3c, sizeof(data));
+    format((char *)disk_name, 256);
+    mount((char *)disk_name);
+    create(); // builds the inode bitmap
+    fs_reset_stats();
+    result = create_many(64, inodes);
+    fs_get_stats(&stats);
+    lookups = stats.cache_hits + stats.cache_misses;
+    ok = result == 64 && inodes[0] == 1 && inodes[63] == 64 && lookups <= 6;
+    for (int i = 0; i < 64; i++)
+    {
+        write(inodes[i], data, sizeof(data), 0);
+    }
+    const int doomed[] = {40, 2, 9, 40, 500}; // a duplicate and an invalid inode
+    result = delete_many(doomed, 5);
+    ok = ok && result == E_INVALID_INODE && stat(9) < 0 && stat(40) < 0 && stat(10) == 1024;
+    ok = ok && create_many(4, inodes) == 4 && inodes[0] == 2 && inodes[1] == 9 && inodes[2] == 40 && inodes[3] == 65;
+    ok = ok && delete_many(inodes, -1) == E_INVALID_OFFSET && create_many(0, inodes) == 0 &&
+         delete_many(inodes, 0) == 0 && stat(inodes[0]) == 0 && create() == 66;
+    delete(66);
+    ok = ok && write(inodes[0], data, sizeof(data), 0) == 1024;
+    int broken = create();
+    for (int offset = 0; offset < 5 * 1024; offset += 1024)
+    {
+        write(broken, data, sizeof(data), offset); // the 5th block is behind the indirect one
+    }
+    unmount();
+    result = set_indirect_block(disk_name, broken, 0x7fffffff);
+    mount((char *)disk_name);
+    const int batch[] = {broken, 64};
+    int batch_result = delete_many(batch, 2);
+    memset(data, 0xc3, sizeof(data));
+    write(create(), data, sizeof(data), 0);
+    ok = ok && result == 0 && broken / 32 == 64 / 32 && batch_result < 0 && batch_result != E_INVALID_INODE &&
+         stat(64) == 1024 && stat(broken) == 5 * 1024 && read(64, data, sizeof(data), 0) == 1024 && data[0] == 0x3c;
+    unmount();
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Batched create and delete", ok, (int)lookups);
+
+    // Test 7: stat_all() reports every file with its size and blocks, reading
+    // the inode table (32 blocks) in one request. Only the sparse file's
+    // indirect block is read (to leave the hole out); the others' block
+    // counts follow from their sizes
+    print_test_header("stat_all inventory");
+    results.total++;
+    const int sizes[] = {0, 1, 1024, 5 * 1024, 300 * 1024};
+    const char *stat_disk = "stat_disk.img"; // 8 MiB, for the 20 files of 300 KiB
+    uint8_t *contents = calloc(300 * 1024, 1);
+    make_image(stat_disk, 8192);
+    format((char *)stat_disk, 1024);
+    mount((char *)stat_disk);
+    for (int i = 0; i < 100; i++)
+    {
+        int file = create();
+        write(file, contents, sizes[i % 5], 0);
+    }
+    for (int i = 0; i < 100; i += 3)
+    {
+        delete(i);
+    }
+    write(create(), contents, 10, 200 * 1024); // inode 0: hole, then 1 block behind the indirect one
+    unmount();
+    fs_set_cache_size(0);
+    mount((char *)stat_disk);
+    stat_check_t check = {0, -1, true};
+    fs_reset_stats();
+    result = stat_all(check_stat, &check);
+    fs_get_stats(&stats);
+    unmount();
+    fs_set_cache_size(1024 * 1024);
+    remove(stat_disk);
+    free(contents);
+    ok = result == 67 && check.files == 67 && check.ok && stats.host_calls == 2;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("stat_all inventory", ok, result);
+
+    // Test 8: Small appends only touch their data block (read + write): the
+    // inode, new file included, stays in memory until fs_sync() (or the
+    // dirty limit, here 0)
+    print_test_header("Inodes written back lazily");
+    results.total++;
+    uint8_t bytes[10] = "0123456789";
+    fs_set_cache_size(0);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    inode = create();
+    write(inode, bytes, sizeof(bytes), 0);
+    fs_reset_stats();
+    for (int i = 1; i <= 50; i++)
+    {
+        write(inode, bytes, sizeof(bytes), i * sizeof(bytes));
+    }
+    fs_get_stats(&stats);
+    uint32_t before_sync = read_inode_size(disk_name, inode);
+    result = fs_sync();
+    uint32_t after_sync = read_inode_size(disk_name, inode);
+    fs_set_inode_dirty_limit(0);
+    write(inode, bytes, sizeof(bytes), 51 * sizeof(bytes));
+    uint32_t write_through = read_inode_size(disk_name, inode);
+    fs_set_inode_dirty_limit(64);
+    unmount();
+    mount((char *)disk_name);
+    ok = result == 0 && stats.host_calls <= 100 && before_sync == 0 && after_sync == 510 &&
+         write_through == 520 && stat(inode) == 520;
+    unmount();
+    fs_set_cache_size(1024 * 1024);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Inodes written back lazily", ok, (int)stats.host_calls);
+
+    // Test 9: New blocks are written once, with no zero-fill or read first:
+    // appends of a block, then a write past the end (a hole of 2 blocks, and
+    // a new block zeroed in memory around the data)
+    print_test_header("New blocks written once");
+    results.total++;
+    uint8_t blocks_data[3 * 1024];
+    fs_set_cache_size(0);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    inode = create();
+    int other = create();
+    memset(blocks_data, 0x77, sizeof(blocks_data));
+    write(inode, blocks_data, 1024, 0); // waits for the block bitmap
+    fs_reset_stats();
+    for (int i = 1; i < 4; i++)
+    {
+        write(inode, blocks_data, 1024, i * 1024);
+    }
+    fs_get_stats(&stats);
+    uint64_t append_calls = stats.host_calls;
+    fs_reset_stats();
+    result = write(other, bytes, sizeof(bytes), 3000);
+    fs_get_stats(&stats);
+    ok = append_calls == 3 && stats.host_calls == 1 && result == sizeof(bytes);
+    memset(blocks_data, 0xff, sizeof(blocks_data));
+    result = read(other, blocks_data, sizeof(blocks_data), 0);
+    for (int i = 0; i < 3010 && ok; i++)
+    {
+        ok = blocks_data[i] == ((i < 3000) ? 0 : bytes[i - 3000]);
+    }
+    unmount();
+    fs_set_cache_size(1024 * 1024);
+    ok = ok && result == 3010;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("New blocks written once", ok, (int)stats.host_calls);
+
+    fs_set_cache_size(4 * 1024);
+    add_results(&results, run_large_file_tests(1024));
+    fs_set_cache_policy(VDISK_CACHE_LRU);
+    add_results(&results, run_large_file_tests(1024));
+    fs_set_cache_policy(VDISK_CACHE_2Q);
+    fs_set_cache_size(0);
+    add_results(&results, run_large_file_tests(1024));
+    fs_set_cache_size(1024 * 1024);
+
+    return results;
+}
+
+// Helper function to record the # of blocks of each file reported by
+// stat_all() (`arg`: array indexed by inode #)
+static void record_blocks(const fs_stat_t *file, void *arg)
+{
+    ((uint32_t *)arg)[file->inode] = file->blocks;
+}
+
+// Run extent inode tests: contiguous files in one extent, fragmented files
+// in an extent tree, holes, fallocate(), then the basic and large file tests
+// on a volume of extent inodes
+TestResults run_extent_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const char *extent_disk = "extent_disk.img"; // 16 MiB: 16379 data blocks
+    const int chunk = 256 * 1024;
+    fs_stats_t stats;
+
+    log_test("Extent Inode Tests");
+    fs_set_inode_format(FS_INODE_EXTENTS);
+
+    // Test 1: An 8 MiB file written sequentially is one extent, in the
+    // inode: no metadata block at all, and a cold sequential read of it
+    // looks up at most 2 blocks (the inode's)
+    print_test_header("Contiguous file in one extent");
+    results.total++;
+    const int file_size = 8 * 1024 * 1024;
+    uint8_t *pattern = malloc(file_size);
+    uint8_t *read_buffer = malloc(file_size);
+    fill_pattern(pattern, file_size, 23);
+    make_image(extent_disk, 16384);
+    format((char *)extent_disk, 64);
+    mount((char *)extent_disk);
+    int inode = create();
+    int written = 0;
+    for (int offset = 0; offset < file_size; offset += chunk)
+    {
+        written += write(inode, pattern + offset, chunk, offset);
+    }
+    uint32_t blocks[64] = {0};
+    stat_all(record_blocks, blocks);
+    unmount();
+    mount((char *)extent_disk);
+    fs_reset_stats();
+    int result = 0;
+    for (int offset = 0; offset < file_size; offset += chunk)
+    {
+        result += read(inode, read_buffer + offset, chunk, offset);
+    }
+    fs_get_stats(&stats);
+    unmount();
+    uint64_t lookups = stats.cache_hits + stats.cache_misses;
+    bool ok = written == file_size && blocks[inode] == 8192 && result == file_size &&
+              memcmp(read_buffer, pattern, file_size) == 0 && lookups <= 2;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Contiguous file in one extent", ok, (int)lookups);
+
+    // Test 2: Two files appended to block by block in turn get no two
+    // blocks in a row, so 3000 extents each: a tree of 36 full leaves under
+    // an index block. Both read back after a crash, whose inode scan finds
+    // all their blocks in use (the rest of the volume takes one more file),
+    // and deleting them frees everything, tree blocks included
+    print_test_header("Fragmented files in an extent tree");
+    results.total++;
+    const int fragmented = 3000 * 1024;
+    uint8_t *other_pattern = malloc(fragmented);
+    fill_pattern(other_pattern, fragmented, 29);
+    format((char *)extent_disk, 64);
+    mount((char *)extent_disk);
+    int first = create();
+    int second = create();
+    written = 0;
+    for (int offset = 0; offset < fragmented; offset += 1024)
+    {
+        written += write(first, pattern + offset, 1024, offset);
+        written += write(second, other_pattern + offset, 1024, offset);
+    }
+    memset(blocks, 0, sizeof(blocks));
+    stat_all(record_blocks, blocks);
+    ok = written == 2 * fragmented && blocks[first] == 3000 + 37 && blocks[second] == 3000 + 37;
+    unmount();
+    simulate_crash(extent_disk, 3);
+    mount((char *)extent_disk);
+    int rest = create();
+    const int free_bytes = (16379 - 2 * (3000 + 37)) * 1024;
+    uint8_t *filler = calloc(file_size, 1);
+    ok = ok && write(rest, filler, file_size, 0) + write(rest, filler, file_size, file_size) == free_bytes;
+    memset(read_buffer, 0, fragmented);
+    ok = ok && read(first, read_buffer, fragmented, 0) == fragmented &&
+         memcmp(read_buffer, pattern, fragmented) == 0;
+    memset(read_buffer, 0, fragmented);
+    ok = ok && read(second, read_buffer, fragmented, 0) == fragmented &&
+         memcmp(read_buffer, other_pattern, fragmented) == 0;
+    delete(first);
+    delete(second);
+    delete(rest);
+    unmount();
+    mount((char *)extent_disk);
+    inode = create();
+    result = write(inode, filler, file_size, 0) + write(inode, filler, file_size, file_size);
+    unmount();
+    ok = ok && result == 16379 * 1024;
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Fragmented files in an extent tree", ok, result);
+    free(filler);
+    free(other_pattern);
+    remove(extent_disk);
+
+    // Test 3: A write far past the end leaves a hole; blocks written into
+    // it later get their own extents (3 extents: the root moves to a leaf
+    // block), and the rest of the 1020 data blocks stays free
+    print_test_header("Holes in an extent file");
+    results.total++;
+    const int far = 60 * 1024 * 1024;
+    uint8_t bytes[10] = "0123456789";
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    inode = create();
+    result = write(inode, bytes, sizeof(bytes), far);
+    ok = result == sizeof(bytes) && stat(inode) == far + 10;
+    ok = ok && write(inode, bytes, sizeof(bytes), 1024) == sizeof(bytes) &&
+         write(inode, bytes, sizeof(bytes), 8 * 1024) == sizeof(bytes);
+    unmount();
+    mount((char *)disk_name);
+    memset(read_buffer, 0xff, 1024);
+    ok = ok && read(inode, read_buffer, 1024, 1024 * 1024) == 1024;
+    for (int i = 0; i < 1024 && ok; i++)
+    {
+        ok = read_buffer[i] == 0;
+    }
+    ok = ok && read(inode, read_buffer, 20, 1020) == 20 && memcmp(read_buffer + 4, bytes, 10) == 0 &&
+         read_buffer[0] == 0 && read(inode, read_buffer, 15, far - 5) == 15 &&
+         memcmp(read_buffer + 5, bytes, 10) == 0;
+    ok = ok && seek(inode, 0, FS_SEEK_DATA) == 1024 && seek(inode, 2048, FS_SEEK_DATA) == 8 * 1024 &&
+         seek(inode, 8 * 1024, FS_SEEK_HOLE) == 9 * 1024 && seek(inode, 9 * 1024, FS_SEEK_DATA) == far;
+    int other = create();
+    ok = ok && write(other, pattern, 1020 * 1024, 0) == 1016 * 1024;
+    unmount();
+    ok ? results.passed++ : results.failed++;
+    print_test_result("Holes in an extent file", ok, result);
+    free(pattern);
+    free(read_buffer);
+
+    // Test 4: fallocate() reserves the rest of 500 KiB with no I/O (one
+    // unwritten extent, from block 6: another file has block 5). Writes then
+    // fill the reserved blocks in place, even when appends to the other file
+    // come in between and one lands in the middle (a leaf block holds the
+    // extents). The file takes 500 blocks and the leaf, the other 101: 418
+    // are left. Pointer volumes can't hold unwritten blocks
+    print_test_header("fallocate");
+    results.total++;
+    const int reserved = 500 * 1024;
+    pattern = malloc(reserved);
+    read_buffer = malloc(reserved);
+    fill_pattern(pattern, reserved, 41);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    inode = create();
+    other = create();
+    write(inode, pattern, 1024, 0);
+    write(other, pattern, 1024, 0);
+    fs_reset_stats();
+    result = fallocate(inode, 0, reserved);
+    fs_get_stats(&stats);
+    memset(read_buffer, 0xff, reserved);
+    ok = result == 0 && stats.host_calls == 0 && stat(inode) == reserved &&
+         read(inode, read_buffer, reserved, 0) == reserved && memcmp(read_buffer, pattern, 1024) == 0 &&
+         seek(inode, 0, FS_SEEK_HOLE) == 1024;
+    for (int i = 1024; i < reserved && ok; i++)
+    {
+        ok = read_buffer[i] == 0;
+    }
+    for (int offset = 1024; offset <= 100 * 1024; offset += 1024)
+    {
+        write(inode, pattern + offset, 1024, offset);
+        write(other, pattern, 1024, offset);
+    }
+    write(inode, pattern + 300 * 1024, 1024, 300 * 1024);
+    memset(blocks, 0, sizeof(blocks));
+    stat_all(record_blocks, blocks);
+    ok = ok && blocks[inode] == 501 && blocks[other] == 101;
+    unmount();
+    mount((char *)disk_name);
+    memset(read_buffer, 0xff, reserved);
+    ok = ok && read(inode, read_buffer, reserved, 0) == reserved &&
+         memcmp(read_buffer, pattern, 101 * 1024) == 0 &&
+         memcmp(read_buffer + 300 * 1024, pattern + 300 * 1024, 1024) == 0;
+    for (int i = 101 * 1024; i < reserved && ok; i++)
+    {
+        ok = (i >= 300 * 1024 && i < 301 * 1024) || read_buffer[i] == 0;
+    }
+    ok = ok && write(create(), pattern, reserved, 0) == 418 * 1024;
+    unmount();
+    fs_set_inode_format(FS_INODE_POINTERS);
+    format((char *)disk_name, 64);
+    mount((char *)disk_name);
+    ok = ok && fallocate(create(), 0, 1024) == E_NOT_SUPPORTED;
+    unmount();
+    fs_set_inode_format(FS_INODE_EXTENTS);
+    ok ? results.passed++ : results.failed++;
+    print_test_result("fallocate", ok, result);
+    free(pattern);
+    free(read_buffer);
+
+    add_results(&results, run_basic_tests());
+    add_results(&results, run_large_file_tests(1024));
+    add_results(&results, run_large_file_tests(4096));
+    fs_set_inode_format(FS_INODE_POINTERS);
+
+    return results;
+}
+
 int main(void)
 {
     printf("File System Testing Suite\n");
     printf("=======================\n\n");
 
     TestResults basic_results = run_basic_tests();
+    TestResults large_results = run_large_file_tests(1024);
+    TestResults block_size_results = run_block_size_tests();
+    TestResults allocation_results = run_allocation_tests();
+    TestResults goal_results = run_goal_allocation_tests();
+    TestResults sparse_results = run_sparse_tests();
+    TestResults cache_results = run_cache_tests();
+    TestResults readahead_results = run_readahead_tests(true);
+    TestResults extent_results = run_extent_tests();
+
+    // Run the same suites on every virtual disk backend
+    const int modes[] = {VDISK_MODE_STDIO, VDISK_MODE_MMAP, VDISK_MODE_DIRECT};
+    TestResults backend_results = {0, 0, 0};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        // Skip backends the host can't provide (e.g. O_DIRECT on tmpfs)
+        DISK probe;
+        if (vdisk_on_mode("test_disk.img", &probe, modes[m]) != 0)
+        {
+            printf("\nSkipping virtual disk backend %d (unavailable)\n", modes[m]);
+            continue;
+        }
+        vdisk_off(&probe);
+
+        vdisk_set_default_mode(modes[m]);
+        add_results(&backend_results, run_basic_tests());
+        add_results(&backend_results, run_large_file_tests(1024));
+        add_results(&backend_results, run_block_size_tests());
+        add_results(&backend_results, run_allocation_tests());
+        add_results(&backend_results, run_goal_allocation_tests());
+        add_results(&backend_results, run_sparse_tests());
+        add_results(&backend_results, run_readahead_tests(modes[m] == VDISK_MODE_DIRECT));
+    }
+    vdisk_set_default_mode(VDISK_MODE_PREAD);
+
+    TestResults all_results = {0, 0, 0};
+    add_results(&all_results, basic_results);
+    add_results(&all_results, large_results);
+    add_results(&all_results, block_size_results);
+    add_results(&all_results, allocation_results);
+    add_results(&all_results, goal_results);
+    add_results(&all_results, sparse_results);
+    add_results(&all_results, cache_results);
+    add_results(&all_results, readahead_results);
+    add_results(&all_results, extent_results);
+    add_results(&all_results, backend_results);
 
     // Print final summary
     printf("\n\n==== FINAL TEST SUMMARY ====\n");
     printf("Basic Tests: %d/%d passed (%.1f%%)\n",
            basic_results.passed, basic_results.total,
            (basic_results.passed * 100.0) / basic_results.total);
-    print_test_summary(basic_results);
+    printf("Large File Tests: %d/%d passed (%.1f%%)\n",
+           large_results.passed, large_results.total,
+           (large_results.passed * 100.0) / large_results.total);
+    printf("Block Size Tests: %d/%d passed (%.1f%%)\n",
+           block_size_results.passed, block_size_results.total,
+           (block_size_results.passed * 100.0) / block_size_results.total);
+    printf("Allocation Tests: %d/%d passed (%.1f%%)\n",
+           allocation_results.passed, allocation_results.total,
+           (allocation_results.passed * 100.0) / allocation_results.total);
+    printf("Goal-Based Allocation Tests: %d/%d passed (%.1f%%)\n",
+           goal_results.passed, goal_results.total,
+           (goal_results.passed * 100.0) / goal_results.total);
+    printf("Sparse File Tests: %d/%d passed (%.1f%%)\n",
+           sparse_results.passed, sparse_results.total,
+           (sparse_results.passed * 100.0) / sparse_results.total);
+    printf("Block Cache Tests: %d/%d passed (%.1f%%)\n",
+           cache_results.passed, cache_results.total,
+           (cache_results.passed * 100.0) / cache_results.total);
+    printf("Readahead Tests: %d/%d passed (%.1f%%)\n",
+           readahead_results.passed, readahead_results.total,
+           (readahead_results.passed * 100.0) / readahead_results.total);
+    printf("Extent Inode Tests: %d/%d passed (%.1f%%)\n",
+           extent_results.passed, extent_results.total,
+           (extent_results.passed * 100.0) / extent_results.total);
+    printf("Backend Tests: %d/%d passed (%.1f%%)\n",
+           backend_results.passed, backend_results.total,
+           (backend_results.passed * 100.0) / backend_results.total);
+    print_test_summary(all_results);
 
-    return basic_results.failed > 0 ? 1 : 0;
+    return all_results.failed > 0 ? 1 : 0;
 }
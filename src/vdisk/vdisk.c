@@ -1,8 +1,13 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <bsd/string.h>
 
 #ifndef __APPLE__
@@ -13,35 +18,219 @@
 #include "../include/error.h"
 #include "../include/vdisk.h"
 
-const int VDISK_SECTOR_SIZE = 1024;
+const int VDISK_SECTOR_SIZE = VDISK_MIN_SECTOR_SIZE;
+
+// Max # of iovecs per preadv/pwritev call (IOV_MAX on Linux)
+#define VDISK_MAX_IOV 1024
+
+// Backend used by vdisk_on (see vdisk_set_default_mode)
+static int default_mode = VDISK_MODE_PREAD;
+
+static int open_error(void) {
+    if (errno == EACCES) {
+        return vdisk_EACCESS;
+    }
+    if (errno == ENOENT) {
+        return vdisk_ENOEXIST;
+    }
+    return -1; // unknown error
+}
+
+static int is_on(DISK *diskp) {
+    if (diskp->mode == VDISK_MODE_STDIO) {
+        return diskp->fp != NULL;
+    }
+    return diskp->fd >= 0;
+}
+
+static int is_positional(DISK *diskp) {
+    return diskp->mode == VDISK_MODE_PREAD || diskp->mode == VDISK_MODE_DIRECT;
+}
+
+/*************************/
+/* Buffer pool           */
+/*************************/
+
+static int pool_init(DISK *diskp) {
+    void *pool;
+    if (posix_memalign(&pool, VDISK_BUF_ALIGN, (size_t)VDISK_POOL_BUFFERS * diskp->sector_size) != 0) {
+        return -1;
+    }
+    diskp->pool_free = malloc(VDISK_POOL_BUFFERS * sizeof(uint8_t *));
+    if (diskp->pool_free == NULL) {
+        free(pool);
+        return -1;
+    }
+    diskp->pool = pool;
+    for (uint32_t i = 0; i < VDISK_POOL_BUFFERS; i++) {
+        diskp->pool_free[i] = diskp->pool + (size_t)i * diskp->sector_size;
+    }
+    diskp->pool_free_count = VDISK_POOL_BUFFERS;
+    return 0;
+}
+
+static void pool_exit(DISK *diskp) {
+    free(diskp->pool);
+    free(diskp->pool_free);
+    diskp->pool = NULL;
+    diskp->pool_free = NULL;
+    diskp->pool_free_count = 0;
+}
+
+// Get a sector-sized buffer aligned for any backend (O_DIRECT included)
+// Served from the disk's preallocated pool; falls back to the heap when the
+// pool is exhausted. Return it with vdisk_buf_put
+uint8_t *vdisk_buf_get(DISK *diskp) {
+    if (diskp->pool_free_count > 0) {
+        return diskp->pool_free[--diskp->pool_free_count];
+    }
+    void *buffer;
+    if (posix_memalign(&buffer, VDISK_BUF_ALIGN, diskp->sector_size) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+void vdisk_buf_put(DISK *diskp, uint8_t *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    uint8_t *pool_end = diskp->pool + (size_t)VDISK_POOL_BUFFERS * diskp->sector_size;
+    if (diskp->pool != NULL && buffer >= diskp->pool && buffer < pool_end) {
+        diskp->pool_free[diskp->pool_free_count++] = buffer;
+    } else {
+        free(buffer);
+    }
+}
+
+static int is_direct_aligned(const void *buffer) {
+    return ((uintptr_t)buffer % VDISK_DIRECT_ALIGN) == 0;
+}
+
+/*************************/
+/* Sector I/O            */
+/*************************/
 
 int vdisk_on(char *filename, DISK *diskp) {
-    FILE *vdisk = fopen(filename, "r+b");
-    diskp->fp = vdisk;
-    if (vdisk == NULL) {
-        if (errno == EACCES) {
-            return vdisk_EACCESS;
+    return vdisk_on_mode(filename, diskp, default_mode);
+}
+
+void vdisk_set_default_mode(int mode) {
+    default_mode = mode;
+}
+
+int vdisk_on_mode(char *filename, DISK *diskp, int mode) {
+    diskp->fp = NULL;
+    diskp->fd = -1;
+    diskp->map = NULL;
+    diskp->map_len = 0;
+    diskp->mode = mode;
+    diskp->host_calls = 0;
+    diskp->pool = NULL;
+    diskp->pool_free = NULL;
+    diskp->pool_free_count = 0;
+    diskp->aio = NULL;
+    diskp->cache = NULL;
+    diskp->cache_hits = 0;
+    diskp->cache_misses = 0;
+
+    long size;
+    if (mode == VDISK_MODE_STDIO) {
+        FILE *vdisk = fopen(filename, "r+b");
+        diskp->fp = vdisk;
+        if (vdisk == NULL) {
+            return open_error();
+        }
+        fseek(vdisk, 0L, SEEK_END);
+        size = ftell(vdisk);
+    } else if (mode == VDISK_MODE_PREAD || mode == VDISK_MODE_MMAP || mode == VDISK_MODE_DIRECT) {
+        int flags = O_RDWR;
+        if (mode == VDISK_MODE_DIRECT) {
+#ifdef O_DIRECT
+            flags |= O_DIRECT;
+#else
+            return vdisk_EMODE;
+#endif
         }
-        if (errno == ENOENT) {
-            return vdisk_ENOEXIST;
-        } else {
-            return -1; // unknown error
+        diskp->fd = open(filename, flags);
+        if (diskp->fd < 0) {
+            // EINVAL: the host file system does not support O_DIRECT
+            return (errno == EINVAL) ? vdisk_EMODE : open_error();
         }
+        struct stat st;
+        if (fstat(diskp->fd, &st) != 0) {
+            close(diskp->fd);
+            diskp->fd = -1;
+            return -1;
+        }
+        size = st.st_size;
+    } else {
+        return vdisk_EMODE;
     }
+
     int filename_length = strlen(filename) + 1;
     diskp->name = malloc(filename_length);
     strlcpy(diskp->name, filename, filename_length);
 
-    fseek(vdisk, 0L, SEEK_END);
-    diskp->size_in_sectors = ftell(vdisk) / VDISK_SECTOR_SIZE;
+    diskp->size_in_sectors = size / VDISK_SECTOR_SIZE;
     if (diskp->size_in_sectors == 0) {
         vdisk_off(diskp);
         return vdisk_ENODISK;
     }
     diskp->sector_size = VDISK_SECTOR_SIZE;
+
+    if (mode == VDISK_MODE_MMAP) {
+        // Map whole sectors only; a trailing partial sector is never addressed
+        size_t map_len = (size_t)diskp->size_in_sectors * VDISK_SECTOR_SIZE;
+        void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, diskp->fd, 0);
+        if (map == MAP_FAILED) {
+            vdisk_off(diskp);
+            return -1;
+        }
+        diskp->map = map;
+        diskp->map_len = map_len;
+    }
+
+    if (pool_init(diskp) != 0) {
+        vdisk_off(diskp);
+        return -1;
+    }
     return 0;
 }
 
+// Re-cut the image into sectors of `sector_size` bytes (a power of 2 between
+// VDISK_MIN_SECTOR_SIZE and VDISK_MAX_SECTOR_SIZE). Only whole sectors of the
+// current size are kept. All pool buffers must have been returned, since the
+// pool is rebuilt at the new size; the async engine and the sector cache are
+// shut down
+int vdisk_set_sector_size(DISK *diskp, uint32_t sector_size) {
+    if (!is_on(diskp)) {
+        return vdisk_ENODISK;
+    }
+    if (sector_size < VDISK_MIN_SECTOR_SIZE || sector_size > VDISK_MAX_SECTOR_SIZE ||
+        (sector_size & (sector_size - 1)) != 0) {
+        return vdisk_ESIZE;
+    }
+    if (sector_size == diskp->sector_size) {
+        return 0;
+    }
+    if (diskp->pool_free_count != VDISK_POOL_BUFFERS) {
+        return vdisk_EBUSY;
+    }
+
+    uint64_t bytes = (uint64_t)diskp->size_in_sectors * diskp->sector_size;
+    if (bytes / sector_size == 0) {
+        return vdisk_ENODISK;
+    }
+
+    vdisk_aio_exit(diskp);
+    vdisk_cache_exit(diskp);
+    pool_exit(diskp);
+    diskp->size_in_sectors = bytes / sector_size;
+    diskp->sector_size = sector_size;
+    return pool_init(diskp);
+}
+
 int seek_sector(DISK *diskp, uint32_t sector) {
     FILE *vdisk = diskp->fp;
     if (vdisk == NULL) {
@@ -50,49 +239,393 @@ int seek_sector(DISK *diskp, uint32_t sector) {
     if (sector >= diskp->size_in_sectors) {
         return vdisk_EEXCEED;
     }
-    fseek(vdisk, sector * diskp->sector_size, SEEK_SET);
+    fseek(vdisk, (long)sector * diskp->sector_size, SEEK_SET);
     return 0;
 }
 
+// Check that the disk is open and the sector lies on it
+static int check_sector(DISK *diskp, uint32_t sector) {
+    if (!is_on(diskp)) {
+        return vdisk_ENODISK;
+    }
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+    return 0;
+}
+
+static off_t sector_offset(DISK *diskp, uint32_t sector) {
+    return (off_t)sector * diskp->sector_size;
+}
+
+// pread/pwrite `len` bytes at `offset`, resuming after short transfers
+// O_DIRECT transfers from an unaligned buffer go through an aligned bounce
+static int positional_io(DISK *diskp, uint8_t *buffer, size_t len, off_t offset, int is_write) {
+    uint8_t *io_buffer = buffer;
+    if (diskp->mode == VDISK_MODE_DIRECT && !is_direct_aligned(buffer)) {
+        void *bounce;
+        if (posix_memalign(&bounce, VDISK_BUF_ALIGN, len) != 0) {
+            return vdisk_ESECTOR;
+        }
+        io_buffer = bounce;
+        if (is_write) {
+            memcpy(io_buffer, buffer, len);
+        }
+    }
+
+    int err = 0;
+    size_t done = 0;
+    while (done < len) {
+        diskp->host_calls++;
+        ssize_t moved = is_write ? pwrite(diskp->fd, io_buffer + done, len - done, offset + done)
+                                 : pread(diskp->fd, io_buffer + done, len - done, offset + done);
+        if (moved <= 0) {
+            err = vdisk_ESECTOR;
+            break;
+        }
+        done += moved;
+    }
+
+    if (io_buffer != buffer) {
+        if (!is_write && err == 0) {
+            memcpy(buffer, io_buffer, len);
+        }
+        free(io_buffer);
+    }
+    return err;
+}
+
+// Pointer to a sector inside the image mapping, or NULL when the disk is not
+// memory-mapped. Stores through the pointer land in the image directly
+// (vdisk_sync makes them durable).
+uint8_t *vdisk_map_sector(DISK *diskp, uint32_t sector) {
+    if (diskp->map == NULL || sector >= diskp->size_in_sectors) {
+        return NULL;
+    }
+    return diskp->map + sector_offset(diskp, sector);
+}
+
+// Sector I/O through the cache when one is set up (see vdisk_cache.c)
 inline int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->cache != NULL) {
+        return vdisk_cache_read(diskp, sector, buffer, false);
+    }
+    return vdisk_read_uncached(diskp, sector, buffer);
+}
+
+inline int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->cache != NULL) {
+        return vdisk_cache_write(diskp, sector, buffer, false);
+    }
+    return vdisk_write_uncached(diskp, sector, buffer);
+}
+
+// Same for sectors holding file system metadata, which the 2Q cache keeps
+// resident in preference to data
+int vdisk_read_meta(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->cache != NULL) {
+        return vdisk_cache_read(diskp, sector, buffer, true);
+    }
+    return vdisk_read_uncached(diskp, sector, buffer);
+}
+
+int vdisk_write_meta(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->cache != NULL) {
+        return vdisk_cache_write(diskp, sector, buffer, true);
+    }
+    return vdisk_write_uncached(diskp, sector, buffer);
+}
+
+int vdisk_read_uncached(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->mode == VDISK_MODE_MMAP) {
+        int err = check_sector(diskp, sector);
+        if (err) {
+            return err;
+        }
+        memcpy(buffer, vdisk_map_sector(diskp, sector), diskp->sector_size);
+        return 0;
+    }
+
+    if (is_positional(diskp)) {
+        int err = check_sector(diskp, sector);
+        if (err) {
+            return err;
+        }
+        return positional_io(diskp, buffer, diskp->sector_size, sector_offset(diskp, sector), 0);
+    }
+
     int err = seek_sector(diskp, sector);
     if (err) {
         return err;
     }
+    diskp->host_calls += 2;
     if (fread(buffer, 1, diskp->sector_size, diskp->fp) != diskp->sector_size) {
         return vdisk_ESECTOR;
     }
     return 0;
 }
 
-inline int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+int vdisk_write_uncached(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->mode == VDISK_MODE_MMAP) {
+        int err = check_sector(diskp, sector);
+        if (err) {
+            return err;
+        }
+        // memmove: the caller may hand back a pointer from vdisk_map_sector
+        memmove(vdisk_map_sector(diskp, sector), buffer, diskp->sector_size);
+        return 0;
+    }
+
+    if (is_positional(diskp)) {
+        int err = check_sector(diskp, sector);
+        if (err) {
+            return err;
+        }
+        return positional_io(diskp, buffer, diskp->sector_size, sector_offset(diskp, sector), 1);
+    }
+
     int err = seek_sector(diskp, sector);
     if (err) {
         return err;
     }
+    diskp->host_calls += 2;
     if (fwrite(buffer, 1, diskp->sector_size, diskp->fp) != diskp->sector_size) {
         return vdisk_ESECTOR;
     }
     return 0;
 }
 
-int vdisk_sync(DISK *diskp) {
-    FILE *vdisk = diskp->fp;
-    if (vdisk == NULL){
+// Check that `count` sectors starting at `sector` all lie on the disk
+static int check_range(DISK *diskp, uint32_t sector, uint32_t count) {
+    if (!is_on(diskp)) {
         return vdisk_ENODISK;
     }
-    fflush(vdisk);
-    fsync(fileno(vdisk));
+    if (count == 0 || sector >= diskp->size_in_sectors || count > diskp->size_in_sectors - sector) {
+        return vdisk_EEXCEED;
+    }
+    return 0;
+}
+
+// Check a range about to be transferred around the sector cache and keep the
+// cache coherent with it: dirty sectors are written back before a read, and
+// cached copies dropped before a write
+static int bypass_cache(DISK *diskp, uint32_t sector, uint32_t count, int is_write) {
+    int err = check_range(diskp, sector, count);
+    if (err) {
+        return err;
+    }
+    if (is_write) {
+        vdisk_cache_drop(diskp, sector, count);
+        return 0;
+    }
+    return vdisk_cache_clean(diskp, sector, count);
+}
+
+// Transfer `count` contiguous sectors between the disk and one buffer each,
+// with as few host calls as the backend allows
+static int transfer_vector(DISK *diskp, uint32_t sector, uint8_t **buffers, uint32_t count, int is_write) {
+    int err = bypass_cache(diskp, sector, count, is_write);
+    if (err) {
+        return err;
+    }
+
+    if (diskp->mode == VDISK_MODE_STDIO) {
+        for (uint32_t i = 0; i < count; i++) {
+            err = is_write ? vdisk_write_uncached(diskp, sector + i, buffers[i])
+                           : vdisk_read_uncached(diskp, sector + i, buffers[i]);
+            if (err) {
+                return err;
+            }
+        }
+        return 0;
+    }
+
+    if (diskp->mode == VDISK_MODE_MMAP) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t *mapped = vdisk_map_sector(diskp, sector + i);
+            if (is_write) {
+                memmove(mapped, buffers[i], diskp->sector_size);
+            } else {
+                memmove(buffers[i], mapped, diskp->sector_size);
+            }
+        }
+        return 0;
+    }
+
+    // Positional backend: one preadv/pwritev per VDISK_MAX_IOV sectors,
+    // resuming after short transfers. O_DIRECT needs every iovec aligned,
+    // unaligned buffers are bounced through pool buffers
+    struct iovec iov[VDISK_MAX_IOV];
+    uint8_t *bounce[VDISK_MAX_IOV];
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t n = count - done;
+        if (n > VDISK_MAX_IOV) {
+            n = VDISK_MAX_IOV;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            bounce[i] = NULL;
+            iov[i].iov_base = buffers[done + i];
+            iov[i].iov_len = diskp->sector_size;
+            if (diskp->mode == VDISK_MODE_DIRECT && !is_direct_aligned(buffers[done + i])) {
+                bounce[i] = vdisk_buf_get(diskp);
+                if (bounce[i] == NULL) {
+                    err = vdisk_ESECTOR;
+                    n = i;
+                    break;
+                }
+                if (is_write) {
+                    memcpy(bounce[i], buffers[done + i], diskp->sector_size);
+                }
+                iov[i].iov_base = bounce[i];
+            }
+        }
+
+        struct iovec *first = iov;
+        int remaining = (err == 0) ? (int)n : 0;
+        off_t offset = sector_offset(diskp, sector + done);
+        while (remaining > 0) {
+            diskp->host_calls++;
+            ssize_t moved = is_write ? pwritev(diskp->fd, first, remaining, offset)
+                                     : preadv(diskp->fd, first, remaining, offset);
+            if (moved <= 0) {
+                err = vdisk_ESECTOR;
+                break;
+            }
+            offset += moved;
+            while (remaining > 0 && (size_t)moved >= first->iov_len) {
+                moved -= first->iov_len;
+                first++;
+                remaining--;
+            }
+            if (remaining > 0 && moved > 0) {
+                first->iov_base = (uint8_t *)first->iov_base + moved;
+                first->iov_len -= moved;
+            }
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (bounce[i] != NULL) {
+                if (!is_write && err == 0) {
+                    memcpy(buffers[done + i], bounce[i], diskp->sector_size);
+                }
+                vdisk_buf_put(diskp, bounce[i]);
+            }
+        }
+        if (err) {
+            return err;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Read `count` contiguous sectors into one buffer of count * sector_size bytes
+int vdisk_read_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer) {
+    int err = bypass_cache(diskp, sector, count, 0);
+    if (err) {
+        return err;
+    }
+    size_t len = (size_t)count * diskp->sector_size;
+
+    if (diskp->mode == VDISK_MODE_MMAP) {
+        memcpy(buffer, vdisk_map_sector(diskp, sector), len);
+        return 0;
+    }
+    if (is_positional(diskp)) {
+        return positional_io(diskp, buffer, len, sector_offset(diskp, sector), 0);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        err = vdisk_read_uncached(diskp, sector + i, buffer + (size_t)i * diskp->sector_size);
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+// Write `count` contiguous sectors from one buffer of count * sector_size bytes
+int vdisk_write_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer) {
+    int err = bypass_cache(diskp, sector, count, 1);
+    if (err) {
+        return err;
+    }
+    size_t len = (size_t)count * diskp->sector_size;
+
+    if (diskp->mode == VDISK_MODE_MMAP) {
+        memmove(vdisk_map_sector(diskp, sector), buffer, len);
+        return 0;
+    }
+    if (is_positional(diskp)) {
+        return positional_io(diskp, buffer, len, sector_offset(diskp, sector), 1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        err = vdisk_write_uncached(diskp, sector + i, buffer + (size_t)i * diskp->sector_size);
+        if (err) {
+            return err;
+        }
+    }
     return 0;
 }
 
+// Scatter read: `count` contiguous sectors, sector i into buffers[i]
+int vdisk_readv(DISK *diskp, uint32_t sector, uint8_t **buffers, uint32_t count) {
+    return transfer_vector(diskp, sector, buffers, count, 0);
+}
+
+// Gather write: `count` contiguous sectors, sector i from buffers[i]
+int vdisk_writev(DISK *diskp, uint32_t sector, uint8_t **buffers, uint32_t count) {
+    return transfer_vector(diskp, sector, buffers, count, 1);
+}
+
+int vdisk_sync(DISK *diskp) {
+    if (!is_on(diskp)) {
+        return vdisk_ENODISK;
+    }
+    int err = vdisk_cache_flush(diskp);
+    int synced = 0;
+    if (diskp->mode == VDISK_MODE_STDIO) {
+        synced = fflush(diskp->fp) == 0 && fsync(fileno(diskp->fp)) == 0;
+    } else {
+        synced = 1;
+        if (diskp->map != NULL) {
+            diskp->host_calls++;
+            synced = msync(diskp->map, diskp->map_len, MS_SYNC) == 0;
+        }
+        synced = fsync(diskp->fd) == 0 && synced;
+    }
+    if (err == 0 && !synced) {
+        err = vdisk_EIO; // the data may not be on stable storage
+    }
+    return err;
+}
+
 void vdisk_off(DISK *diskp) {
-    FILE *vdisk = diskp->fp;
-    if (vdisk == NULL) {
+    if (!is_on(diskp)) {
         return;
     }
-    fpurge(vdisk);
-    fclose(vdisk);
+    vdisk_aio_exit(diskp);
+    if (diskp->cache != NULL) {
+        vdisk_cache_exit(diskp);
+        if (diskp->fp != NULL) {
+            fflush(diskp->fp); // the write-backs, before fpurge drops them
+        }
+    }
+    if (diskp->mode == VDISK_MODE_STDIO) {
+        fpurge(diskp->fp);
+        fclose(diskp->fp);
+        diskp->fp = NULL;
+    } else {
+        if (diskp->map != NULL) {
+            munmap(diskp->map, diskp->map_len);
+            diskp->map = NULL;
+            diskp->map_len = 0;
+        }
+        close(diskp->fd);
+    }
+    pool_exit(diskp);
     free(diskp->name);
-    diskp->fp = NULL;
+    diskp->fd = -1;
 }
@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define VDISK_HAVE_URING 1
+#endif
+#endif
+
+#include "../include/error.h"
+#include "../include/vdisk.h"
+
+/*
+ * Asynchronous sector I/O.
+ *
+ * Callers queue reads/writes with vdisk_submit_read/vdisk_submit_write
+ * (each tagged with a cookie) and collect them with vdisk_complete. At most
+ * `queue_depth` requests are in flight; submitting more returns vdisk_EBUSY
+ * until some completions are reaped.
+ *
+ * - io_uring: submissions are only queued in the SQ ring and handed to the
+ *   kernel in one io_uring_enter() per vdisk_complete() call (batching).
+ * - thread pool: fallback where io_uring is unavailable, workers run
+ *   blocking pread/pwrite on the shared descriptor.
+ * - sync: stdio and mmap backends have no usable descriptor for concurrent
+ *   positional I/O, requests are performed inline at submit time.
+ *
+ * The io_uring and thread pool engines go around the sector cache, see
+ * vdisk_cache.c.
+ *
+ * With VDISK_MODE_DIRECT, buffers handed to the io_uring/thread engines must
+ * be VDISK_DIRECT_ALIGN-aligned (pool buffers are).
+ */
+
+#define VDISK_AIO_THREADS_MAX 8
+
+typedef struct {
+    uint32_t sector;
+    uint8_t *buffer;
+    uint64_t tag;
+    bool is_write;
+    struct iovec iov; // io_uring only: must stay valid until completion
+} aio_request;
+
+struct vdisk_aio {
+    int engine;
+    uint32_t depth;
+    uint32_t in_flight; // Submitted and not yet reaped by the caller
+
+    // Completions ready for the caller (thread pool and sync engines)
+    vdisk_completion *done;
+    uint32_t done_head;
+    uint32_t done_count;
+
+    // Request slots, free ones kept on a stack
+    aio_request *slots;
+    uint32_t *free_slots;
+    uint32_t free_count;
+
+#ifdef VDISK_HAVE_URING
+    int ring_fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t unsubmitted; // SQEs queued but not yet handed to the kernel
+#endif
+
+    // Thread pool
+    pthread_t threads[VDISK_AIO_THREADS_MAX];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    uint32_t *queue; // Slot ids waiting for a worker (ring of `depth`)
+    uint32_t queue_head;
+    uint32_t queue_count;
+    bool stopping;
+    DISK *diskp;
+};
+
+/*************************/
+/* Slots and completions */
+/*************************/
+
+static int alloc_slot(struct vdisk_aio *aio) {
+    if (aio->free_count == 0) {
+        return -1;
+    }
+    return aio->free_slots[--aio->free_count];
+}
+
+static void release_slot(struct vdisk_aio *aio, uint32_t slot) {
+    aio->free_slots[aio->free_count++] = slot;
+}
+
+// Queue a completion for the caller (thread pool: called with the lock held)
+static void push_done(struct vdisk_aio *aio, uint64_t tag, int result) {
+    uint32_t idx = (aio->done_head + aio->done_count) % aio->depth;
+    aio->done[idx].tag = tag;
+    aio->done[idx].result = result;
+    aio->done_count++;
+}
+
+static int pop_done(struct vdisk_aio *aio, vdisk_completion *completions, int max) {
+    int n = 0;
+    while (n < max && aio->done_count > 0) {
+        completions[n++] = aio->done[aio->done_head];
+        aio->done_head = (aio->done_head + 1) % aio->depth;
+        aio->done_count--;
+    }
+    return n;
+}
+
+// Blocking transfer of one sector on the raw descriptor (thread pool)
+static int transfer_sector(DISK *diskp, aio_request *req) {
+    off_t offset = (off_t)req->sector * diskp->sector_size;
+    __atomic_fetch_add(&diskp->host_calls, 1, __ATOMIC_RELAXED);
+    ssize_t moved = req->is_write ? pwrite(diskp->fd, req->buffer, diskp->sector_size, offset)
+                                  : pread(diskp->fd, req->buffer, diskp->sector_size, offset);
+    return (moved == (ssize_t)diskp->sector_size) ? 0 : vdisk_ESECTOR;
+}
+
+/*************************/
+/* io_uring engine       */
+/*************************/
+
+#ifdef VDISK_HAVE_URING
+static int uring_setup(struct vdisk_aio *aio) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    aio->ring_fd = syscall(__NR_io_uring_setup, aio->depth, &params);
+    if (aio->ring_fd < 0) {
+        return -1;
+    }
+
+    aio->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cq_ring_len > aio->sq_ring_len) {
+            aio->sq_ring_len = aio->cq_ring_len;
+        }
+        aio->cq_ring_len = aio->sq_ring_len;
+    }
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        aio->ring_fd, IORING_OFF_SQ_RING);
+    if (aio->sq_ring == MAP_FAILED) {
+        close(aio->ring_fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->cq_ring = aio->sq_ring;
+    } else {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            aio->ring_fd, IORING_OFF_CQ_RING);
+        if (aio->cq_ring == MAP_FAILED) {
+            munmap(aio->sq_ring, aio->sq_ring_len);
+            close(aio->ring_fd);
+            return -1;
+        }
+    }
+
+    aio->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     aio->ring_fd, IORING_OFF_SQES);
+    if (aio->sqes == MAP_FAILED) {
+        if (aio->cq_ring != aio->sq_ring) {
+            munmap(aio->cq_ring, aio->cq_ring_len);
+        }
+        munmap(aio->sq_ring, aio->sq_ring_len);
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    uint8_t *sq = aio->sq_ring;
+    uint8_t *cq = aio->cq_ring;
+    aio->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)(sq + params.sq_off.array);
+    aio->cq_head = (unsigned *)(cq + params.cq_off.head);
+    aio->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    aio->unsubmitted = 0;
+    return 0;
+}
+
+static void uring_teardown(struct vdisk_aio *aio) {
+    munmap(aio->sqes, aio->sqes_len);
+    if (aio->cq_ring != aio->sq_ring) {
+        munmap(aio->cq_ring, aio->cq_ring_len);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_len);
+    close(aio->ring_fd);
+}
+
+// Queue an SQE for the slot; nothing reaches the kernel until uring_enter
+static void uring_queue(struct vdisk_aio *aio, DISK *diskp, uint32_t slot) {
+    aio_request *req = &aio->slots[slot];
+    req->iov.iov_base = req->buffer;
+    req->iov.iov_len = diskp->sector_size;
+
+    unsigned tail = *aio->sq_tail;
+    unsigned index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = diskp->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t)req->sector * diskp->sector_size;
+    sqe->user_data = slot;
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->unsubmitted++;
+}
+
+// Hand all queued SQEs to the kernel, optionally waiting for completions
+static int uring_enter(struct vdisk_aio *aio, DISK *diskp, unsigned min_complete) {
+    if (aio->unsubmitted == 0 && min_complete == 0) {
+        return 0;
+    }
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        diskp->host_calls++;
+        int ret = syscall(__NR_io_uring_enter, aio->ring_fd, aio->unsubmitted, min_complete, flags, NULL, 0);
+        if (ret >= 0) {
+            aio->unsubmitted -= ret;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return vdisk_ESECTOR;
+        }
+    }
+}
+
+static int uring_reap(struct vdisk_aio *aio, DISK *diskp, vdisk_completion *completions, int max) {
+    int n = 0;
+    unsigned head = *aio->cq_head;
+    unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    while (n < max && head != tail) {
+        struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+        uint32_t slot = (uint32_t)cqe->user_data;
+        completions[n].tag = aio->slots[slot].tag;
+        completions[n].result = (cqe->res == (int)diskp->sector_size) ? 0 : vdisk_ESECTOR;
+        release_slot(aio, slot);
+        n++;
+        head++;
+    }
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+#endif
+
+/*************************/
+/* Thread pool engine    */
+/*************************/
+
+static void *worker_main(void *arg) {
+    struct vdisk_aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->queue_count == 0 && !aio->stopping) {
+            pthread_cond_wait(&aio->work_cv, &aio->lock);
+        }
+        if (aio->queue_count == 0) {
+            break; // stopping and queue drained
+        }
+        uint32_t slot = aio->queue[aio->queue_head];
+        aio->queue_head = (aio->queue_head + 1) % aio->depth;
+        aio->queue_count--;
+        pthread_mutex_unlock(&aio->lock);
+
+        int result = transfer_sector(aio->diskp, &aio->slots[slot]);
+
+        pthread_mutex_lock(&aio->lock);
+        push_done(aio, aio->slots[slot].tag, result);
+        release_slot(aio, slot);
+        pthread_cond_signal(&aio->done_cv);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int pool_setup(struct vdisk_aio *aio) {
+    aio->queue = malloc(aio->depth * sizeof(uint32_t));
+    if (aio->queue == NULL) {
+        return -1;
+    }
+    aio->queue_head = 0;
+    aio->queue_count = 0;
+    aio->stopping = false;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work_cv, NULL);
+    pthread_cond_init(&aio->done_cv, NULL);
+
+    int wanted = aio->depth < VDISK_AIO_THREADS_MAX ? (int)aio->depth : VDISK_AIO_THREADS_MAX;
+    aio->num_threads = 0;
+    while (aio->num_threads < wanted) {
+        if (pthread_create(&aio->threads[aio->num_threads], NULL, worker_main, aio) != 0) {
+            break;
+        }
+        aio->num_threads++;
+    }
+    return aio->num_threads > 0 ? 0 : -1;
+}
+
+static void pool_teardown(struct vdisk_aio *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio->stopping = true;
+    pthread_cond_broadcast(&aio->work_cv);
+    pthread_mutex_unlock(&aio->lock);
+    for (int i = 0; i < aio->num_threads; i++) {
+        pthread_join(aio->threads[i], NULL);
+    }
+    pthread_cond_destroy(&aio->done_cv);
+    pthread_cond_destroy(&aio->work_cv);
+    pthread_mutex_destroy(&aio->lock);
+    free(aio->queue);
+}
+
+/*************************/
+/* Public API            */
+/*************************/
+
+int vdisk_aio_init(DISK *diskp, int engine, uint32_t queue_depth) {
+    if (diskp->aio != NULL) {
+        vdisk_aio_exit(diskp);
+    }
+    if (queue_depth == 0) {
+        queue_depth = VDISK_AIO_DEFAULT_DEPTH;
+    }
+
+    struct vdisk_aio *aio = calloc(1, sizeof(struct vdisk_aio));
+    if (aio == NULL) {
+        return -1;
+    }
+    aio->depth = queue_depth;
+    aio->diskp = diskp;
+    aio->done = malloc(queue_depth * sizeof(vdisk_completion));
+    aio->slots = malloc(queue_depth * sizeof(aio_request));
+    aio->free_slots = malloc(queue_depth * sizeof(uint32_t));
+    if (aio->done == NULL || aio->slots == NULL || aio->free_slots == NULL) {
+        free(aio->done);
+        free(aio->slots);
+        free(aio->free_slots);
+        free(aio);
+        return -1;
+    }
+    for (uint32_t i = 0; i < queue_depth; i++) {
+        aio->free_slots[i] = queue_depth - 1 - i;
+    }
+    aio->free_count = queue_depth;
+
+    // Only a raw descriptor supports concurrent positional I/O
+    if (diskp->mode != VDISK_MODE_PREAD && diskp->mode != VDISK_MODE_DIRECT) {
+        engine = VDISK_AIO_SYNC;
+    }
+
+    int result = -1;
+#ifdef VDISK_HAVE_URING
+    if (engine == VDISK_AIO_AUTO || engine == VDISK_AIO_URING) {
+        result = uring_setup(aio);
+        if (result == 0) {
+            engine = VDISK_AIO_URING;
+        } else if (engine == VDISK_AIO_AUTO) {
+            engine = VDISK_AIO_THREADS;
+        }
+    }
+#else
+    if (engine == VDISK_AIO_AUTO) {
+        engine = VDISK_AIO_THREADS;
+    }
+#endif
+    if (engine == VDISK_AIO_THREADS) {
+        result = pool_setup(aio);
+    } else if (engine == VDISK_AIO_SYNC) {
+        result = 0;
+    }
+
+    if (result != 0) {
+        free(aio->done);
+        free(aio->slots);
+        free(aio->free_slots);
+        free(aio);
+        return vdisk_EMODE;
+    }
+    aio->engine = engine;
+    diskp->aio = aio;
+    return 0;
+}
+
+// Engine in use (VDISK_AIO_*), setting up the default one if needed
+int vdisk_aio_engine(DISK *diskp) {
+    if (diskp->aio == NULL && vdisk_aio_init(diskp, VDISK_AIO_AUTO, 0) != 0) {
+        return -1;
+    }
+    return diskp->aio->engine;
+}
+
+static int submit(DISK *diskp, uint32_t sector, uint8_t *buffer, uint64_t tag, bool is_write) {
+    if (diskp->aio == NULL) {
+        int result = vdisk_aio_init(diskp, VDISK_AIO_AUTO, 0);
+        if (result != 0) {
+            return result;
+        }
+    }
+    struct vdisk_aio *aio = diskp->aio;
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+    if (aio->in_flight >= aio->depth) {
+        return vdisk_EBUSY; // reap completions first
+    }
+    if (diskp->mode == VDISK_MODE_DIRECT && aio->engine != VDISK_AIO_SYNC &&
+        ((uintptr_t)buffer % VDISK_DIRECT_ALIGN) != 0) {
+        return vdisk_EMODE; // O_DIRECT: use vdisk_buf_get or VDISK_BUF_ALIGN buffers
+    }
+
+    if (aio->engine == VDISK_AIO_SYNC) {
+        int result = is_write ? vdisk_write(diskp, sector, buffer) : vdisk_read(diskp, sector, buffer);
+        push_done(aio, tag, result);
+        aio->in_flight++;
+        return 0;
+    }
+
+    // Keep the sector cache coherent with the transfer going around it
+    if (is_write) {
+        vdisk_cache_drop(diskp, sector, 1);
+    } else {
+        int result = vdisk_cache_clean(diskp, sector, 1);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    if (aio->engine == VDISK_AIO_THREADS) {
+        pthread_mutex_lock(&aio->lock);
+    }
+    int slot = alloc_slot(aio);
+    if (slot < 0) {
+        // Completed but unreaped requests still hold no slot, so this only
+        // happens when the caller exceeded the depth
+        if (aio->engine == VDISK_AIO_THREADS) {
+            pthread_mutex_unlock(&aio->lock);
+        }
+        return vdisk_EBUSY;
+    }
+    aio_request *req = &aio->slots[slot];
+    req->sector = sector;
+    req->buffer = buffer;
+    req->tag = tag;
+    req->is_write = is_write;
+    aio->in_flight++;
+
+#ifdef VDISK_HAVE_URING
+    if (aio->engine == VDISK_AIO_URING) {
+        uring_queue(aio, diskp, slot);
+        return 0;
+    }
+#endif
+
+    aio->queue[(aio->queue_head + aio->queue_count) % aio->depth] = slot;
+    aio->queue_count++;
+    pthread_cond_signal(&aio->work_cv);
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+}
+
+int vdisk_submit_read(DISK *diskp, uint32_t sector, uint8_t *buffer, uint64_t tag) {
+    return submit(diskp, sector, buffer, tag, false);
+}
+
+int vdisk_submit_write(DISK *diskp, uint32_t sector, uint8_t *buffer, uint64_t tag) {
+    return submit(diskp, sector, buffer, tag, true);
+}
+
+// Collect up to `max` completions, blocking until at least `min_wait` (capped
+// at the # of requests in flight) are available. Returns the # collected or
+// a negative error
+int vdisk_complete(DISK *diskp, vdisk_completion *completions, int max, int min_wait) {
+    struct vdisk_aio *aio = diskp->aio;
+    if (aio == NULL) {
+        return 0;
+    }
+    if (min_wait > (int)aio->in_flight) {
+        min_wait = aio->in_flight;
+    }
+    if (min_wait > max) {
+        min_wait = max;
+    }
+
+    int n = 0;
+    if (aio->engine == VDISK_AIO_SYNC) {
+        n = pop_done(aio, completions, max);
+    }
+#ifdef VDISK_HAVE_URING
+    else if (aio->engine == VDISK_AIO_URING) {
+        n = uring_reap(aio, diskp, completions, max);
+        if (n < min_wait || aio->unsubmitted > 0) {
+            int result = uring_enter(aio, diskp, n < min_wait ? min_wait - n : 0);
+            if (result != 0) {
+                return result;
+            }
+            n += uring_reap(aio, diskp, completions + n, max - n);
+        }
+    }
+#endif
+    else {
+        pthread_mutex_lock(&aio->lock);
+        for (;;) {
+            n += pop_done(aio, completions + n, max - n);
+            if (n >= min_wait) {
+                break;
+            }
+            pthread_cond_wait(&aio->done_cv, &aio->lock);
+        }
+        pthread_mutex_unlock(&aio->lock);
+    }
+
+    aio->in_flight -= n;
+    return n;
+}
+
+void vdisk_aio_exit(DISK *diskp) {
+    struct vdisk_aio *aio = diskp->aio;
+    if (aio == NULL) {
+        return;
+    }
+
+    // Drain requests still in flight so no buffer is touched afterwards
+    vdisk_completion drained[16];
+    while (aio->in_flight > 0) {
+        if (vdisk_complete(diskp, drained, 16, 1) < 0) {
+            break;
+        }
+    }
+
+#ifdef VDISK_HAVE_URING
+    if (aio->engine == VDISK_AIO_URING) {
+        uring_teardown(aio);
+    }
+#endif
+    if (aio->engine == VDISK_AIO_THREADS) {
+        pool_teardown(aio);
+    }
+    free(aio->done);
+    free(aio->slots);
+    free(aio->free_slots);
+    free(aio);
+    diskp->aio = NULL;
+}
@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../include/error.h"
+#include "../include/vdisk.h"
+
+/*
+ * Sector cache.
+ *
+ * Write-back cache of whole sectors in front of vdisk_read/vdisk_write, with
+ * the memory budget given to vdisk_cache_init. Sectors are found through a
+ * hash table; dirty sectors are written back when evicted, on
+ * vdisk_cache_flush and on vdisk_sync.
+ *
+ * Replacement is either plain LRU or 2Q (the default), which resists scans:
+ * - A1in: FIFO of sectors touched once, at most 1/4 of the cache. A sequential
+ *   pass only ever cycles through this queue.
+ * - A1out: sector #s (no data) recently pushed out of A1in, 1/2 of the cache.
+ * - Am: LRU of sectors asked for again after leaving A1in, plus every sector
+ *   read or written through vdisk_read_meta/vdisk_write_meta: file system
+ *   metadata goes straight to the protected queue.
+ * Victims come from A1in while it is over its share, from Am otherwise. With
+ * LRU, everything lives in Am.
+ *
+ * Multi-sector and async transfers go around the cache: reads first write
+ * back the dirty sectors they cover (vdisk_cache_clean), writes drop the
+ * cached copies they replace (vdisk_cache_drop).
+ *
+ * The mmap backend is never cached, the mapping already is one.
+ */
+
+#define NO_ENTRY UINT32_MAX
+
+// Queues an entry can be on
+#define Q_A1IN  0
+#define Q_AM    1
+#define Q_A1OUT 2 // ghost: sector # only
+#define Q_COUNT 3
+
+typedef struct {
+    uint32_t sector;
+    bool dirty;
+    uint8_t queue;      // Q_*
+    uint32_t slot;      // Data slot of a resident entry
+    uint32_t hash_next; // Next entry in the same bucket, or in the free list
+    uint32_t prev;      // Queue neighbours, towards the most recent
+    uint32_t next;      // ... and towards the next to leave
+} cache_entry;
+
+typedef struct {
+    uint32_t head; // Most recent
+    uint32_t tail; // Next to leave
+    uint32_t count;
+} cache_queue;
+
+struct vdisk_cache {
+    int policy;           // VDISK_CACHE_LRU or VDISK_CACHE_2Q
+    uint32_t capacity;    // # of sectors the budget holds
+    uint32_t in_max;      // Max # of sectors on A1in
+    uint32_t out_max;     // Max # of ghosts on A1out
+    uint32_t bucket_mask; // # of buckets - 1 (power of 2)
+    uint32_t *buckets;
+    cache_entry *entries; // capacity + out_max of them
+    uint32_t free_head;   // Unused entries, chained through hash_next
+    uint8_t *data;        // Slot i at data + i * sector_size
+    uint32_t *free_slots; // Stack of unused slots
+    uint32_t free_slot_count;
+    cache_queue queues[Q_COUNT];
+    uint32_t dirty_count;
+};
+
+/*************************/
+/* Lookup and queues     */
+/*************************/
+
+static uint32_t bucket_of(struct vdisk_cache *cache, uint32_t sector) {
+    return (sector * 2654435761u) & cache->bucket_mask;
+}
+
+// Entry for `sector`, resident or ghost
+static uint32_t find(struct vdisk_cache *cache, uint32_t sector) {
+    uint32_t idx = cache->buckets[bucket_of(cache, sector)];
+    while (idx != NO_ENTRY && cache->entries[idx].sector != sector) {
+        idx = cache->entries[idx].hash_next;
+    }
+    return idx;
+}
+
+// Resident entry for `sector`
+static uint32_t find_resident(struct vdisk_cache *cache, uint32_t sector) {
+    uint32_t idx = find(cache, sector);
+    return (idx != NO_ENTRY && cache->entries[idx].queue != Q_A1OUT) ? idx : NO_ENTRY;
+}
+
+static void queue_unlink(struct vdisk_cache *cache, uint32_t idx) {
+    cache_entry *entry = &cache->entries[idx];
+    cache_queue *queue = &cache->queues[entry->queue];
+    if (entry->prev != NO_ENTRY) {
+        cache->entries[entry->prev].next = entry->next;
+    } else {
+        queue->head = entry->next;
+    }
+    if (entry->next != NO_ENTRY) {
+        cache->entries[entry->next].prev = entry->prev;
+    } else {
+        queue->tail = entry->prev;
+    }
+    queue->count--;
+}
+
+static void queue_push(struct vdisk_cache *cache, uint32_t idx, uint8_t q) {
+    cache_entry *entry = &cache->entries[idx];
+    cache_queue *queue = &cache->queues[q];
+    entry->queue = q;
+    entry->prev = NO_ENTRY;
+    entry->next = queue->head;
+    if (queue->head != NO_ENTRY) {
+        cache->entries[queue->head].prev = idx;
+    } else {
+        queue->tail = idx;
+    }
+    queue->head = idx;
+    queue->count++;
+}
+
+static void hash_remove(struct vdisk_cache *cache, uint32_t idx) {
+    uint32_t *link = &cache->buckets[bucket_of(cache, cache->entries[idx].sector)];
+    while (*link != idx) {
+        link = &cache->entries[*link].hash_next;
+    }
+    *link = cache->entries[idx].hash_next;
+}
+
+static uint8_t *entry_data(DISK *diskp, uint32_t idx) {
+    struct vdisk_cache *cache = diskp->cache;
+    return cache->data + (size_t)cache->entries[idx].slot * diskp->sector_size;
+}
+
+/*************************/
+/* Entries               */
+/*************************/
+
+static int write_back(DISK *diskp, uint32_t idx) {
+    struct vdisk_cache *cache = diskp->cache;
+    cache_entry *entry = &cache->entries[idx];
+    if (!entry->dirty) {
+        return 0;
+    }
+    int err = vdisk_write_uncached(diskp, entry->sector, entry_data(diskp, idx));
+    if (err == 0) {
+        entry->dirty = false;
+        cache->dirty_count--;
+    }
+    return err;
+}
+
+// Give back the data slot of a resident entry, without writing it back
+static void release_slot(struct vdisk_cache *cache, uint32_t idx) {
+    if (cache->entries[idx].dirty) {
+        cache->dirty_count--;
+        cache->entries[idx].dirty = false;
+    }
+    cache->free_slots[cache->free_slot_count++] = cache->entries[idx].slot;
+}
+
+// Forget an entry (resident or ghost) without writing it back
+static void drop_entry(struct vdisk_cache *cache, uint32_t idx) {
+    if (cache->entries[idx].queue != Q_A1OUT) {
+        release_slot(cache, idx);
+    }
+    hash_remove(cache, idx);
+    queue_unlink(cache, idx);
+    cache->entries[idx].hash_next = cache->free_head;
+    cache->free_head = idx;
+}
+
+// Free a data slot by evicting a resident sector: the oldest of A1in while
+// A1in is over its share (it then lives on as a ghost), else the least
+// recently used of Am
+static int evict(DISK *diskp) {
+    struct vdisk_cache *cache = diskp->cache;
+    cache_queue *in = &cache->queues[Q_A1IN];
+    bool from_in = in->count > 0 && (in->count > cache->in_max || cache->queues[Q_AM].count == 0);
+    uint32_t victim = from_in ? in->tail : cache->queues[Q_AM].tail;
+
+    int err = write_back(diskp, victim);
+    if (err) {
+        return err;
+    }
+    if (!from_in || cache->out_max == 0) {
+        drop_entry(cache, victim);
+        return 0;
+    }
+
+    release_slot(cache, victim);
+    queue_unlink(cache, victim);
+    queue_push(cache, victim, Q_A1OUT);
+    if (cache->queues[Q_A1OUT].count > cache->out_max) {
+        drop_entry(cache, cache->queues[Q_A1OUT].tail);
+    }
+    return 0;
+}
+
+// Make `sector` resident after a miss. A sector remembered on A1out, metadata
+// and every sector under LRU go to Am, others to A1in. The entry is clean and
+// its data is left for the caller to fill
+static int admit(DISK *diskp, uint32_t sector, bool meta, uint32_t *idxp) {
+    struct vdisk_cache *cache = diskp->cache;
+    if (cache->free_slot_count == 0) {
+        int err = evict(diskp);
+        if (err) {
+            return err;
+        }
+    }
+
+    uint32_t idx = find(cache, sector); // a ghost, if anything
+    bool ghost = idx != NO_ENTRY;
+    if (ghost) {
+        queue_unlink(cache, idx);
+    } else {
+        idx = cache->free_head;
+        cache->free_head = cache->entries[idx].hash_next;
+        cache->entries[idx].sector = sector;
+        uint32_t bucket = bucket_of(cache, sector);
+        cache->entries[idx].hash_next = cache->buckets[bucket];
+        cache->buckets[bucket] = idx;
+    }
+
+    cache_entry *entry = &cache->entries[idx];
+    entry->dirty = false;
+    entry->slot = cache->free_slots[--cache->free_slot_count];
+    queue_push(cache, idx, (ghost || meta || cache->policy == VDISK_CACHE_LRU) ? Q_AM : Q_A1IN);
+    *idxp = idx;
+    return 0;
+}
+
+// Look `sector` up for an access, counting the hit or miss. A hit on Am
+// makes it the most recently used; A1in stays in FIFO order, except that
+// metadata is promoted to Am
+static int lookup(DISK *diskp, uint32_t sector, bool meta, bool *hit, uint32_t *idxp) {
+    struct vdisk_cache *cache = diskp->cache;
+    uint32_t idx = find_resident(cache, sector);
+    *hit = idx != NO_ENTRY;
+    if (!*hit) {
+        diskp->cache_misses++;
+        return admit(diskp, sector, meta, idxp);
+    }
+
+    diskp->cache_hits++;
+    if (cache->entries[idx].queue == Q_AM || meta) {
+        queue_unlink(cache, idx);
+        queue_push(cache, idx, Q_AM);
+    }
+    *idxp = idx;
+    return 0;
+}
+
+/*************************/
+/* Cached sector I/O     */
+/*************************/
+
+// `meta`: the sector holds file system metadata (see vdisk_read_meta)
+int vdisk_cache_read(DISK *diskp, uint32_t sector, uint8_t *buffer, bool meta) {
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+
+    bool hit;
+    uint32_t idx;
+    int err = lookup(diskp, sector, meta, &hit, &idx);
+    if (err) {
+        return err;
+    }
+    if (!hit) {
+        err = vdisk_read_uncached(diskp, sector, entry_data(diskp, idx));
+        if (err) {
+            drop_entry(diskp->cache, idx);
+            return err;
+        }
+    }
+    memcpy(buffer, entry_data(diskp, idx), diskp->sector_size);
+    return 0;
+}
+
+// Whole sectors are written: a miss takes an entry without reading the disk
+int vdisk_cache_write(DISK *diskp, uint32_t sector, uint8_t *buffer, bool meta) {
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+
+    bool hit;
+    uint32_t idx;
+    int err = lookup(diskp, sector, meta, &hit, &idx);
+    if (err) {
+        return err;
+    }
+    memcpy(entry_data(diskp, idx), buffer, diskp->sector_size);
+    cache_entry *entry = &diskp->cache->entries[idx];
+    if (!entry->dirty) {
+        entry->dirty = true;
+        diskp->cache->dirty_count++;
+    }
+    return 0;
+}
+
+// Write back the dirty cached sectors among `count` sectors from `sector`
+// (before the range is read around the cache)
+int vdisk_cache_clean(DISK *diskp, uint32_t sector, uint32_t count) {
+    struct vdisk_cache *cache = diskp->cache;
+    if (cache == NULL || cache->dirty_count == 0) {
+        return 0;
+    }
+
+    // Walk whichever is shorter: the range or the cache
+    if (count <= cache->capacity) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t idx = find_resident(cache, sector + i);
+            if (idx != NO_ENTRY) {
+                int err = write_back(diskp, idx);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+        return 0;
+    }
+    for (int q = Q_A1IN; q <= Q_AM; q++) {
+        for (uint32_t idx = cache->queues[q].head; idx != NO_ENTRY; idx = cache->entries[idx].next) {
+            if (cache->entries[idx].sector - sector < count) {
+                int err = write_back(diskp, idx);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Drop the cached copies of `count` sectors from `sector` (before the range
+// is overwritten around the cache)
+void vdisk_cache_drop(DISK *diskp, uint32_t sector, uint32_t count) {
+    struct vdisk_cache *cache = diskp->cache;
+    if (cache == NULL || cache->free_slot_count == cache->capacity) {
+        return;
+    }
+
+    if (count <= cache->capacity) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t idx = find_resident(cache, sector + i);
+            if (idx != NO_ENTRY) {
+                drop_entry(cache, idx);
+            }
+        }
+        return;
+    }
+    for (int q = Q_A1IN; q <= Q_AM; q++) {
+        uint32_t idx = cache->queues[q].head;
+        while (idx != NO_ENTRY) {
+            uint32_t next = cache->entries[idx].next;
+            if (cache->entries[idx].sector - sector < count) {
+                drop_entry(cache, idx);
+            }
+            idx = next;
+        }
+    }
+}
+
+// Write back every dirty sector. Returns the first error, if any
+int vdisk_cache_flush(DISK *diskp) {
+    struct vdisk_cache *cache = diskp->cache;
+    if (cache == NULL) {
+        return 0;
+    }
+
+    int first_err = 0;
+    for (int q = Q_A1IN; q <= Q_AM; q++) {
+        for (uint32_t idx = cache->queues[q].head; idx != NO_ENTRY && cache->dirty_count > 0;
+             idx = cache->entries[idx].next) {
+            int err = write_back(diskp, idx);
+            if (err && first_err == 0) {
+                first_err = err;
+            }
+        }
+    }
+    return first_err;
+}
+
+/*************************/
+/* Setup and teardown    */
+/*************************/
+
+// Cache up to `budget` bytes of sectors (0 turns the cache off), replaced
+// with `policy` (VDISK_CACHE_*). Any previous cache is flushed and replaced
+int vdisk_cache_init(DISK *diskp, size_t budget, int policy) {
+    vdisk_cache_exit(diskp);
+    uint32_t capacity = budget / diskp->sector_size;
+    if (capacity == 0 || diskp->mode == VDISK_MODE_MMAP) {
+        return 0;
+    }
+    if (policy != VDISK_CACHE_LRU && policy != VDISK_CACHE_2Q) {
+        return vdisk_EMODE;
+    }
+
+    struct vdisk_cache *cache = calloc(1, sizeof(struct vdisk_cache));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->policy = policy;
+    cache->capacity = capacity;
+    if (policy == VDISK_CACHE_2Q) {
+        cache->in_max = (capacity / 4 > 0) ? capacity / 4 : 1;
+        cache->out_max = capacity / 2;
+    }
+    uint32_t num_entries = capacity + cache->out_max;
+    uint32_t num_buckets = 1;
+    while (num_buckets < num_entries) {
+        num_buckets <<= 1;
+    }
+
+    void *data = NULL;
+    cache->buckets = malloc(num_buckets * sizeof(uint32_t));
+    cache->entries = malloc(num_entries * sizeof(cache_entry));
+    cache->free_slots = malloc(capacity * sizeof(uint32_t));
+    if (cache->buckets == NULL || cache->entries == NULL || cache->free_slots == NULL ||
+        posix_memalign(&data, VDISK_BUF_ALIGN, (size_t)capacity * diskp->sector_size) != 0) {
+        free(cache->buckets);
+        free(cache->entries);
+        free(cache->free_slots);
+        free(cache);
+        return -1;
+    }
+
+    cache->data = data;
+    cache->bucket_mask = num_buckets - 1;
+    memset(cache->buckets, 0xff, num_buckets * sizeof(uint32_t)); // all NO_ENTRY
+    for (uint32_t i = 0; i < num_entries; i++) {
+        cache->entries[i].hash_next = (i + 1 < num_entries) ? i + 1 : NO_ENTRY;
+    }
+    cache->free_head = 0;
+    for (uint32_t i = 0; i < capacity; i++) {
+        cache->free_slots[i] = capacity - 1 - i;
+    }
+    cache->free_slot_count = capacity;
+    for (int q = 0; q < Q_COUNT; q++) {
+        cache->queues[q].head = NO_ENTRY;
+        cache->queues[q].tail = NO_ENTRY;
+    }
+    diskp->cache = cache;
+    return 0;
+}
+
+// Flush and free the cache (write-back errors are lost: vdisk_sync first to
+// see them)
+void vdisk_cache_exit(DISK *diskp) {
+    struct vdisk_cache *cache = diskp->cache;
+    if (cache == NULL) {
+        return;
+    }
+    vdisk_cache_flush(diskp);
+    free(cache->data);
+    free(cache->free_slots);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+    diskp->cache = NULL;
+}